@@ -0,0 +1,136 @@
+#include <cstdlib>
+#include <new>
+#include "bsg.h"
+#include "bsgMenagerie.h"
+
+// This program checks that drawing a frame needs no memory from the
+// heap.  It replaces the global operator new with one that counts the
+// calls, draws a scene that keeps moving, and reports how many
+// allocations were made once things have settled down.  Allocating
+// memory every frame is slow, and makes the frame times uneven, so
+// the count should be zero.  The program exits with an error status
+// if it isn't, so this can be used as a test.
+
+// Every allocation in the program, including the library's, goes
+// through here.
+static size_t allocationCount = 0;
+
+void* operator new(size_t size) {
+  allocationCount++;
+  void* out = malloc(size ? size : 1);
+  if (!out) throw std::bad_alloc();
+  return out;
+}
+
+void operator delete(void* ptr) noexcept {
+  free(ptr);
+}
+
+bsg::scene scene = bsg::scene();
+bsg::drawableCompound* cube;
+
+// The first few frames are allowed to allocate, since that's when
+// buffers are created and things are loaded.  The count is taken over
+// the frames after that.
+const int settlingFrames = 10;
+const int countedFrames = 100;
+int frame = 0;
+size_t allocationsBefore = 0;
+
+void init(int argc, char** argv) {
+
+  glutInit(&argc, argv);
+  glutInitDisplayMode(GLUT_DEPTH | GLUT_DOUBLE | GLUT_RGBA);
+}
+
+void renderScene() {
+
+  if (frame == settlingFrames) allocationsBefore = allocationCount;
+
+  if (frame == settlingFrames + countedFrames) {
+    size_t allocations = allocationCount - allocationsBefore;
+    std::cout << allocations << " allocations in " << countedFrames
+              << " frames." << std::endl;
+    exit(allocations > 0 ? 1 : 0);
+  }
+
+  // Keep something moving, so the world matrices and bounds have to
+  // be recalculated.
+  cube->setPosition(glm::vec3(sin(0.1f * frame), 0.0f, 0.0f));
+  cube->setRotation(glm::vec3(0.0f, 0.05f * frame, 0.0f));
+
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+  // Two views, the way a stereo display would draw them.
+  scene.load();
+  scene.draw(scene.getViewMatrix(), scene.getProjMatrix());
+  scene.draw(scene.getViewMatrix(), scene.getProjMatrix());
+
+  glutSwapBuffers();
+  frame++;
+}
+
+void makeWindow(const int xOffset, const int yOffset,
+                const int xWidth, const int yWidth) {
+
+  glutInitWindowPosition(xOffset, yOffset);
+  glutInitWindowSize(xWidth, yWidth);
+  glutCreateWindow("Allocation Count");
+
+  glutDisplayFunc(renderScene);
+  glutIdleFunc(renderScene);
+
+  glewExperimental = true; // Needed for core profile
+  if (glewInit() != GLEW_OK) {
+    throw std::runtime_error("Failed to initialize GLEW");
+  }
+
+  if (!glewIsSupported("GL_VERSION_2_1")) {
+    throw std::runtime_error("Software check: OpenGL 2.1 not supported.");
+  }
+
+  glClearColor(0.1 , 0.0, 0.4, 1.0);
+  glEnable(GL_DEPTH_TEST);
+  glEnable(GL_CULL_FACE);
+}
+
+int main(int argc, char **argv) {
+
+  init(argc, argv);
+  makeWindow(100, 100, 400, 400);
+
+  if (argc < 3) {
+    throw std::runtime_error("\nNeed two args: the names of a vertex and fragment shader.\nTry 'bin/allocDemo ../shaders/shader2.vp ../shaders/shader.fp'.");
+  }
+
+  bsg::bsgPtr<bsg::lightList> lights = new bsg::lightList();
+  lights->addLight(glm::vec4(10.0f, 10.0f, 10.0f, 1.0f),
+                   glm::vec4(1.0f, 1.0f, 0.0f, 0.0f));
+  lights->addLight(glm::vec4(10.0f,-10.0f, 10.0f, 1.0f),
+                   glm::vec4(0.0f, 1.0f, 1.0f, 0.0f));
+
+  bsg::bsgPtr<bsg::shaderMgr> shader = new bsg::shaderMgr();
+  shader->addLights(lights);
+  shader->addShader(bsg::GLSHADER_VERTEX, std::string(argv[1]));
+  shader->addShader(bsg::GLSHADER_FRAGMENT, std::string(argv[2]));
+  shader->compileShaders();
+
+  cube = new bsg::drawableCube(shader, 5, glm::vec4(1.0f, 0.0f, 0.0f, 1.0f));
+  scene.addObject(cube);
+
+  bsg::drawableSphere* sphere =
+    new bsg::drawableSphere(shader, 16, 16, glm::vec4(0.0f, 1.0f, 0.0f, 1.0f));
+  sphere->setPosition(glm::vec3(3.0f, 0.0f, 0.0f));
+  scene.addObject(sphere);
+
+  scene.addObject(new bsg::drawableAxes(shader, 10.0f));
+
+  scene.setLookAtPosition(glm::vec3(0.0f, 0.0f, 0.0f));
+  scene.setCameraPosition(glm::vec3(1.0f, 2.0f, 7.5f));
+
+  scene.prepare();
+
+  glutMainLoop();
+
+  return(0);
+}
@@ -29,6 +29,10 @@ void main() {
 
   vec4 color = 0.05 * colorFrag;
   //vec4 color = vec4(0,0,0,0);
+
+  // The back of a two-sided surface faces the other way from its
+  // normals, so turn them around.  (See drawableObj::setTwoSided().)
+  vec4 normal = gl_FrontFacing ? normalCS : -normalCS;
   
   // The lighting effects are additive, so we run through the lights,
   // and add their effects.
@@ -45,13 +49,13 @@ void main() {
     //  - light is at the vertical of the triangle -> 1
     //  - light is perpendicular to the triangle -> 0
     //  - light is behind the triangle -> 0
-    float cosAngleFromNormal = max(0.0, dot(normalCS, lightDirectionCS[i]));
+    float cosAngleFromNormal = max(0.0, dot(normal, lightDirectionCS[i]));
 
     // Diffuse : "color" of the object
     vec4 diffuse = materialColor * lightColor[i] * cosAngleFromNormal;
     
     // Direction in which the triangle reflects the light
-    vec4 reflectDir = reflect(-lightDirectionCS[i], normalCS);
+    vec4 reflectDir = reflect(-lightDirectionCS[i], normal);
 
     // Cosine of the angle between the Eye vector and the Reflect vector,
     // clamped to remain above 0.
@@ -1,11 +1,30 @@
 #include "bsg.h"
+#include <sstream>
+#include <glm/gtc/packing.hpp>
 
-// Stb Image library
+// Stb Image library.  Images are decoded on several threads at once,
+// and its failure reasons are kept in a global, so we do without them.
 #define STB_IMAGE_IMPLEMENTATION
+#define STBI_NO_FAILURE_STRINGS
+#if defined(__GNUC__)
+// Without the strings, some of its error checks are statements that
+// do nothing.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-value"
+#endif
 #include "stb_image.h"
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
 
 #define BUFFER_OFFSET(i) ((char *)NULL + (i))
 
+// The ray casting uses SSE to test four triangles at once, if it can.
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define BSG_USE_SSE
+#include <xmmintrin.h>
+#endif
+
 namespace bsg {
 
 void bsgUtils::printMat(const std::string& name, const glm::mat4& mat) {
@@ -45,10 +64,10 @@ void lightList::draw() {
   if (_lightPositions.size() > 0) {
     glUniform4fv(_lightPositions.ID,
                  _lightPositions.size(),
-                 &_lightPositions.getData()[0].x);
+                 &_lightPositions.beginAddress()->x);
     glUniform4fv(_lightColors.ID,
                  _lightColors.size(),
-                 &_lightColors.getData()[0].x);
+                 &_lightColors.beginAddress()->x);
   }
 }
 
@@ -56,7 +75,11 @@ void textureMgr::readFile(const textureType& type, const std::string& fileName)
 
   switch(type) {
   case textureDDS:
-    throw std::runtime_error("still working on DDS, try PNG");
+    _textureBufferID = _loadDDS(fileName);
+    break;
+
+  case textureKTX:
+    _textureBufferID = _loadKTX(fileName);
     break;
 
   case textureBMP:
@@ -116,6 +139,425 @@ GLuint textureMgr::_loadCheckerBoard (const int size, int numFields) {
 }
 
 
+// Reads an image file into RGBA pixels, bottom row first, as OpenGL
+// wants them.  Any image is made RGBA, so rows are always a multiple
+// of four bytes long.  Free the pixels with stbi_image_free().
+// Returns NULL if the file can't be read.  This is called from the
+// texture loader's threads, too.
+static unsigned char* decodeImage(const std::string &fileName,
+                                  int &width, int &height) {
+
+  int components;
+  unsigned char* pixels = stbi_load(fileName.c_str(), &width, &height,
+                                    &components, STBI_rgb_alpha);
+  if (!pixels) return NULL;
+
+  // Stb loads images upside down (as OpenGL sees it).  It can flip
+  // them itself, but the setting is a global, which the threads would
+  // all be touching at once, so we swap the rows here.
+  size_t rowSize = 4 * (size_t)width;
+  for (int top = 0, bottom = height - 1; top < bottom; top++, bottom--) {
+    std::swap_ranges(pixels + top * rowSize, pixels + (top + 1) * rowSize,
+                     pixels + bottom * rowSize);
+  }
+
+  return pixels;
+}
+
+bool textureMgr::_mipmaps = true;
+float textureMgr::_maxAnisotropy = 1.0f;
+
+// Sets the sampling of the bound texture.  Mipmapped textures are
+// filtered between the levels, and maybe anisotropically.  Others are
+// sampled as they always were.
+static void setTextureFiltering(const bool &mipmapped) {
+
+  if (!mipmapped) {
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    return;
+  }
+
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+  if ((textureMgr::getMaxAnisotropy() > 1.0f) &&
+      GLEW_EXT_texture_filter_anisotropic) {
+    GLfloat limit = 1.0f;
+    glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &limit);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT,
+                    std::min(textureMgr::getMaxAnisotropy(), limit));
+  }
+}
+
+// Makes the rest of the mipmap levels of the bound texture from the
+// first, if we're making mipmaps and OpenGL can.  Returns whether it
+// did.
+static bool generateMipmaps() {
+
+  if (!textureMgr::getMipmaps()) return false;
+
+  if (GLEW_VERSION_3_0 || GLEW_ARB_framebuffer_object) {
+    glGenerateMipmap(GL_TEXTURE_2D);
+  } else if (GLEW_EXT_framebuffer_object) {
+    glGenerateMipmapEXT(GL_TEXTURE_2D);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Puts RGBA pixels into a texture.  The pixels can also be an offset
+// into the bound GL_PIXEL_UNPACK_BUFFER.
+static void setTextureImage(const GLuint &texture, const int &width,
+                            const int &height, const void* pixels) {
+
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height,
+               0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+  setTextureFiltering(generateMipmaps());
+}
+
+// One mipmap level of an image that is loaded as it is in the file.
+struct textureLevel {
+  GLsizei width, height, size;
+  const char* data;
+};
+
+// Puts a chain of mipmap levels into a texture.  A type of zero means
+// the data is compressed, in the internal format, and goes straight
+// to the graphics card.  Otherwise it is in the format and type.
+static void setTextureLevels(const GLuint &texture,
+                             const GLenum &internalFormat,
+                             const GLenum &format, const GLenum &type,
+                             const std::vector<textureLevel> &levels) {
+
+  glBindTexture(GL_TEXTURE_2D, texture);
+  for (size_t i = 0; i < levels.size(); i++) {
+    const textureLevel &level = levels[i];
+    if (type == 0) {
+      glCompressedTexImage2D(GL_TEXTURE_2D, i, internalFormat,
+                             level.width, level.height, 0,
+                             level.size, level.data);
+    } else {
+      glTexImage2D(GL_TEXTURE_2D, i, internalFormat,
+                   level.width, level.height, 0, format, type, level.data);
+    }
+  }
+
+  // The chain needn't go all the way down to 1x1.
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels.size() - 1);
+  setTextureFiltering(levels.size() > 1);
+}
+
+// Reads a whole file into memory.
+static void readWholeFile(const std::string &fileName,
+                          std::vector<char> &contents) {
+
+  std::ifstream file(fileName.c_str(), std::ios::binary);
+  if (!file) throw std::runtime_error("could not open " + fileName);
+
+  file.seekg(0, std::ios::end);
+  contents.resize((size_t)file.tellg());
+  file.seekg(0, std::ios::beg);
+  if (!contents.empty()) file.read(&contents[0], contents.size());
+  if (!file) throw std::runtime_error("could not read " + fileName);
+}
+
+static inline uint32_t readUint32(const std::vector<char> &contents,
+                                  const size_t &offset) {
+  uint32_t out;
+  memcpy(&out, &contents[offset], sizeof(out));
+  return out;
+}
+
+// How many levels there are in a full mipmap chain for an image this
+// big, down to 1x1.  A file that claims more is padded or broken, and
+// OpenGL would refuse the extra levels anyway.
+static uint32_t mipmapLevels(const GLsizei &width, const GLsizei &height) {
+
+  uint32_t levels = 1;
+  for (GLsizei size = std::max(width, height); size > 1; size >>= 1) levels++;
+  return levels;
+}
+
+// How many bytes a pixel of uncompressed data takes, in this format
+// and type.  Zero means we don't know.
+static uint64_t pixelBytes(const GLenum &format, const GLenum &type) {
+
+  // The packed types hold a whole pixel.
+  switch (type) {
+  case GL_UNSIGNED_BYTE_3_3_2:
+  case GL_UNSIGNED_BYTE_2_3_3_REV:
+    return 1;
+  case GL_UNSIGNED_SHORT_5_6_5:
+  case GL_UNSIGNED_SHORT_5_6_5_REV:
+  case GL_UNSIGNED_SHORT_4_4_4_4:
+  case GL_UNSIGNED_SHORT_4_4_4_4_REV:
+  case GL_UNSIGNED_SHORT_5_5_5_1:
+  case GL_UNSIGNED_SHORT_1_5_5_5_REV:
+    return 2;
+  case GL_UNSIGNED_INT_8_8_8_8:
+  case GL_UNSIGNED_INT_8_8_8_8_REV:
+  case GL_UNSIGNED_INT_10_10_10_2:
+  case GL_UNSIGNED_INT_2_10_10_10_REV:
+  case GL_UNSIGNED_INT_10F_11F_11F_REV:
+  case GL_UNSIGNED_INT_5_9_9_9_REV:
+    return 4;
+  }
+
+  uint64_t componentBytes = 0;
+  switch (type) {
+  case GL_UNSIGNED_BYTE:
+  case GL_BYTE:
+    componentBytes = 1;
+    break;
+  case GL_UNSIGNED_SHORT:
+  case GL_SHORT:
+  case GL_HALF_FLOAT:
+    componentBytes = 2;
+    break;
+  case GL_UNSIGNED_INT:
+  case GL_INT:
+  case GL_FLOAT:
+    componentBytes = 4;
+    break;
+  }
+
+  switch (format) {
+  case GL_RED:
+  case GL_RED_INTEGER:
+  case GL_ALPHA:
+  case GL_LUMINANCE:
+  case GL_DEPTH_COMPONENT:
+    return componentBytes;
+  case GL_RG:
+  case GL_RG_INTEGER:
+  case GL_LUMINANCE_ALPHA:
+    return 2 * componentBytes;
+  case GL_RGB:
+  case GL_BGR:
+  case GL_RGB_INTEGER:
+    return 3 * componentBytes;
+  case GL_RGBA:
+  case GL_BGRA:
+  case GL_RGBA_INTEGER:
+    return 4 * componentBytes;
+  default:
+    return 0;
+  }
+}
+
+// Can this OpenGL context take images compressed this way?
+static bool compressedFormatSupported(const GLenum &format) {
+
+  switch (format) {
+  case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+  case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+  case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT:
+  case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+    return GLEW_EXT_texture_compression_s3tc;
+  case GL_COMPRESSED_RGBA_BPTC_UNORM_ARB:
+    return GLEW_ARB_texture_compression_bptc;
+  default:
+    // We don't know, so let OpenGL decide.
+    return true;
+  }
+}
+
+GLuint textureMgr::_loadDDS(const std::string imagePath) {
+
+  std::vector<char> contents;
+  readWholeFile(imagePath, contents);
+
+  // A "DDS " and a 124-byte header, which may be followed by another,
+  // 20-byte one, for the newer formats.
+  if ((contents.size() < 128) || memcmp(&contents[0], "DDS ", 4))
+    throw std::runtime_error(imagePath + " is not a DDS file");
+
+  uint32_t flags = readUint32(contents, 8);
+  GLsizei height = readUint32(contents, 12);
+  GLsizei width = readUint32(contents, 16);
+  uint32_t nLevels = (flags & 0x20000) ? readUint32(contents, 28) : 1;
+  uint32_t fourCC = readUint32(contents, 84);
+  uint32_t caps2 = readUint32(contents, 112);
+
+  // The faces of a cube map, or the slices of a volume, would be
+  // taken for more mipmap levels.
+  if ((flags & 0x800000) || (caps2 & 0x200) || (caps2 & 0x200000))
+    throw std::runtime_error(imagePath + " is not a plain 2D texture");
+  if ((width <= 0) || (height <= 0))
+    throw std::runtime_error(imagePath + " has a bad size");
+  nLevels = std::min(std::max(nLevels, (uint32_t)1),
+                     mipmapLevels(width, height));
+
+  // BC1, BC2, and BC3 are also known as DXT1, DXT3, and DXT5.  The
+  // DX10 header gives the format as a DXGI_FORMAT number.
+  GLenum format = 0;
+  size_t offset = 128;
+  if (!memcmp(&contents[84], "DXT1", 4)) {
+    format = GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+  } else if (!memcmp(&contents[84], "DXT3", 4)) {
+    format = GL_COMPRESSED_RGBA_S3TC_DXT3_EXT;
+  } else if (!memcmp(&contents[84], "DXT5", 4)) {
+    format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+  } else if (!memcmp(&contents[84], "DX10", 4) && (contents.size() >= 148)) {
+    offset = 148;
+
+    // The dimension, flags (4 is a cube map), and array size.
+    if ((readUint32(contents, 132) == 4) || (readUint32(contents, 136) & 0x4) ||
+        (readUint32(contents, 140) > 1))
+      throw std::runtime_error(imagePath + " is not a plain 2D texture");
+
+    switch (readUint32(contents, 128)) {
+    case 71: // BC1_UNORM
+    case 72: // BC1_UNORM_SRGB
+      format = GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+      break;
+    case 74: // BC2_UNORM
+    case 75: // BC2_UNORM_SRGB
+      format = GL_COMPRESSED_RGBA_S3TC_DXT3_EXT;
+      break;
+    case 77: // BC3_UNORM
+    case 78: // BC3_UNORM_SRGB
+      format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+      break;
+    case 98: // BC7_UNORM
+    case 99: // BC7_UNORM_SRGB
+      format = GL_COMPRESSED_RGBA_BPTC_UNORM_ARB;
+      break;
+    }
+  }
+  if (format == 0) {
+    std::stringstream message;
+    message << imagePath << " has an unsupported DDS format (" << std::hex
+            << fourCC << ")";
+    throw std::runtime_error(message.str());
+  }
+  if (!compressedFormatSupported(format))
+    throw std::runtime_error(imagePath + "'s format is not supported by this OpenGL");
+
+  // Each 4x4 block takes 8 bytes in BC1, and 16 in the others.  The
+  // sizes are worked out in 64 bits, so a bad header can't make them
+  // wrap around.
+  uint64_t blockSize = (format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) ? 8 : 16;
+
+  std::vector<textureLevel> levels;
+  for (uint32_t i = 0; i < nLevels; i++) {
+    textureLevel level;
+    level.width = std::max(1, width >> i);
+    level.height = std::max(1, height >> i);
+    uint64_t size = ((uint64_t)(level.width + 3) / 4) *
+      ((uint64_t)(level.height + 3) / 4) * blockSize;
+    if ((uint64_t)offset + size > contents.size()) break;
+    level.size = size;
+    level.data = &contents[offset];
+    offset += size;
+    levels.push_back(level);
+  }
+  if (levels.empty()) throw std::runtime_error(imagePath + " is cut short");
+
+  GLuint texture;
+  glGenTextures(1, &texture);
+  setTextureLevels(texture, format, 0, 0, levels);
+
+  _width = width;
+  _height = height;
+  return texture;
+}
+
+GLuint textureMgr::_loadKTX(const std::string imagePath) {
+
+  std::vector<char> contents;
+  readWholeFile(imagePath, contents);
+
+  // A twelve-byte identifier, and thirteen numbers.
+  static const unsigned char identifier[12] = {
+    0xAB, 0x4B, 0x54, 0x58, 0x20, 0x31, 0x31, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A };
+  if ((contents.size() < 64) || memcmp(&contents[0], identifier, 12))
+    throw std::runtime_error(imagePath + " is not a KTX file");
+
+  // A file written on a machine with the other byte order would need
+  // every number swapped.
+  if (readUint32(contents, 12) != 0x04030201)
+    throw std::runtime_error(imagePath + " has the wrong byte order");
+
+  GLenum type = readUint32(contents, 16);
+  GLenum format = readUint32(contents, 24);
+  GLenum internalFormat = readUint32(contents, 28);
+  GLsizei width = readUint32(contents, 36);
+  GLsizei height = readUint32(contents, 40);
+  uint32_t depth = readUint32(contents, 44);
+  uint32_t nArrayElements = readUint32(contents, 48);
+  uint32_t nFaces = readUint32(contents, 52);
+  uint32_t nLevels = readUint32(contents, 56);
+  uint32_t keyValueBytes = readUint32(contents, 60);
+
+  if ((depth > 1) || (nArrayElements > 0) || (nFaces != 1) || (height == 0))
+    throw std::runtime_error(imagePath + " is not a plain 2D texture");
+  if ((width <= 0) || (height <= 0))
+    throw std::runtime_error(imagePath + " has a bad size");
+  if ((type == 0) && !compressedFormatSupported(internalFormat))
+    throw std::runtime_error(imagePath + "'s format is not supported by this OpenGL");
+
+  // For uncompressed data we know how big each level has to be, and
+  // OpenGL would read past a smaller one.
+  uint64_t bytesPerPixel = 0;
+  if (type != 0) {
+    bytesPerPixel = pixelBytes(format, type);
+    if (bytesPerPixel == 0) {
+      std::stringstream message;
+      message << imagePath << " has an unsupported KTX format (" << std::hex
+              << format << ", " << type << ")";
+      throw std::runtime_error(message.str());
+    }
+  }
+
+  // Each level is its size, then its data, padded to four bytes.  The
+  // rows of uncompressed data are padded to four bytes, too, which is
+  // what OpenGL expects by default.  The sizes are worked out in 64
+  // bits, so a bad header can't make them wrap around.
+  std::vector<textureLevel> levels;
+  uint64_t offset = 64 + (uint64_t)keyValueBytes;
+  uint32_t nStored = std::min(std::max(nLevels, (uint32_t)1),
+                              mipmapLevels(width, height));
+  for (uint32_t i = 0; i < nStored; i++) {
+    if (offset + 4 > contents.size()) break;
+    textureLevel level;
+    level.width = std::max(1, width >> i);
+    level.height = std::max(1, height >> i);
+    uint64_t size = readUint32(contents, offset);
+    offset += 4;
+    if (offset + size > contents.size()) break;
+
+    if (type != 0) {
+      uint64_t rowSize = (level.width * bytesPerPixel + 3) & ~(uint64_t)3;
+      if (size < rowSize * level.height)
+        throw std::runtime_error(imagePath + " has a mipmap level that is too small");
+    }
+
+    level.size = size;
+    level.data = &contents[offset];
+    offset += (size + 3) & ~(uint64_t)3;
+    levels.push_back(level);
+  }
+  if (levels.empty()) throw std::runtime_error(imagePath + " is cut short");
+
+  GLuint texture;
+  glGenTextures(1, &texture);
+  setTextureLevels(texture, internalFormat, format, type, levels);
+
+  // No levels in the file means they should be made here.
+  if ((nLevels == 0) && (type != 0)) {
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 1000);
+    setTextureFiltering(generateMipmaps());
+  }
+
+  _width = width;
+  _height = height;
+  return texture;
+}
+
 GLuint textureMgr::_loadPNG(const std::string imagePath) {
 
   // This function was originally written by David Grayson for
@@ -254,31 +696,271 @@ GLuint textureMgr::_loadPNG(const std::string imagePath) {
   png_read_image(png_ptr, row_pointers);
   */
 
-  // Neccessary as stb loads images upside down (as OpenGL sees it)
-  stbi_set_flip_vertically_on_load(true);
-
-  int width, height, components;
-  unsigned char* data = stbi_load(imagePath.c_str(), &width, &height, &components, STBI_rgb_alpha);//STBI_default);
+  int width, height;
+  unsigned char* data = decodeImage(imagePath, width, height);
   if (!data) {
-	  throw(stbi_failure_reason());
+    throw std::runtime_error("could not read " + imagePath);
   }
+
   // Generate the OpenGL texture object
   GLuint texture;
   glGenTextures(1, &texture);
-  glBindTexture(GL_TEXTURE_2D, texture);
-  if (components == 3) {
-	  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height,
-		  0, GL_RGB, GL_UNSIGNED_BYTE, data);
-  } else if (components == 4) {
-	  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height,
-		  0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-  }
-  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  setTextureImage(texture, width, height, data);
+  stbi_image_free(data);
 
+  _width = width;
+  _height = height;
   return texture;
 }
 
+textureMgr::~textureMgr() {
+
+  if (_loading) textureLoader::cancel(this);
+}
+
+void textureMgr::readFileAsync(const textureType& type,
+                               const std::string& fileName) {
+
+  if (type != texturePNG) {
+    readFile(type, fileName);
+    return;
+  }
+
+  // Something to show in the meantime.
+  if (_textureBufferID == 0) _textureBufferID = _loadCheckerBoard(64, 8);
+
+  textureLoader::add(this, fileName);
+}
+
+std::deque<textureLoader::job*> textureLoader::_waiting;
+std::deque<textureLoader::job*> textureLoader::_ready;
+std::vector<textureLoader::job*> textureLoader::_decoding;
+std::mutex textureLoader::_mutex;
+std::condition_variable textureLoader::_wakeup;
+std::vector<std::thread> textureLoader::_workers;
+bool textureLoader::_stopping = false;
+int textureLoader::_numThreads = 0;
+size_t textureLoader::_bytesPerFrame = 16 * 1024 * 1024;
+GLuint textureLoader::_pixelBufferID = 0;
+
+// The worker threads have to be stopped before the program exits, or
+// their std::thread objects will end it rudely.  This is destroyed
+// before the statics above, which it uses.
+static struct textureLoaderStopper {
+  ~textureLoaderStopper() { textureLoader::stop(); };
+} textureLoaderStopper;
+
+void textureLoader::_freeJob(job* finished) {
+  if (finished->pixels) stbi_image_free(finished->pixels);
+  delete finished;
+}
+
+void textureLoader::add(textureMgr* texture, const std::string &fileName) {
+
+  // A texture gets only the last image asked for.
+  if (texture->_loading) cancel(texture);
+
+  job* next = new job();
+  next->fileName = fileName;
+  next->texture = texture;
+  next->pixels = NULL;
+  next->width = next->height = 0;
+  texture->_loading = true;
+
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  // Start the workers the first time through.
+  if (_workers.empty()) {
+    _stopping = false;
+    int nThreads = _numThreads;
+    if (nThreads <= 0) {
+      nThreads = std::max(1, (int)std::thread::hardware_concurrency() - 1);
+    }
+    for (int i = 0; i < nThreads; i++) {
+      _workers.push_back(std::thread(_work));
+    }
+  }
+
+  _waiting.push_back(next);
+  _wakeup.notify_one();
+}
+
+void textureLoader::_work() {
+
+  std::unique_lock<std::mutex> lock(_mutex);
+  while (true) {
+    while (_waiting.empty() && !_stopping) _wakeup.wait(lock);
+    if (_stopping) return;
+
+    job* next = _waiting.front();
+    _waiting.pop_front();
+    _decoding.push_back(next);
+
+    // Decode without holding the lock, so the others can work, too.
+    lock.unlock();
+    next->pixels = decodeImage(next->fileName, next->width, next->height);
+    lock.lock();
+
+    _decoding.erase(std::find(_decoding.begin(), _decoding.end(), next));
+    if (next->texture) {
+      _ready.push_back(next);
+    } else {
+      _freeJob(next);
+    }
+  }
+}
+
+void textureLoader::cancel(textureMgr* texture) {
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  texture->_loading = false;
+
+  for (std::deque<job*>* queue = &_waiting; queue;
+       queue = (queue == &_waiting) ? &_ready : NULL) {
+    for (std::deque<job*>::iterator it = queue->begin(); it != queue->end(); ) {
+      if ((*it)->texture == texture) {
+        _freeJob(*it);
+        it = queue->erase(it);
+      } else {
+        it++;
+      }
+    }
+  }
+
+  // The ones being decoded are thrown away when they're done.
+  for (std::vector<job*>::iterator it = _decoding.begin();
+       it != _decoding.end(); it++) {
+    if ((*it)->texture == texture) (*it)->texture = NULL;
+  }
+}
+
+int textureLoader::uploadReady() {
+
+  int uploaded = 0;
+  size_t bytes = 0;
+  while (true) {
+
+    job* next;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (_ready.empty()) break;
+
+      // At least one a frame, however big it is.
+      size_t size = 4 * (size_t)_ready.front()->width * _ready.front()->height;
+      if ((uploaded > 0) && (bytes + size > _bytesPerFrame)) break;
+
+      next = _ready.front();
+      _ready.pop_front();
+      bytes += size;
+    }
+
+    _upload(next);
+    _freeJob(next);
+    uploaded++;
+  }
+
+  return uploaded;
+}
+
+void textureLoader::_upload(job* finished) {
+
+  textureMgr* texture = finished->texture;
+  texture->_loading = false;
+
+  if (!finished->pixels) {
+    std::cerr << "** Caution: could not read " << finished->fileName
+              << std::endl;
+    return;
+  }
+
+  size_t size = 4 * (size_t)finished->width * finished->height;
+
+  // The pixels go into a pixel buffer object, and from there to the
+  // texture, which OpenGL can do without holding up this thread.
+  // Each upload gets a new data store for the buffer, so it doesn't
+  // have to wait for the last one to finish.  We copy the pixels
+  // straight into the mapped store, instead of handing them to
+  // glBufferData(), which would copy them once more on the way.
+  if (_pixelBufferID == 0) glGenBuffers(1, &_pixelBufferID);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, _pixelBufferID);
+  glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+
+  void* dest;
+  if (GLEW_VERSION_3_0 || GLEW_ARB_map_buffer_range) {
+    dest = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+                            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+  } else {
+    dest = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+  }
+
+  // glUnmapBuffer() fails if the store was lost while it was mapped.
+  bool copied = false;
+  if (dest) {
+    memcpy(dest, finished->pixels, size);
+    copied = glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+  }
+
+  if (copied) {
+    setTextureImage(texture->_textureBufferID,
+                    finished->width, finished->height, BUFFER_OFFSET(0));
+  } else {
+    // Load the pixels the ordinary way.
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    setTextureImage(texture->_textureBufferID,
+                    finished->width, finished->height, finished->pixels);
+  }
+
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+  texture->_width = finished->width;
+  texture->_height = finished->height;
+}
+
+size_t textureLoader::getNumPending() {
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _waiting.size() + _decoding.size() + _ready.size();
+}
+
+void textureLoader::finish() {
+
+  while (getNumPending() > 0) {
+    if (uploadReady() == 0) std::this_thread::yield();
+  }
+}
+
+void textureLoader::deletePixelBuffer() {
+
+  if (_pixelBufferID == 0) return;
+
+  glDeleteBuffers(1, &_pixelBufferID);
+  _pixelBufferID = 0;
+}
+
+void textureLoader::stop() {
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stopping = true;
+    _wakeup.notify_all();
+  }
+  for (std::vector<std::thread>::iterator it = _workers.begin();
+       it != _workers.end(); it++) {
+    it->join();
+  }
+  _workers.clear();
+
+  // Nobody is decoding any more.
+  while (!_waiting.empty()) {
+    _freeJob(_waiting.front());
+    _waiting.pop_front();
+  }
+  while (!_ready.empty()) {
+    _freeJob(_ready.front());
+    _ready.pop_front();
+  }
+}
+
 void textureMgr::load(const GLuint programID) {
 
   // Get a handle for the texture uniform.
@@ -431,6 +1113,14 @@ void shaderMgr::compileShaders() {
   glAttachShader(_programID, _shaderIDs[GLSHADER_FRAGMENT]);
   if (geom) glAttachShader(_programID, _shaderIDs[GLSHADER_GEOMETRY]);
 
+  // Give the usual attributes the same locations in every program,
+  // so an object can be drawn with any of them without setting its
+  // attributes up again.  Names the shaders don't use are ignored.
+  glBindAttribLocation(_programID, 0, "position");
+  glBindAttribLocation(_programID, 1, "color");
+  glBindAttribLocation(_programID, 2, "normal");
+  glBindAttribLocation(_programID, 3, "texture");
+
   // Assemble the shaders into a single program with 'link', which
   // will make sure that the inputs to the fragment shader correspond
   // with outputs from the vertex shader, and so on.
@@ -453,13 +1143,15 @@ void shaderMgr::compileShaders() {
   _compiled = true;
 }
 
+GLuint shaderMgr::_currentProgram = 0;
+
 GLuint shaderMgr::getAttribID(const std::string& attribName) {
-  glUseProgram(_programID);
+  useProgram();
   return glGetAttribLocation(_programID, attribName.c_str());
 }
 
 GLuint shaderMgr::getUniformID(const std::string& unifName) {
-  glUseProgram(_programID);
+  useProgram();
   return glGetUniformLocation(_programID, unifName.c_str());
 }
 
@@ -481,840 +1173,3820 @@ void shaderMgr::draw() {
   if (_textureLoaded) _texture->draw();
 }
 
-void drawableObj::addData(const GLDATATYPE type,
-                          const std::string& name,
-                          const std::vector<glm::vec4>& data) {
+streamBuffer* streamBuffer::_ring = NULL;
+size_t streamBuffer::_defaultRegionSize = 4 * 1024 * 1024;
+unsigned long streamBuffer::_nextFrame = 0;
 
-  switch(type) {
-  case(GLDATA_VERTICES):
-    _vertices = drawableObjData<glm::vec4>(name, data);
-    break;
-  case(GLDATA_COLORS):
-    _colors = drawableObjData<glm::vec4>(name, data);
-    break;
-  case(GLDATA_NORMALS):
-    _normals = drawableObjData<glm::vec4>(name, data);
-    break;
-  case(GLDATA_TEXCOORDS):
-    throw std::runtime_error("Do not use vec4 for texture coordinates.");
-    break;
-  }
-  _loadedIntoBuffer = false;
+bool streamBuffer::supported() {
+
+  return (GLEW_VERSION_3_0 || GLEW_ARB_map_buffer_range) &&
+    (GLEW_VERSION_3_2 || GLEW_ARB_sync);
 }
 
-void drawableObj::addData(const GLDATATYPE type,
-             const std::string& name,
-             const std::vector<glm::vec2>& data) {
+streamBuffer* streamBuffer::getRing() {
 
-  switch(type) {
-  case(GLDATA_TEXCOORDS):
-    _uvs = drawableObjData<glm::vec2>(name, data);
-    break;
-  case(GLDATA_COLORS):
-  case(GLDATA_NORMALS):
-  case(GLDATA_VERTICES):
-    throw std::runtime_error("Vec2 is only for texture coordinates.");
-    break;
-  }
-  _loadedIntoBuffer = false;
+  if (!_ring && supported()) _ring = new streamBuffer(_defaultRegionSize);
+  return _ring;
 }
 
-void drawableObj::setData(const GLDATATYPE type,
-                          const std::vector<glm::vec4>& data) {
+void streamBuffer::deleteRing() {
 
-  switch(type) {
-  case(GLDATA_VERTICES):
-    _vertices.setData(data);
-    break;
-  case(GLDATA_COLORS):
-    _colors.setData(data);
-    break;
-  case(GLDATA_NORMALS):
-    _normals.setData(data);
-    break;
-  case(GLDATA_TEXCOORDS):
-    throw std::runtime_error("Do not use vec4 for texture coordinates.");
-    break;
+  if (!_ring) return;
+
+  delete _ring;
+  _ring = NULL;
+}
+
+streamBuffer::streamBuffer(const size_t &regionSize) :
+  _bufferID(0), _regionSize(regionSize), _region(0), _offset(0),
+  _frame(_nextFrame++), _mapped(NULL) {
+
+  for (int i = 0; i < _numRegions; i++) _fences[i] = NULL;
+
+  glGenBuffers(1, &_bufferID);
+  glBindBuffer(GL_ARRAY_BUFFER, _bufferID);
+
+  // With immutable storage, the buffer can stay mapped while the GPU
+  // draws from it.  Coherent mapping means our writes show up without
+  // any flushing.
+  if (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage) {
+    GLbitfield flags =
+      GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage(GL_ARRAY_BUFFER, _numRegions * _regionSize, NULL, flags);
+    _mapped = (char*)glMapBufferRange(GL_ARRAY_BUFFER, 0,
+                                      _numRegions * _regionSize, flags);
+    if (!_mapped)
+      std::cerr << "** Caution: could not map the stream buffer." << std::endl;
+  } else {
+    glBufferData(GL_ARRAY_BUFFER, _numRegions * _regionSize, NULL,
+                 GL_STREAM_DRAW);
   }
-  _loadedIntoBuffer = false;
+
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
-void drawableObj::setData(const GLDATATYPE type,
-             const std::vector<glm::vec2>& data) {
+streamBuffer::~streamBuffer() {
 
-  switch(type) {
-  case(GLDATA_TEXCOORDS):
-    _uvs.setData(data);
-    break;
-  case(GLDATA_COLORS):
-  case(GLDATA_NORMALS):
-  case(GLDATA_VERTICES):
-    throw std::runtime_error("Vec2 is only for texture coordinates.");
-    break;
+  for (int i = 0; i < _numRegions; i++) {
+    if (_fences[i]) glDeleteSync(_fences[i]);
   }
-  _loadedIntoBuffer = false;
+
+  if (_mapped) {
+    glBindBuffer(GL_ARRAY_BUFFER, _bufferID);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+  glDeleteBuffers(1, &_bufferID);
 }
 
-bool drawableObj::insideBoundingBox(const glm::vec4 &testPoint,
-                                    const glm::mat4 &modelMatrix) {
+GLintptr streamBuffer::write(const void* data, const size_t &size) {
 
-  if (!_selectable) return false;
+  // Start each piece on a 64-byte boundary, which keeps the vertex
+  // fetch happy.
+  size_t start = (_offset + 63) & ~((size_t)63);
+  if (start + size > _regionSize) return -1;
 
-  glm::vec4 upper = modelMatrix * _vertexBoundingBoxUpper;
-  glm::vec4 lower = modelMatrix * _vertexBoundingBoxLower;
+  GLintptr offset = _region * _regionSize + start;
 
-  return
-    (testPoint.x <= upper.x) &&
-    (testPoint.x >= lower.x) &&
-    (testPoint.y <= upper.y) &&
-    (testPoint.y >= lower.y) &&
-    (testPoint.z <= upper.z) &&
-    (testPoint.z >= lower.z);
+  if (_mapped) {
+    memcpy(_mapped + offset, data, size);
+  } else {
+    // The fences guarantee the GPU is done with this region, so
+    // there's no need for OpenGL to synchronize anything.
+    glBindBuffer(GL_ARRAY_BUFFER, _bufferID);
+    void* dest = glMapBufferRange(GL_ARRAY_BUFFER, offset, size,
+                                  GL_MAP_WRITE_BIT |
+                                  GL_MAP_INVALIDATE_RANGE_BIT |
+                                  GL_MAP_UNSYNCHRONIZED_BIT);
+    if (!dest) {
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+      return -1;
+    }
+    memcpy(dest, data, size);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+
+  _offset = start + size;
+  return offset;
 }
 
-void drawableObj::_getAttribLocations(GLuint programID) {
+void streamBuffer::nextFrame() {
 
-  bool badID = false;
+  // Mark the end of the commands that use this frame's region.
+  if (_fences[_region]) glDeleteSync(_fences[_region]);
+  _fences[_region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 
-  _vertices.ID = glGetAttribLocation(programID, _vertices.name.c_str());
+  _region = (_region + 1) % _numRegions;
+  _offset = 0;
+  _frame = _nextFrame++;
 
-  // Check to make sure the ID awarded is sane.  If not, probably the
-  // name does not match the name in the shader.
-  if (_vertices.ID < 0) {
-    std::cerr << "** Caution: Bad ID for vertices attribute '" << _vertices.name << "'" << std::endl;
-    badID = true;
-  }
-
-  if (!_colors.empty()) {
-    _colors.ID = glGetAttribLocation(programID, _colors.name.c_str());
+  _waitForRegion(_region);
+}
 
-    if (_colors.ID < 0) {
-      std::cerr << "** Caution: Bad ID for colors attribute '" << _colors.name << "'" << std::endl;
-      badID = true;
-    }
-  }
-  if (!_normals.empty()) {
-    _normals.ID = glGetAttribLocation(programID, _normals.name.c_str());
+void streamBuffer::_waitForRegion(const int &region) {
 
-    if (_normals.ID < 0) {
-      std::cerr << "** Caution: Bad ID for normals attribute '" << _normals.name << "'" << std::endl;
-      badID = true;
-    }
-  }
-  if (!_uvs.empty()) {
-    _uvs.ID = glGetAttribLocation(programID, _uvs.name.c_str());
+  if (!_fences[region]) return;
 
-    if (_uvs.ID < 0) {
-      std::cerr << "** Caution: Bad ID for texture attribute '" << _uvs.name << "'" << std::endl;
-      badID = true;
+  // Usually the GPU finished with this region a frame or two ago, and
+  // the first check returns right away.  If not, flush the commands
+  // so the fence will be reached, and wait for it.
+  GLbitfield flags = 0;
+  GLuint64 timeout = 0;
+  while (true) {
+    GLenum result = glClientWaitSync(_fences[region], flags, timeout);
+    if ((result == GL_ALREADY_SIGNALED) || (result == GL_CONDITION_SATISFIED))
+      break;
+    if (result == GL_WAIT_FAILED) {
+      std::cerr << "** Caution: waiting for the stream buffer failed."
+                << std::endl;
+      break;
     }
+    flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+    timeout = 1000000; // nanoseconds
   }
 
-  if (badID) {
-    std::cerr << "This can be caused either by a spelling error, or by not using the" << std::endl << "attribute within the shader code." << std::endl;
-  }
+  glDeleteSync(_fences[region]);
+  _fences[region] = NULL;
 }
 
-void drawableObj::findBoundingBox() {
-
-  // Find the bounding box for this object.
-  _vertexBoundingBoxLower = glm::vec4(1.0e35, 1.0e35, 1.0e35, 1.0f);
-  _vertexBoundingBoxUpper = glm::vec4(-1.0e35, -1.0e35, -1.0e35, 1.0f);
-
-  // Don't use a templated accessor to test the for loop (very slow).
-  std::vector<glm::vec4> data = _vertices.getData();
-
-  for (std::vector<glm::vec4>::iterator it = data.begin();
-       it != data.end(); it++) {
+std::map<GLenum, bufferArena*> bufferArena::_arenas;
+size_t bufferArena::_blockSize = 64 * 1024 * 1024;
+bool bufferArena::_enabled = true;
 
-    _vertexBoundingBoxUpper.x = fmax((*it).x, _vertexBoundingBoxUpper.x);
-    _vertexBoundingBoxUpper.y = fmax((*it).y, _vertexBoundingBoxUpper.y);
-    _vertexBoundingBoxUpper.z = fmax((*it).z, _vertexBoundingBoxUpper.z);
+// Arena ranges are kept to multiples of this, which suits any vertex
+// attribute or index type.
+static const size_t arenaAlignment = 16;
 
-    _vertexBoundingBoxLower.x = fmin((*it).x, _vertexBoundingBoxLower.x);
-    _vertexBoundingBoxLower.y = fmin((*it).y, _vertexBoundingBoxLower.y);
-    _vertexBoundingBoxLower.z = fmin((*it).z, _vertexBoundingBoxLower.z);
-  }
+bufferArena* bufferArena::getArena(const GLenum &target) {
 
-  // We don't want any zero-width bounding boxes.
-  if (_vertexBoundingBoxUpper.x == _vertexBoundingBoxLower.x) {
-    _vertexBoundingBoxUpper.x += _boundingBoxMin;
-    _vertexBoundingBoxLower.x -= _boundingBoxMin;
-  }
-  if (_vertexBoundingBoxUpper.y == _vertexBoundingBoxLower.y) {
-    _vertexBoundingBoxUpper.y += _boundingBoxMin;
-    _vertexBoundingBoxLower.y -= _boundingBoxMin;
-  }
-  if (_vertexBoundingBoxUpper.z == _vertexBoundingBoxLower.z) {
-    _vertexBoundingBoxUpper.z += _boundingBoxMin;
-    _vertexBoundingBoxLower.z -= _boundingBoxMin;
-  }
+  if (!_enabled) return NULL;
 
-  _haveBoundingBox = true;
+  bufferArena* &arena = _arenas[target];
+  if (!arena) arena = new bufferArena(target);
+  return arena;
 }
 
-void drawableObj::prepare(GLuint programID) {
+void bufferArena::_addBlock() {
 
-  if (!_haveBoundingBox) findBoundingBox();
+  block newBlock;
+  glGenBuffers(1, &newBlock.bufferID);
+  glBindBuffer(_target, newBlock.bufferID);
+  glBufferData(_target, _blockSize, NULL, GL_STATIC_DRAW);
+  glBindBuffer(_target, 0);
 
-  if (_interleaved) {
-    _prepareInterleaved(programID);
-  } else {
-    _prepareSeparate(programID);
-  }
+  newBlock.freeRanges[0] = _blockSize;
+  _blocks.push_back(newBlock);
 }
 
-void drawableObj::_prepareInterleaved(GLuint programID) {
-
-  // Calculate the stride and offset for each vertex value.
-  _stride = 3 * sizeof(float); // We're cheating here, assuming only x,y,z.
-
-  if (!_colors.empty()) {
-    _colorPos = _stride;  // The colors appear after the vertices.
-    _stride += 3 * sizeof(float);  // The next value appears after that.
+bool bufferArena::allocate(const size_t &size, GLuint &bufferID,
+                           GLintptr &offset) {
+
+  size_t alignedSize = (size + arenaAlignment - 1) & ~(arenaAlignment - 1);
+  if ((alignedSize == 0) || (alignedSize > _blockSize)) return false;
+
+  // Find the smallest free range that fits, which leaves the big ones
+  // for big meshes.
+  block* bestBlock = NULL;
+  std::map<size_t, size_t>::iterator best;
+  for (std::vector<block>::iterator it = _blocks.begin();
+       it != _blocks.end(); it++) {
+    for (std::map<size_t, size_t>::iterator jt = it->freeRanges.begin();
+         jt != it->freeRanges.end(); jt++) {
+      if ((jt->second >= alignedSize) &&
+          (!bestBlock || (jt->second < best->second))) {
+        bestBlock = &(*it);
+        best = jt;
+      }
+    }
   }
 
-  if (!_normals.empty()) {
-    _normalPos = _stride;
-    _stride += 3 * sizeof(float);
+  if (!bestBlock) {
+    _addBlock();
+    bestBlock = &_blocks.back();
+    best = bestBlock->freeRanges.begin();
   }
 
-  if (!_uvs.empty()) {
-    _uvPos = _stride;
-    _stride += 2 * sizeof(float);
-  }
-  // End of calculating all the stride values.
+  // Take the front of the free range.
+  size_t start = best->first;
+  size_t remaining = best->second - alignedSize;
+  bestBlock->freeRanges.erase(best);
+  if (remaining > 0) bestBlock->freeRanges[start + alignedSize] = remaining;
 
-  // Prepare a data buffer for the interleaved data.
-  glGenBuffers(1, &_interleavedData.bufferID);
+  bufferID = bestBlock->bufferID;
+  offset = start;
+  return true;
+}
 
-  // Now interleave the data.
-  for (int i = 0; i < _vertices.size(); i++) {
+void bufferArena::release(const GLuint &bufferID, const GLintptr &offset,
+                          const size_t &size) {
 
-    // Load the x,y,z vertices.
-    _interleavedData.addData(_vertices[i].x);
-    _interleavedData.addData(_vertices[i].y);
-    _interleavedData.addData(_vertices[i].z);
+  size_t alignedSize = (size + arenaAlignment - 1) & ~(arenaAlignment - 1);
 
-    // Now interleave the other vertex attributes, if any.
-    if (!_colors.empty()) {
-      _interleavedData.addData(_colors[i].r);
-      _interleavedData.addData(_colors[i].g);
-      _interleavedData.addData(_colors[i].b);
-    }
-    if (!_normals.empty()) {
-      _interleavedData.addData(_normals[i].x);
-      _interleavedData.addData(_normals[i].y);
-      _interleavedData.addData(_normals[i].z);
+  for (std::vector<block>::iterator it = _blocks.begin();
+       it != _blocks.end(); it++) {
+    if (it->bufferID != bufferID) continue;
+
+    std::map<size_t, size_t> &freeRanges = it->freeRanges;
+    std::map<size_t, size_t>::iterator range =
+      freeRanges.insert(std::make_pair((size_t)offset, alignedSize)).first;
+
+    // Merge with the free ranges on either side, so the free list
+    // doesn't break up into little pieces.
+    std::map<size_t, size_t>::iterator next = range;
+    next++;
+    if ((next != freeRanges.end()) &&
+        (range->first + range->second == next->first)) {
+      range->second += next->second;
+      freeRanges.erase(next);
     }
-    if (!_uvs.empty()) {
-      _interleavedData.addData(_uvs[i].s);
-      _interleavedData.addData(_uvs[i].t);
+    if (range != freeRanges.begin()) {
+      std::map<size_t, size_t>::iterator prev = range;
+      prev--;
+      if (prev->first + prev->second == range->first) {
+        prev->second += range->second;
+        freeRanges.erase(range);
+      }
     }
+    return;
   }
 
-  _getAttribLocations(programID);
-
-  _loadInterleaved();
+  std::cerr << "** Caution: releasing a range of an unknown arena block."
+            << std::endl;
 }
 
-void drawableObj::_prepareSeparate(GLuint programID) {
+size_t bufferArena::getFreeSpace() const {
 
-  // Figure out which buffers we need and get IDs for them.
-  glGenBuffers(1, &_vertices.bufferID);
-  if (!_colors.empty()) glGenBuffers(1, &_colors.bufferID);
-  if (!_normals.empty()) glGenBuffers(1, &_normals.bufferID);
-  if (!_uvs.empty()) glGenBuffers(1, &_uvs.bufferID);
+  size_t out = 0;
+  for (std::vector<block>::const_iterator it = _blocks.begin();
+       it != _blocks.end(); it++) {
+    for (std::map<size_t, size_t>::const_iterator jt = it->freeRanges.begin();
+         jt != it->freeRanges.end(); jt++) {
+      out += jt->second;
+    }
+  }
+  return out;
+}
 
-  _getAttribLocations(programID);
+drawableObj::~drawableObj() {
 
-  // Put the data in its buffers, for practice.
-  _loadSeparate();
+  // The vertex array objects belong to the context, so this has to
+  // happen while it is current, like the deletion of a shader.
+  for (VertexArrayMap::iterator it = _vertexArrays.begin();
+       it != _vertexArrays.end(); it++) {
+    if (it->second.ID) glDeleteVertexArrays(1, &it->second.ID);
+  }
 
+  _vertices.deleteBuffer();
+  _colors.deleteBuffer();
+  _normals.deleteBuffer();
+  _uvs.deleteBuffer();
+  _interleavedData.deleteBuffer();
+  _indices.deleteBuffer();
 }
 
+void drawableObj::addData(const GLDATATYPE type,
+                          const std::string& name,
+                          const std::vector<glm::vec4>& data) {
+  addData(type, name, std::vector<glm::vec4>(data));
+}
 
-void drawableObj::load() {
-
-  // if (_loadedIntoBuffer)
-  //   std::cout << "no need " << std::endl;
-  // else
-  //   std::cout << "load!!! " << std::endl;
+void drawableObj::addData(const GLDATATYPE type,
+                          const std::string& name,
+                          std::vector<glm::vec4>&& data) {
 
-  if (_interleaved) {
-    _loadInterleaved();
-  } else {
-    _loadSeparate();
+  switch(type) {
+  case(GLDATA_VERTICES):
+    _vertices = drawableObjData<glm::vec4>(name, std::move(data));
+    _haveBoundingBox = false;
+    _haveTriangleTree = false;
+    break;
+  case(GLDATA_COLORS):
+    _colors = drawableObjData<glm::vec4>(name, std::move(data));
+    break;
+  case(GLDATA_NORMALS):
+    _normals = drawableObjData<glm::vec4>(name, std::move(data));
+    break;
+  case(GLDATA_TEXCOORDS):
+    throw std::runtime_error("Do not use vec4 for texture coordinates.");
+    break;
   }
+  _loadedIntoBuffer = false;
 }
 
-void drawableObj::_loadInterleaved() {
-
-  if (!_loadedIntoBuffer) {
-
-    // Load it into a buffer.
-    glBindBuffer(GL_ARRAY_BUFFER, _interleavedData.bufferID);
-    glBufferData(GL_ARRAY_BUFFER, _interleavedData.byteSize(),
-                 _interleavedData.beginAddress(), GL_STATIC_DRAW);
+void drawableObj::addData(const GLDATATYPE type,
+             const std::string& name,
+             const std::vector<glm::vec2>& data) {
+  addData(type, name, std::vector<glm::vec2>(data));
+}
 
+void drawableObj::addData(const GLDATATYPE type,
+             const std::string& name,
+             std::vector<glm::vec2>&& data) {
 
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    _loadedIntoBuffer = true;
+  switch(type) {
+  case(GLDATA_TEXCOORDS):
+    _uvs = drawableObjData<glm::vec2>(name, std::move(data));
+    break;
+  case(GLDATA_COLORS):
+  case(GLDATA_NORMALS):
+  case(GLDATA_VERTICES):
+    throw std::runtime_error("Vec2 is only for texture coordinates.");
+    break;
   }
+  _loadedIntoBuffer = false;
 }
 
+void drawableObj::setData(const GLDATATYPE type,
+                          const std::vector<glm::vec4>& data) {
+  setData(type, std::vector<glm::vec4>(data));
+}
 
-void drawableObj::_loadSeparate() {
+void drawableObj::setData(const GLDATATYPE type,
+                          std::vector<glm::vec4>&& data) {
 
-  if (!_loadedIntoBuffer) {
-    glBindBuffer(GL_ARRAY_BUFFER, _vertices.bufferID);
-    glBufferData(GL_ARRAY_BUFFER, _vertices.byteSize(), _vertices.beginAddress(),
-                 GL_STATIC_DRAW);
+  switch(type) {
+  case(GLDATA_VERTICES):
+    _vertices.setData(std::move(data));
+    _haveBoundingBox = false;
+    _haveTriangleTree = false;
+    break;
+  case(GLDATA_COLORS):
+    _colors.setData(std::move(data));
+    break;
+  case(GLDATA_NORMALS):
+    _normals.setData(std::move(data));
+    break;
+  case(GLDATA_TEXCOORDS):
+    throw std::runtime_error("Do not use vec4 for texture coordinates.");
+    break;
+  }
+  _loadedIntoBuffer = false;
+}
 
-    if (!_colors.empty()) {
-      glBindBuffer(GL_ARRAY_BUFFER, _colors.bufferID);
-      glBufferData(GL_ARRAY_BUFFER, _colors.byteSize(), _colors.beginAddress(),
-                   GL_STATIC_DRAW);
-    }
-    if (!_normals.empty()) {
-      glBindBuffer(GL_ARRAY_BUFFER, _normals.bufferID);
-      glBufferData(GL_ARRAY_BUFFER, _normals.byteSize(), _normals.beginAddress(),
-                   GL_STATIC_DRAW);
-    }
-    if (!_uvs.empty()) {
-      glBindBuffer(GL_ARRAY_BUFFER, _uvs.bufferID);
-      glBufferData(GL_ARRAY_BUFFER, _uvs.byteSize(), _uvs.beginAddress(),
-                   GL_STATIC_DRAW);
-    }
+void drawableObj::setData(const GLDATATYPE type,
+             const std::vector<glm::vec2>& data) {
+  setData(type, std::vector<glm::vec2>(data));
+}
 
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    _loadedIntoBuffer = true;
+void drawableObj::setData(const GLDATATYPE type,
+             std::vector<glm::vec2>&& data) {
+
+  switch(type) {
+  case(GLDATA_TEXCOORDS):
+    _uvs.setData(std::move(data));
+    break;
+  case(GLDATA_COLORS):
+  case(GLDATA_NORMALS):
+  case(GLDATA_VERTICES):
+    throw std::runtime_error("Vec2 is only for texture coordinates.");
+    break;
   }
+  _loadedIntoBuffer = false;
 }
 
+void drawableObj::setDataRange(const GLDATATYPE type, const size_t &first,
+                               const std::vector<glm::vec4>& data) {
 
-void drawableObj::draw() {
+  drawableObjData<glm::vec4>* target = NULL;
 
-  // Enable all the attribute arrays we'll use.
-  glEnableVertexAttribArray(_vertices.ID);
-  if (!_colors.empty()) glEnableVertexAttribArray(_colors.ID);
-  if (!_normals.empty()) glEnableVertexAttribArray(_normals.ID);
-  if (!_uvs.empty()) glEnableVertexAttribArray(_uvs.ID);
-
-  if (_interleaved) {
-    _drawInterleaved();
-  } else {
-    _drawSeparate();
+  switch(type) {
+  case(GLDATA_VERTICES):
+    target = &_vertices;
+    _haveBoundingBox = false;
+    _haveTriangleTree = false;
+    break;
+  case(GLDATA_COLORS):
+    target = &_colors;
+    break;
+  case(GLDATA_NORMALS):
+    target = &_normals;
+    break;
+  case(GLDATA_TEXCOORDS):
+    throw std::runtime_error("Do not use vec4 for texture coordinates.");
+    break;
   }
 
-  // Now disable the attribute arrays so they won't interfere with the
-  // next draw.
-  glDisableVertexAttribArray(_vertices.ID);
-  if (!_colors.empty()) glDisableVertexAttribArray(_colors.ID);
-  if (!_normals.empty()) glDisableVertexAttribArray(_normals.ID);
-  if (!_uvs.empty()) glDisableVertexAttribArray(_uvs.ID);
-}
+  if (first + data.size() > target->size())
+    throw std::runtime_error("setDataRange() past the end of the data.");
 
-void drawableObj::_drawInterleaved() {
+  std::copy(data.begin(), data.end(), target->beginAddress() + first);
+  target->setDirty(first, first + data.size());
+  _loadedIntoBuffer = false;
+}
 
-  glBindBuffer(GL_ARRAY_BUFFER, _interleavedData.bufferID);
+void drawableObj::setDataRange(const GLDATATYPE type, const size_t &first,
+                               const std::vector<glm::vec2>& data) {
 
-  // Since the point of the interleaving is to make the transfer of
-  // data more efficient, we are cheating in the following, and
-  // leaving out the w from the vec4 data and the a from rgba.  These
-  // are restored with default values by OpenGL.
-  glVertexAttribPointer(_vertices.ID, 3,//_vertices.componentsPerVertex() - 1,
-                        GL_FLOAT, GL_FALSE, _stride, BUFFER_OFFSET(0));
+  if (type != GLDATA_TEXCOORDS)
+    throw std::runtime_error("Vec2 is only for texture coordinates.");
 
-  if (!_colors.empty()) {
-    glVertexAttribPointer(_colors.ID, 3,//_colors.componentsPerVertex() - 1,
-                            GL_FLOAT, GL_FALSE, _stride, BUFFER_OFFSET(_colorPos));
-  }
-  if (!_normals.empty()) {
-    glVertexAttribPointer(_normals.ID, 3,//_normals.componentsPerVertex() - 1,
-                            GL_FLOAT, GL_FALSE, _stride, BUFFER_OFFSET(_normalPos));
-  }
-  if (!_uvs.empty()) {
-    glVertexAttribPointer(_uvs.ID, 2,//_uvs.componentsPerVertex(),
-                            GL_FLOAT, GL_FALSE, _stride, BUFFER_OFFSET(_uvPos));
-  }
+  if (first + data.size() > _uvs.size())
+    throw std::runtime_error("setDataRange() past the end of the data.");
 
-  glDrawArrays(_drawType, 0, _count);
+  std::copy(data.begin(), data.end(), _uvs.beginAddress() + first);
+  _uvs.setDirty(first, first + data.size());
+  _loadedIntoBuffer = false;
 }
 
+void drawableObj::setUsage(const GLDATATYPE type, const GLenum usage) {
 
-void drawableObj::_drawSeparate() {
+  switch(type) {
+  case(GLDATA_VERTICES):
+    _vertices.usage = usage;
+    break;
+  case(GLDATA_COLORS):
+    _colors.usage = usage;
+    break;
+  case(GLDATA_NORMALS):
+    _normals.usage = usage;
+    break;
+  case(GLDATA_TEXCOORDS):
+    _uvs.usage = usage;
+    break;
+  }
 
-  glBindBuffer(GL_ARRAY_BUFFER, _vertices.bufferID);
-  glVertexAttribPointer(_vertices.ID, _vertices.componentsPerVertex(),
-                        GL_FLOAT, 0, 0, 0);
+  // The interleaved buffer changes when any of its parts do.
+  if (usage != GL_STATIC_DRAW) _interleavedData.usage = usage;
+}
 
-  if (!_colors.empty()) {
-    glBindBuffer(GL_ARRAY_BUFFER, _colors.bufferID);
-    glVertexAttribPointer(_colors.ID, _colors.componentsPerVertex(),
-                          GL_FLOAT, 0, 0, 0);
-  }
-  if (!_normals.empty()) {
-    glBindBuffer(GL_ARRAY_BUFFER, _normals.bufferID);
-    glVertexAttribPointer(_normals.ID, _normals.componentsPerVertex(),
-                          GL_FLOAT, 0, 0, 0);
-  }
-  if (!_uvs.empty()) {
-    glBindBuffer(GL_ARRAY_BUFFER, _uvs.bufferID);
-    glVertexAttribPointer(_uvs.ID, _uvs.componentsPerVertex(),
-                          GL_FLOAT, 0, 0, 0);
-  }
+bool drawableObj::canMergeWith(const drawableObj &other) const {
 
-  glDrawArrays(_drawType, 0, _count);
+  // The combined data is stored in one format per attribute, so the
+  // formats, and with them the number of components stored, have to
+  // agree.
+  for (int i = 0; i < 4; i++) {
+    if (_formats[i] != other._formats[i]) return false;
+  }
 
+  // Only static data, since the combined object is a copy.
+  return _indices.empty() && other._indices.empty() &&
+    !_vertices.empty() && !other._vertices.empty() &&
+    (_drawType == other._drawType) &&
+    (_interleaved == other._interleaved) &&
+    (_twoSided == other._twoSided) &&
+    (_haveConstantColor == other._haveConstantColor) &&
+    (_constantColor == other._constantColor) &&
+    (_colors.empty() == other._colors.empty()) &&
+    (_normals.empty() == other._normals.empty()) &&
+    (_uvs.empty() == other._uvs.empty()) &&
+    (_vertices.name == other._vertices.name) &&
+    (_colors.name == other._colors.name) &&
+    (_normals.name == other._normals.name) &&
+    (_uvs.name == other._uvs.name) &&
+    (_vertices.usage == GL_STATIC_DRAW) &&
+    (other._vertices.usage == GL_STATIC_DRAW) &&
+    (_colors.usage == GL_STATIC_DRAW) &&
+    (other._colors.usage == GL_STATIC_DRAW) &&
+    (_normals.usage == GL_STATIC_DRAW) &&
+    (other._normals.usage == GL_STATIC_DRAW) &&
+    (_uvs.usage == GL_STATIC_DRAW) &&
+    (other._uvs.usage == GL_STATIC_DRAW);
 }
 
-std::string bsgName::printName() const {
-    std::string out;
-    for (std::list<std::string>::const_iterator it = this->begin();
-         it != this->end(); it++) {
-      out += *it + "/";
-    }
-    // The trailing slash is just confusing, so leave it out.
-    return out.substr(0, out.length() - 1);
+void drawableObj::append(const bsgPtr<drawableObj> &other) {
+
+  // The first one sets the pattern.
+  if (_vertices.empty()) {
+    _vertices.name = other->_vertices.name;
+    _colors.name = other->_colors.name;
+    _normals.name = other->_normals.name;
+    _uvs.name = other->_uvs.name;
+    _drawType = other->_drawType;
+    _interleaved = other->_interleaved;
+    _twoSided = other->_twoSided;
+    _haveConstantColor = other->_haveConstantColor;
+    _constantColor = other->_constantColor;
+    for (int i = 0; i < 4; i++) _formats[i] = other->_formats[i];
   }
 
+  _firsts.push_back(_vertices.size());
+  _counts.push_back(other->_count);
 
-glm::mat4 drawableMulti::getModelMatrix() {
-
-  if (_modelMatrixNeedsReset) {
-    glm::mat4 translationMatrix = glm::translate(glm::mat4(1.0f), _position);
-    glm::mat4 rotationMatrix = glm::mat4_cast(_orientation);
-    glm::mat4 scaleMatrix = glm::scale(glm::mat4(1.0f), _scale);
+  _vertices.append(other->_vertices);
+  _colors.append(other->_colors);
+  _normals.append(other->_normals);
+  _uvs.append(other->_uvs);
+  _count = _vertices.size();
 
-    _modelMatrix = translationMatrix * rotationMatrix * scaleMatrix;
-    _modelMatrixNeedsReset = false;
+  _sources.push_back(other);
 
-    //    std::cout << glm::to_string(_modelMatrix) << std::endl;
+  _haveBoundingBox = false;
+  _haveTriangleTree = false;
+  _loadedIntoBuffer = false;
+}
 
-    // bsgUtils::printMat("trans:", translationMatrix);
-    // bsgUtils::printMat("rotat:", rotationMatrix);
-    // bsgUtils::printMat("scale:", scaleMatrix);
-    // bsgUtils::printMat("model:", _modelMatrix);
+GLenum drawableObj::basePrimitive(const GLenum &drawType) {
+
+  switch (drawType) {
+  case GL_TRIANGLES:
+  case GL_TRIANGLE_STRIP:
+  case GL_TRIANGLE_FAN:
+    return GL_TRIANGLES;
+  case GL_LINES:
+  case GL_LINE_STRIP:
+  case GL_LINE_LOOP:
+    return GL_LINES;
+  case GL_POINTS:
+    return GL_POINTS;
+  default:
+    return 0;
   }
-
-  // If there is a parent, get the parent transformation (model)
-  // matrix and use it with this one.
-  if (_parent)
-    return _parent->getModelMatrix() * _modelMatrix;
-  else
-    return _modelMatrix;
 }
 
-std::string drawableMulti::randomName(const std::string &nameRoot) {
-
-  // This is a pretty dopey method, but it seems to work, so long as
-  // the number of characters in each name is big enough.
-  std::string out = nameRoot;
-  for(int i = 0; i < 6; i++) {
-    switch(rand()%3) {
-    case 0:
-      out += ('0' + rand()%10);
-      break;
-    case 1:
-      out += ('A' + rand()%26);
-      break;
-    case 2:
-      out += ('a' + rand()%26);
-      break;
+// Lists the vertices of each separate triangle, line, or point in n
+// vertices drawn with the given draw type.  The numbers are positions
+// in the vertex array, or in the index array if there is one.
+static void primitiveCorners(const GLenum &drawType, const size_t &n,
+                             std::vector<GLuint> &corners) {
+
+  corners.clear();
+  switch (drawType) {
+  case GL_TRIANGLES:
+    for (size_t i = 0; i + 2 < n; i += 3) {
+      corners.push_back(i);
+      corners.push_back(i + 1);
+      corners.push_back(i + 2);
+    }
+    break;
+  case GL_TRIANGLE_STRIP:
+    // Every other triangle of a strip is wound backwards.
+    for (size_t i = 0; i + 2 < n; i++) {
+      corners.push_back((i % 2) ? i + 1 : i);
+      corners.push_back((i % 2) ? i : i + 1);
+      corners.push_back(i + 2);
+    }
+    break;
+  case GL_TRIANGLE_FAN:
+    for (size_t i = 1; i + 1 < n; i++) {
+      corners.push_back(0);
+      corners.push_back(i);
+      corners.push_back(i + 1);
+    }
+    break;
+  case GL_LINES:
+    for (size_t i = 0; i + 1 < n; i += 2) {
+      corners.push_back(i);
+      corners.push_back(i + 1);
+    }
+    break;
+  case GL_LINE_STRIP:
+  case GL_LINE_LOOP:
+    for (size_t i = 0; i + 1 < n; i++) {
+      corners.push_back(i);
+      corners.push_back(i + 1);
+    }
+    if ((drawType == GL_LINE_LOOP) && (n > 2)) {
+      corners.push_back(n - 1);
+      corners.push_back(0);
     }
+    break;
+  case GL_POINTS:
+    for (size_t i = 0; i < n; i++) corners.push_back(i);
+    break;
+  default:
+    break;
   }
-  return out;
 }
 
-bsgNameList drawableCompound::insideBoundingBox(const glm::vec4 &testPoint) {
+bool drawableObj::canBatchWith(const drawableObj &other) const {
+
+  // Only static data, since the batch is a copy.
+  return !other._vertices.empty() &&
+    (basePrimitive(other._drawType) != 0) &&
+    (basePrimitive(_drawType) == basePrimitive(other._drawType)) &&
+    (_vertices.empty() || (_twoSided == other._twoSided)) &&
+    (_vertices.empty() ||
+     ((_haveConstantColor == other._haveConstantColor) &&
+      (_constantColor == other._constantColor))) &&
+    (_colors.empty() == other._colors.empty()) &&
+    (_normals.empty() == other._normals.empty()) &&
+    (_uvs.empty() == other._uvs.empty()) &&
+    (_vertices.name == other._vertices.name) &&
+    (_colors.name == other._colors.name) &&
+    (_normals.name == other._normals.name) &&
+    (_uvs.name == other._uvs.name) &&
+    (other._vertices.usage == GL_STATIC_DRAW) &&
+    (other._colors.usage == GL_STATIC_DRAW) &&
+    (other._normals.usage == GL_STATIC_DRAW) &&
+    (other._uvs.usage == GL_STATIC_DRAW);
+}
 
-  bsgName out;
-  bsgNameList outList;
-  glm::mat4 modelMatrix = getModelMatrix();
+bool drawableObj::appendTransformed(const drawableObj &other,
+                                    const glm::mat4 &matrix) {
+
+  GLenum primitive = basePrimitive(other._drawType);
+  if (primitive == 0) return false;
+
+  size_t n = other._indices.empty() ?
+    std::min((size_t)other._count, other._vertices.size()) :
+    std::min((size_t)other._count, other._indices.size());
+
+  std::vector<GLuint> corners;
+  primitiveCorners(other._drawType, n, corners);
+
+  // The first one sets the pattern.
+  if (_vertices.empty()) {
+    _vertices.name = other._vertices.name;
+    _colors.name = other._colors.name;
+    _normals.name = other._normals.name;
+    _uvs.name = other._uvs.name;
+    _indices.name = "indices";
+    _drawType = primitive;
+    _interleaved = other._interleaved;
+    _twoSided = other._twoSided;
+    _haveConstantColor = other._haveConstantColor;
+    _constantColor = other._constantColor;
+    for (int i = 0; i < 4; i++) _formats[i] = other._formats[i];
+  }
 
-  for (DrawableObjList::iterator it = _objects.begin();
-       it != _objects.end(); it++) {
+  GLuint first = _vertices.size();
+
+  const std::vector<glm::vec4> &vertices = other._vertices.getData();
+  for (std::vector<glm::vec4>::const_iterator it = vertices.begin();
+       it != vertices.end(); it++) {
+    _vertices.addData(matrix * *it);
+  }
 
-    if ((*it)->insideBoundingBox(testPoint, modelMatrix)) {
+  // Normals are directions, so they get the inverse transpose, and
+  // need to be made unit length again if there is any scaling.
+  glm::mat3 normalMatrix = glm::mat3(glm::transpose(glm::inverse(matrix)));
+  const std::vector<glm::vec4> &normals = other._normals.getData();
+  for (std::vector<glm::vec4>::const_iterator it = normals.begin();
+       it != normals.end(); it++) {
+    glm::vec3 normal = normalMatrix * glm::vec3(*it);
+    float length = glm::length(normal);
+    if (length > 0.0f) normal /= length;
+    _normals.addData(glm::vec4(normal, it->w));
+  }
+
+  _colors.append(other._colors);
+  _uvs.append(other._uvs);
+
+  for (std::vector<GLuint>::iterator it = corners.begin();
+       it != corners.end(); it++) {
+    GLuint k = other._indices.empty() ? *it : other._indices[*it];
+    _indices.addData(first + k);
+  }
+  _count = _indices.size();
+
+  _haveBoundingBox = false;
+  _haveTriangleTree = false;
+  _loadedIntoBuffer = false;
+  return true;
+}
+
+void drawableObj::addIndices(const std::vector<GLuint>& indices) {
+
+  _indices = drawableObjData<GLuint>("indices", indices);
+  _count = _indices.size();
+  _haveTriangleTree = false;
+  _loadedIntoBuffer = false;
+}
+
+void drawableObj::setIndices(const std::vector<GLuint>& indices) {
+
+  _indices.setData(indices);
+  _count = _indices.size();
+  _haveTriangleTree = false;
+  _loadedIntoBuffer = false;
+}
+
+// Orders vertex positions by all their attributes at once, so that
+// identical vertices wind up next to each other after a sort.  Absent
+// attributes are passed as NULL and ignored.
+struct weldCompare {
+  const glm::vec4 *v, *c, *n;
+  const glm::vec2 *t;
+
+  template <class T>
+  static int cmp(const T &a, const T &b, const int &len) {
+    for (int k = 0; k < len; k++) {
+      if (a[k] < b[k]) return -1;
+      if (b[k] < a[k]) return 1;
+    }
+    return 0;
+  }
+
+  bool operator()(const GLuint &a, const GLuint &b) const {
+    int r = cmp(v[a], v[b], 4);
+    if ((r == 0) && c) r = cmp(c[a], c[b], 4);
+    if ((r == 0) && n) r = cmp(n[a], n[b], 4);
+    if ((r == 0) && t) r = cmp(t[a], t[b], 2);
+    return r < 0;
+  }
+};
+
+void drawableObj::weld() {
+
+  size_t nVerts = _vertices.size();
+  if (nVerts == 0) return;
+
+  weldCompare comp;
+  comp.v = _vertices.beginAddress();
+  comp.c = _colors.empty() ? NULL : _colors.beginAddress();
+  comp.n = _normals.empty() ? NULL : _normals.beginAddress();
+  comp.t = _uvs.empty() ? NULL : _uvs.beginAddress();
+
+  // Sort a list of vertex positions so the duplicates are adjacent.
+  std::vector<GLuint> order(nVerts);
+  for (GLuint i = 0; i < nVerts; i++) order[i] = i;
+  std::sort(order.begin(), order.end(), comp);
+
+  // Each run of identical vertices is represented by the earliest of
+  // them in the original order.
+  std::vector<GLuint> representative(nVerts);
+  size_t runStart = 0;
+  for (size_t i = 1; i <= nVerts; i++) {
+    if ((i == nVerts) || comp(order[runStart], order[i])) {
+      GLuint first = *std::min_element(order.begin() + runStart,
+                                       order.begin() + i);
+      for (size_t j = runStart; j < i; j++) representative[order[j]] = first;
+      runStart = i;
+    }
+  }
 
-      // If we're here, the point is in the bounding box of at least
-      // one of the member objects of this compound object.  Create a
-      // one-element list of a zero-element name.
-      outList.push_back(out);
-      return outList;
+  // Number the survivors in the order they first appear, so the
+  // welded mesh keeps the locality of the original, and copy them
+  // into the compacted arrays.
+  const GLuint unassigned = 0xFFFFFFFF;
+  std::vector<GLuint> newIndex(nVerts, unassigned);
+  std::vector<GLuint> remap(nVerts);
+  std::vector<glm::vec4> vertices, colors, normals;
+  std::vector<glm::vec2> uvs;
+
+  for (size_t i = 0; i < nVerts; i++) {
+    GLuint r = representative[i];
+    if (newIndex[r] == unassigned) {
+      newIndex[r] = vertices.size();
+      vertices.push_back(comp.v[r]);
+      if (comp.c) colors.push_back(comp.c[r]);
+      if (comp.n) normals.push_back(comp.n[r]);
+      if (comp.t) uvs.push_back(comp.t[r]);
     }
+    remap[i] = newIndex[r];
   }
 
-  // If we're here, the answer is no, so return an empty name.
-  return outList;
+  // Nothing to merge.
+  if (vertices.size() == nVerts) return;
+
+  // Rewrite the index array, or create one if there was none.
+  std::vector<GLuint> indices;
+  if (_indices.empty()) {
+    indices = remap;
+  } else {
+    indices = _indices.getData();
+    for (size_t i = 0; i < indices.size(); i++) indices[i] = remap[indices[i]];
+  }
+
+  _vertices.setData(std::move(vertices));
+  if (comp.c) _colors.setData(std::move(colors));
+  if (comp.n) _normals.setData(std::move(normals));
+  if (comp.t) _uvs.setData(std::move(uvs));
+
+  if (_indices.empty()) {
+    addIndices(indices);
+  } else {
+    setIndices(indices);
+  }
+}
+
+template <class T>
+static void putData(binaryWriter &out, const drawableObjData<T> &data) {
+  out.putString(data.name);
+  out.putArray(data.getData());
 }
 
+template <class T>
+static bool getData(binaryReader &in, drawableObjData<T> &data) {
+  std::string name;
+  std::vector<T> values;
+  if (!in.getString(name) || !in.getArray(values)) return false;
+  data = drawableObjData<T>(name, std::move(values));
+  return true;
+}
 
-void drawableCompound::prepare() {
+void drawableObj::writeBinary(binaryWriter &out) {
 
-  _pShader->useProgram();
-  _pShader->prepare();
+  // Pack the data now, so it needn't be done when it's read back.
+  if (_interleaved && _needsPacking()) _packInterleaved();
+  if (!_haveBoundingBox) findBoundingBox();
 
-  _modelMatrixID = _pShader->getUniformID(_modelMatrixName);
-  _normalMatrixID = _pShader->getUniformID(_normalMatrixName);
-  _viewMatrixID = _pShader->getUniformID(_viewMatrixName);
-  _projMatrixID = _pShader->getUniformID(_projMatrixName);
+  out.putValue<uint32_t>(_drawType);
+  out.putValue<int32_t>(_count);
+  out.putValue<uint32_t>(_twoSided);
+  out.putValue<uint32_t>(_haveConstantColor);
+  out.putValue(_constantColor);
+  out.putValue(_vertexBoundingBoxLower);
+  out.putValue(_vertexBoundingBoxUpper);
 
-  // Prepare each component object.
-  for (DrawableObjList::iterator it = _objects.begin();
-       it != _objects.end(); it++) {
-    (*it)->prepare(_pShader->getProgram());
+  putData(out, _vertices);
+  putData(out, _colors);
+  putData(out, _normals);
+  putData(out, _uvs);
+  putData(out, _indices);
+
+  out.putValue<uint32_t>(_interleaved);
+  if (!_interleaved) return;
+
+  for (int i = 0; i < 4; i++) {
+    out.putValue<int32_t>(_formats[i]);
+    out.putValue<int32_t>(_packedFormats[i]);
   }
+  GLshort layout[8] = { _stride, _colorPos, _normalPos, _uvPos,
+                        _vertexSize, _colorSize, _normalSize, _uvSize };
+  out.putBytes(layout, sizeof(layout));
+  out.putValue(_quantizeCenter);
+  out.putValue(_quantizeHalfSize);
+  out.putValue(_positionMatrix);
+  putData(out, _interleavedData);
 }
 
-void drawableCompound::load() {
+static GLshort formatBytes(const GLFORMATTYPE &format, const GLshort &n);
+
+bool drawableObj::readBinary(binaryReader &in) {
+
+  uint32_t drawType = 0, twoSided = 0, haveConstantColor = 0, interleaved = 0;
+  int32_t count = 0;
+  in.getValue(drawType);
+  in.getValue(count);
+  in.getValue(twoSided);
+  in.getValue(haveConstantColor);
+  in.getValue(_constantColor);
+  in.getValue(_vertexBoundingBoxLower);
+  in.getValue(_vertexBoundingBoxUpper);
+
+  getData(in, _vertices);
+  getData(in, _colors);
+  getData(in, _normals);
+  getData(in, _uvs);
+  getData(in, _indices);
+  in.getValue(interleaved);
+  if (!in.good()) return false;
+
+  size_t nVerts = _vertices.size();
+  if ((!_colors.empty() && (_colors.size() != nVerts)) ||
+      (!_normals.empty() && (_normals.size() != nVerts)) ||
+      (!_uvs.empty() && (_uvs.size() != nVerts))) return false;
+
+  // A damaged file could otherwise have us draw past the ends of the
+  // buffers.
+  if (count < 0) return false;
+  if (_indices.empty()) {
+    if ((size_t)count > nVerts) return false;
+  } else {
+    if ((size_t)count > _indices.size()) return false;
+    const std::vector<GLuint> &indices = _indices.getData();
+    for (std::vector<GLuint>::const_iterator it = indices.begin();
+         it != indices.end(); it++) {
+      if (*it >= nVerts) return false;
+    }
+  }
 
-  _pShader->useProgram();
-  _pShader->load();
+  _drawType = drawType;
+  _count = count;
+  _twoSided = (twoSided != 0);
+  _haveConstantColor = (haveConstantColor != 0);
+  _haveBoundingBox = true;
+  _haveTriangleTree = false;
+  _loadedIntoBuffer = false;
+  _interleaved = (interleaved != 0);
+  if (!_interleaved) return true;
 
-  // Review the current state of the transformation matrices, and pack
-  // them all into the total model matrix.
-  _totalModelMatrix = getModelMatrix();
+  int32_t formats[4], packedFormats[4];
+  for (int i = 0; i < 4; i++) {
+    in.getValue(formats[i]);
+    in.getValue(packedFormats[i]);
+  }
+  GLshort layout[8];
+  const char* p = in.getBytes(sizeof(layout));
+  if (p) memcpy(layout, p, sizeof(layout));
+  glm::vec3 quantizeCenter, quantizeHalfSize;
+  glm::mat4 positionMatrix;
+  in.getValue(quantizeCenter);
+  in.getValue(quantizeHalfSize);
+  in.getValue(positionMatrix);
+  drawableObjData<GLubyte> interleavedData;
+  getData(in, interleavedData);
+  if (!in.good()) return false;
+
+  for (int i = 0; i < 4; i++) _formats[i] = (GLFORMATTYPE)formats[i];
+
+  // The packed data is only good if this context can draw it.
+  // Otherwise the components are still dirty, and get packed again.
+  bool usable = (interleavedData.size() == nVerts * layout[0]);
+  for (int i = 0; i < 4; i++) {
+    if ((layout[4 + i] < 0) || (layout[4 + i] > 4) ||
+        (_resolveFormat((GLDATATYPE)i, layout[4 + i]) != packedFormats[i]))
+      usable = false;
+  }
 
-  // Load each component object.
-  for (DrawableObjList::iterator it = _objects.begin();
-       it != _objects.end(); it++) {
-    (*it)->load();
+  // The attributes have to be laid out the way _packInterleaved()
+  // does it, one after the other, or they could be read from outside
+  // the buffer.
+  if (usable) {
+    GLshort position = 0;
+    for (int i = 0; i < 4; i++) {
+      if ((i > 0) && (layout[i] != position)) usable = false;
+      position += formatBytes((GLFORMATTYPE)packedFormats[i], layout[4 + i]);
+    }
+    if ((position != layout[0]) || (position <= 0)) usable = false;
   }
+  if (!usable) return true;
+
+  _stride = layout[0];
+  _colorPos = layout[1];
+  _normalPos = layout[2];
+  _uvPos = layout[3];
+  _vertexSize = layout[4];
+  _colorSize = layout[5];
+  _normalSize = layout[6];
+  _uvSize = layout[7];
+  for (int i = 0; i < 4; i++) _packedFormats[i] = (GLFORMATTYPE)packedFormats[i];
+  _quantizeCenter = quantizeCenter;
+  _quantizeHalfSize = quantizeHalfSize;
+  _positionMatrix = positionMatrix;
+  _interleavedData = std::move(interleavedData);
+
+  _vertices.setClean();
+  _colors.setClean();
+  _normals.setClean();
+  _uvs.setClean();
+  return true;
 }
 
-void drawableCompound::draw(const glm::mat4& viewMatrix,
-                            const glm::mat4& projMatrix) {
+bool drawableObj::insideLocalBoundingBox(const glm::vec4 &localPoint) {
 
-  _pShader->useProgram();
-  _pShader->draw();
+  if (!_selectable) return false;
 
-  // Load the model matrix.  This adjusts the position of each object.
-  // Remember that all the objects in a compound object use the same
-  // shader and the same model matrix.
-  glUniformMatrix4fv(_modelMatrixID, 1, false, &_totalModelMatrix[0][0]);
+  if (!_haveBoundingBox) findBoundingBox();
 
-  // Calculate the normal matrix to use for lighting.
-  _normalMatrix = glm::transpose(glm::inverse(viewMatrix * _totalModelMatrix));
-  glUniformMatrix4fv(_normalMatrixID, 1, false, &_normalMatrix[0][0]);
+  return
+    (localPoint.x <= _vertexBoundingBoxUpper.x) &&
+    (localPoint.x >= _vertexBoundingBoxLower.x) &&
+    (localPoint.y <= _vertexBoundingBoxUpper.y) &&
+    (localPoint.y >= _vertexBoundingBoxLower.y) &&
+    (localPoint.z <= _vertexBoundingBoxUpper.z) &&
+    (localPoint.z >= _vertexBoundingBoxLower.z);
+}
 
-  // The view and projection matrices come from the scene object, above us.
-  glUniformMatrix4fv(_viewMatrixID, 1, false, &viewMatrix[0][0]);
-  glUniformMatrix4fv(_projMatrixID, 1, false, &projMatrix[0][0]);
+// Orders things (objects, triangles) by the position of their centers along one axis.
+struct centerCompare {
+  const std::vector<glm::vec3> *centers;
+  int axis;
 
-  // std::cout << "view" << glm::to_string(viewMatrix) << std::endl;
-  // std::cout << "normal" << glm::to_string(_normalMatrix) << std::endl;
-  // std::cout << "model" << glm::to_string(_modelMatrix) << std::endl;
-  // std::cout << "proj" << glm::to_string(projMatrix) << std::endl;
+  bool operator()(const int &a, const int &b) const {
+    return (*centers)[a][axis] < (*centers)[b][axis];
+  }
+};
 
-  for (DrawableObjList::iterator it = _objects.begin();
-       it != _objects.end(); it++) {
-    (*it)->draw();
+bool drawableObj::raycast(const glm::vec3 &origin, const glm::vec3 &direction,
+                          float &distance, int &triangle) {
+
+  if (!_selectable) return false;
+
+  if (!_haveTriangleTree) {
+    _triangleTree.build(_vertices.getData(), _indices.getData(),
+                        _drawType, _count);
+    _haveTriangleTree = true;
+  }
+
+  return _triangleTree.intersect(origin, direction, distance, triangle);
+}
+
+void triangleTree::build(const std::vector<glm::vec4> &vertices,
+                         const std::vector<GLuint> &indices,
+                         const GLenum &drawType, const GLsizei &count) {
+
+  clear();
+
+  // Work out which vertices make up each triangle.
+  size_t n = indices.empty() ?
+    std::min((size_t)count, vertices.size()) :
+    std::min((size_t)count, indices.size());
+
+  if (drawableObj::basePrimitive(drawType) != GL_TRIANGLES) return;
+
+  std::vector<GLuint> corners;
+  primitiveCorners(drawType, n, corners);
+
+  int nTriangles = corners.size() / 3;
+  if (nTriangles == 0) return;
+
+  std::vector<glm::vec3> positions(corners.size());
+  std::vector<glm::vec3> centers(nTriangles);
+  std::vector<int> triangles(nTriangles);
+
+  for (int i = 0; i < nTriangles; i++) {
+    for (int j = 0; j < 3; j++) {
+      GLuint k = corners[3 * i + j];
+      if (!indices.empty()) k = indices[k];
+      if (k >= vertices.size())
+        throw std::runtime_error("Index out of range in triangleTree.");
+      positions[3 * i + j] = glm::vec3(vertices[k]);
+    }
+    centers[i] = (positions[3 * i] + positions[3 * i + 1] +
+                  positions[3 * i + 2]) / 3.0f;
+    triangles[i] = i;
   }
+
+  _nodes.reserve(2 * (nTriangles / 4 + 1));
+  _blocks.reserve(nTriangles / 4 + 1);
+  _build(triangles, 0, nTriangles, positions, centers);
 }
 
-void drawableCompound::addObjectBoundingBox(bsgPtr<drawableObj> &obj) {
+int triangleTree::_build(std::vector<int> &triangles,
+                         const int &first, const int &last,
+                         const std::vector<glm::vec3> &corners,
+                         const std::vector<glm::vec3> &centers) {
 
-  obj->findBoundingBox();
+  int index = _nodes.size();
+  _nodes.push_back(treeNode());
 
-  bsgPtr<drawableObj> bb = new drawableObj();
-  std::vector<glm::vec4> bbCorners(24);
-  std::vector<glm::vec4> bbColors(24, glm::vec4(1.0f, 0.0f, 1.0f, 1.0f));
+  glm::vec3 lower = corners[3 * triangles[first]];
+  glm::vec3 upper = lower;
+  for (int i = first; i < last; i++) {
+    for (int j = 0; j < 3; j++) {
+      lower = glm::min(lower, corners[3 * triangles[i] + j]);
+      upper = glm::max(upper, corners[3 * triangles[i] + j]);
+    }
+  }
+  _nodes[index].lower = lower;
+  _nodes[index].upper = upper;
+
+  if (last - first <= 4) {
+
+    // A leaf.  Pack the triangles into a block, one coordinate at a
+    // time.
+    triangleBlock block;
+    memset(&block, 0, sizeof(block));
+
+    for (int i = 0; i < 4; i++) {
+      if (first + i < last) {
+        int t = triangles[first + i];
+        glm::vec3 v0 = corners[3 * t];
+        glm::vec3 e1 = corners[3 * t + 1] - v0;
+        glm::vec3 e2 = corners[3 * t + 2] - v0;
+        for (int k = 0; k < 3; k++) {
+          block.v0[k][i] = v0[k];
+          block.e1[k][i] = e1[k];
+          block.e2[k][i] = e2[k];
+        }
+        block.id[i] = t;
+      } else {
+        block.id[i] = -1;
+      }
+    }
 
-  glm::vec4 bbLower = obj->getBoundingBoxLower();
-  glm::vec4 bbUpper = obj->getBoundingBoxUpper();
+    _nodes[index].left = _nodes[index].right = -1;
+    _nodes[index].block = _blocks.size();
+    _blocks.push_back(block);
+    return index;
+  }
 
-  bbCorners[0] = glm::vec4(bbLower.x, bbLower.y, bbLower.z, 1.0);
-  bbCorners[1] = glm::vec4(bbLower.x, bbLower.y, bbUpper.z, 1.0);
+  // Split at the median of the triangle centers, along the longest
+  // axis of the box.
+  glm::vec3 size = upper - lower;
+  centerCompare compare;
+  compare.centers = &centers;
+  compare.axis = (size.x > size.y) ?
+    ((size.x > size.z) ? 0 : 2) : ((size.y > size.z) ? 1 : 2);
 
-  bbCorners[2] = glm::vec4(bbLower.x, bbLower.y, bbUpper.z, 1.0);
-  bbCorners[3] = glm::vec4(bbLower.x, bbUpper.y, bbUpper.z, 1.0);
+  int middle = (first + last) / 2;
+  std::nth_element(triangles.begin() + first, triangles.begin() + middle,
+                   triangles.begin() + last, compare);
 
-  bbCorners[4] = glm::vec4(bbLower.x, bbLower.y, bbLower.z, 1.0);
-  bbCorners[5] = glm::vec4(bbLower.x, bbUpper.y, bbLower.z, 1.0);
+  int left = _build(triangles, first, middle, corners, centers);
+  int right = _build(triangles, middle, last, corners, centers);
 
-  bbCorners[6] = glm::vec4(bbLower.x, bbUpper.y, bbLower.z, 1.0);
-  bbCorners[7] = glm::vec4(bbUpper.x, bbUpper.y, bbLower.z, 1.0);
+  _nodes[index].left = left;
+  _nodes[index].right = right;
+  _nodes[index].block = -1;
 
-  bbCorners[8] = glm::vec4(bbLower.x, bbLower.y, bbLower.z, 1.0);
-  bbCorners[9] = glm::vec4(bbUpper.x, bbLower.y, bbLower.z, 1.0);
+  return index;
+}
 
-  bbCorners[10] = glm::vec4(bbUpper.x, bbLower.y, bbLower.z, 1.0);
-  bbCorners[11] = glm::vec4(bbUpper.x, bbLower.y, bbUpper.z, 1.0);
+// The ray is tested against all four triangles of the block at once,
+// with the Moller-Trumbore algorithm.
+bool triangleTree::_intersectBlock(const triangleBlock &block,
+                                   const glm::vec3 &origin,
+                                   const glm::vec3 &direction,
+                                   float &distance, int &triangle) const {
+
+  float t[4];
+  int hit[4];
+
+#ifdef BSG_USE_SSE
+  const __m128 eps = _mm_set1_ps(1.0e-12f);
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps(1.0f);
+
+  __m128 dx = _mm_set1_ps(direction.x);
+  __m128 dy = _mm_set1_ps(direction.y);
+  __m128 dz = _mm_set1_ps(direction.z);
+
+  __m128 e1x = _mm_loadu_ps(block.e1[0]);
+  __m128 e1y = _mm_loadu_ps(block.e1[1]);
+  __m128 e1z = _mm_loadu_ps(block.e1[2]);
+  __m128 e2x = _mm_loadu_ps(block.e2[0]);
+  __m128 e2y = _mm_loadu_ps(block.e2[1]);
+  __m128 e2z = _mm_loadu_ps(block.e2[2]);
+
+  // p = d x e2
+  __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+  __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+  __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+
+  __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)),
+                          _mm_mul_ps(e1z, pz));
+  __m128 absDet = _mm_max_ps(det, _mm_sub_ps(zero, det));
+  __m128 invDet = _mm_div_ps(one, det);
+
+  // s = o - v0
+  __m128 sx = _mm_sub_ps(_mm_set1_ps(origin.x), _mm_loadu_ps(block.v0[0]));
+  __m128 sy = _mm_sub_ps(_mm_set1_ps(origin.y), _mm_loadu_ps(block.v0[1]));
+  __m128 sz = _mm_sub_ps(_mm_set1_ps(origin.z), _mm_loadu_ps(block.v0[2]));
+
+  __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px),
+                                              _mm_mul_ps(sy, py)),
+                                   _mm_mul_ps(sz, pz)), invDet);
+
+  // q = s x e1
+  __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+  __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+  __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+
+  __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx),
+                                              _mm_mul_ps(dy, qy)),
+                                   _mm_mul_ps(dz, qz)), invDet);
+  __m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx),
+                                               _mm_mul_ps(e2y, qy)),
+                                    _mm_mul_ps(e2z, qz)), invDet);
+
+  __m128 mask = _mm_cmpgt_ps(absDet, eps);
+  mask = _mm_and_ps(mask, _mm_cmpge_ps(u, zero));
+  mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+  mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), one));
+  mask = _mm_and_ps(mask, _mm_cmpgt_ps(tt, zero));
+  mask = _mm_and_ps(mask, _mm_cmplt_ps(tt, _mm_set1_ps(distance)));
+
+  int bits = _mm_movemask_ps(mask);
+  if (!bits) return false;
+
+  _mm_storeu_ps(t, tt);
+  for (int i = 0; i < 4; i++) hit[i] = (bits >> i) & 1;
+#else
+  for (int i = 0; i < 4; i++) {
+    glm::vec3 v0(block.v0[0][i], block.v0[1][i], block.v0[2][i]);
+    glm::vec3 e1(block.e1[0][i], block.e1[1][i], block.e1[2][i]);
+    glm::vec3 e2(block.e2[0][i], block.e2[1][i], block.e2[2][i]);
 
-  bbCorners[12] = glm::vec4(bbUpper.x, bbUpper.y, bbUpper.z, 1.0);
-  bbCorners[13] = glm::vec4(bbLower.x, bbUpper.y, bbUpper.z, 1.0);
+    hit[i] = 0;
 
-  bbCorners[14] = glm::vec4(bbLower.x, bbUpper.y, bbUpper.z, 1.0);
-  bbCorners[15] = glm::vec4(bbLower.x, bbUpper.y, bbLower.z, 1.0);
+    glm::vec3 p = glm::cross(direction, e2);
+    float det = glm::dot(e1, p);
+    if (fabs(det) <= 1.0e-12f) continue;
+    float invDet = 1.0f / det;
 
-  bbCorners[16] = glm::vec4(bbUpper.x, bbUpper.y, bbUpper.z, 1.0);
-  bbCorners[17] = glm::vec4(bbUpper.x, bbLower.y, bbUpper.z, 1.0);
+    glm::vec3 s = origin - v0;
+    float u = glm::dot(s, p) * invDet;
+    if ((u < 0.0f) || (u > 1.0f)) continue;
 
-  bbCorners[18] = glm::vec4(bbUpper.x, bbLower.y, bbUpper.z, 1.0);
-  bbCorners[19] = glm::vec4(bbLower.x, bbLower.y, bbUpper.z, 1.0);
+    glm::vec3 q = glm::cross(s, e1);
+    float v = glm::dot(direction, q) * invDet;
+    if ((v < 0.0f) || (u + v > 1.0f)) continue;
 
-  bbCorners[20] = glm::vec4(bbUpper.x, bbUpper.y, bbUpper.z, 1.0);
-  bbCorners[21] = glm::vec4(bbUpper.x, bbUpper.y, bbLower.z, 1.0);
+    t[i] = glm::dot(e2, q) * invDet;
+    hit[i] = (t[i] > 0.0f) && (t[i] < distance);
+  }
+#endif
 
-  bbCorners[22] = glm::vec4(bbUpper.x, bbUpper.y, bbLower.z, 1.0);
-  bbCorners[23] = glm::vec4(bbUpper.x, bbLower.y, bbLower.z, 1.0);
+  bool out = false;
+  for (int i = 0; i < 4; i++) {
+    if (hit[i] && (block.id[i] >= 0) && (t[i] < distance)) {
+      distance = t[i];
+      triangle = block.id[i];
+      out = true;
+    }
+  }
+  return out;
+}
 
-  // This is a bit hackish; should query to use the same name as in
-  // obj->_vertices, etc.
-  bb->addData(GLDATA_VERTICES, "position", bbCorners);
-  bb->addData(GLDATA_COLORS, "color", bbColors);
-  bb->setDrawType(GL_LINES);
+// Where does a ray enter a box?  Returns false if it misses, or if it
+// enters farther away than maxDistance.
+static bool rayHitsBox(const glm::vec3 &origin, const glm::vec3 &invDirection,
+                       const glm::vec3 &lower, const glm::vec3 &upper,
+                       const float &maxDistance, float &entry) {
 
-  // std::cout << bb << std::endl;
+  glm::vec3 t0 = (lower - origin) * invDirection;
+  glm::vec3 t1 = (upper - origin) * invDirection;
+  glm::vec3 tNear = glm::min(t0, t1);
+  glm::vec3 tFar = glm::max(t0, t1);
 
-  // for (int i = 0; i < 24; i++) {
-  //   std::cout << "corner:" << bbCorners[i].x << "," << bbCorners[i].y << "," << bbCorners[i].z << " color:" << bbColors[i].r << "," << bbColors[i].g << "," << bbColors[i].b << std::endl;
-  // }
+  entry = fmax(fmax(tNear.x, tNear.y), fmax(tNear.z, 0.0f));
+  float exit = fmin(fmin(tFar.x, tFar.y), fmin(tFar.z, maxDistance));
 
-  addObject(bb);
+  return entry <= exit;
 }
 
+bool triangleTree::intersect(const glm::vec3 &origin,
+                             const glm::vec3 &direction,
+                             float &distance, int &triangle) const {
 
+  if (_nodes.empty()) return false;
 
-drawableCollection::drawableCollection() {
-  // Seed a random number generator to generate default names randomly.
-  #ifdef WIN32
-  srand(GetTickCount());
-  #else
-  srand(time(NULL));
-  #endif
-  _name = randomName("coll");
+  glm::vec3 invDirection = 1.0f / direction;
+  bool out = false;
+  float entry;
+
+  if (!rayHitsBox(origin, invDirection, _nodes[0].lower, _nodes[0].upper,
+                  distance, entry)) return false;
+
+  // The tree is built with median splits, so it's balanced, and this
+  // is plenty deep.
+  int stack[64];
+  int top = 0;
+  stack[top++] = 0;
+
+  while (top > 0) {
+    const treeNode &node = _nodes[stack[--top]];
+
+    if (node.block >= 0) {
+      if (_intersectBlock(_blocks[node.block], origin, direction,
+                          distance, triangle)) out = true;
+      continue;
+    }
+
+    // Visit the nearer child first, so the farther one is more
+    // likely to be skipped.
+    float leftEntry, rightEntry;
+    bool hitLeft = rayHitsBox(origin, invDirection, _nodes[node.left].lower,
+                              _nodes[node.left].upper, distance, leftEntry);
+    bool hitRight = rayHitsBox(origin, invDirection, _nodes[node.right].lower,
+                               _nodes[node.right].upper, distance, rightEntry);
+
+    if (hitLeft && hitRight) {
+      if (leftEntry < rightEntry) {
+        stack[top++] = node.right;
+        stack[top++] = node.left;
+      } else {
+        stack[top++] = node.left;
+        stack[top++] = node.right;
+      }
+    } else if (hitLeft) {
+      stack[top++] = node.left;
+    } else if (hitRight) {
+      stack[top++] = node.right;
+    }
+  }
+
+  return out;
 }
 
-drawableCollection::drawableCollection (const std::string name) :
-  drawableMulti(name) {
-  // Seed a random number generator to generate default names randomly.
-  #ifdef WIN32
-  srand(GetTickCount());
-  #else
-  srand(time(NULL));
-  #endif
+void drawableObj::_getAttribLocations(GLuint programID) {
+
+  bool badID = false;
+
+  _vertices.ID = glGetAttribLocation(programID, _vertices.name.c_str());
+
+  // Check to make sure the ID awarded is sane.  If not, probably the
+  // name does not match the name in the shader.
+  if (_vertices.ID < 0) {
+    std::cerr << "** Caution: Bad ID for vertices attribute '" << _vertices.name << "'" << std::endl;
+    badID = true;
+  }
+
+  if (_haveConstantColor) {
+    // The shader needn't use it.
+    _colors.ID = glGetAttribLocation(programID, _colors.name.c_str());
+  } else if (!_colors.empty()) {
+    _colors.ID = glGetAttribLocation(programID, _colors.name.c_str());
+
+    if (_colors.ID < 0) {
+      std::cerr << "** Caution: Bad ID for colors attribute '" << _colors.name << "'" << std::endl;
+      badID = true;
+    }
+  }
+  if (!_normals.empty()) {
+    _normals.ID = glGetAttribLocation(programID, _normals.name.c_str());
+
+    if (_normals.ID < 0) {
+      std::cerr << "** Caution: Bad ID for normals attribute '" << _normals.name << "'" << std::endl;
+      badID = true;
+    }
+  }
+  if (!_uvs.empty()) {
+    _uvs.ID = glGetAttribLocation(programID, _uvs.name.c_str());
+
+    if (_uvs.ID < 0) {
+      std::cerr << "** Caution: Bad ID for texture attribute '" << _uvs.name << "'" << std::endl;
+      badID = true;
+    }
+  }
+
+  if (badID) {
+    std::cerr << "This can be caused either by a spelling error, or by not using the" << std::endl << "attribute within the shader code." << std::endl;
+  }
+}
+
+void drawableObj::findBoundingBox() {
+
+  // Find the bounding box for this object.
+  _vertexBoundingBoxLower = glm::vec4(1.0e35, 1.0e35, 1.0e35, 1.0f);
+  _vertexBoundingBoxUpper = glm::vec4(-1.0e35, -1.0e35, -1.0e35, 1.0f);
+
+  // Don't use a templated accessor to test the for loop (very slow).
+  const std::vector<glm::vec4> &data = _vertices.getData();
+
+  for (std::vector<glm::vec4>::const_iterator it = data.begin();
+       it != data.end(); it++) {
+
+    _vertexBoundingBoxUpper.x = fmax((*it).x, _vertexBoundingBoxUpper.x);
+    _vertexBoundingBoxUpper.y = fmax((*it).y, _vertexBoundingBoxUpper.y);
+    _vertexBoundingBoxUpper.z = fmax((*it).z, _vertexBoundingBoxUpper.z);
+
+    _vertexBoundingBoxLower.x = fmin((*it).x, _vertexBoundingBoxLower.x);
+    _vertexBoundingBoxLower.y = fmin((*it).y, _vertexBoundingBoxLower.y);
+    _vertexBoundingBoxLower.z = fmin((*it).z, _vertexBoundingBoxLower.z);
+  }
+
+  // We don't want any zero-width bounding boxes.
+  if (_vertexBoundingBoxUpper.x == _vertexBoundingBoxLower.x) {
+    _vertexBoundingBoxUpper.x += _boundingBoxMin;
+    _vertexBoundingBoxLower.x -= _boundingBoxMin;
+  }
+  if (_vertexBoundingBoxUpper.y == _vertexBoundingBoxLower.y) {
+    _vertexBoundingBoxUpper.y += _boundingBoxMin;
+    _vertexBoundingBoxLower.y -= _boundingBoxMin;
+  }
+  if (_vertexBoundingBoxUpper.z == _vertexBoundingBoxLower.z) {
+    _vertexBoundingBoxUpper.z += _boundingBoxMin;
+    _vertexBoundingBoxLower.z -= _boundingBoxMin;
+  }
+
+  _haveBoundingBox = true;
+  _boundingBoxVersion++;
+}
+
+bool drawableObj::vertexArraysSupported() {
+
+  return GLEW_VERSION_3_0 || GLEW_ARB_vertex_array_object;
+}
+
+void drawableObj::prepare(GLuint programID) {
+
+  // A shared object may have been prepared for this program by
+  // another compound already.  If nothing has changed since, there's
+  // nothing to do.
+  VertexArrayMap::iterator it = _vertexArrays.find(programID);
+  bool isNew = (it == _vertexArrays.end());
+  if (_loadedIntoBuffer && !isNew) return;
+
+  if (!_haveBoundingBox) findBoundingBox();
+
+  if (_interleaved) {
+    _prepareInterleaved(programID);
+  } else {
+    _prepareSeparate(programID);
+  }
+
+  // Remember this program's attribute locations, with a vertex array
+  // object to record the setup that uses them.  It is only set up
+  // (again) if it is new, or the locations have changed.
+  if (isNew) _deleteStaleVertexArrays();
+  vertexArray &array = _vertexArrays[programID];
+  if (isNew) {
+    array.ID = 0;
+    if (vertexArraysSupported()) glGenVertexArrays(1, &array.ID);
+  }
+
+  GLint locations[4] = { _vertices.ID, _colors.ID, _normals.ID, _uvs.ID };
+  if (isNew || memcmp(locations, array.locations, sizeof(locations))) {
+    memcpy(array.locations, locations, sizeof(locations));
+    array.needsSetup = true;
+  }
+}
+
+void drawableObj::_deleteStaleVertexArrays() {
+
+  // A program that has been deleted, say because its shader was
+  // compiled again, will never be drawn with, so its vertex array
+  // object goes, too.
+  VertexArrayMap::iterator it = _vertexArrays.begin();
+  while (it != _vertexArrays.end()) {
+    if (glIsProgram(it->first)) {
+      it++;
+    } else {
+      if (it->second.ID) glDeleteVertexArrays(1, &it->second.ID);
+      _vertexArrays.erase(it++);
+    }
+  }
+}
+
+void drawableObj::_vertexArraysNeedSetup() {
+
+  for (VertexArrayMap::iterator it = _vertexArrays.begin();
+       it != _vertexArrays.end(); it++) {
+    it->second.needsSetup = true;
+  }
+}
+
+void drawableObj::_useAttribLocations(const vertexArray &array) {
+
+  _vertices.ID = array.locations[0];
+  _colors.ID = array.locations[1];
+  _normals.ID = array.locations[2];
+  _uvs.ID = array.locations[3];
+}
+
+// Copies N floats per vertex from a source array into every stride'th
+// place of the destination.  With N fixed, the compiler can unroll
+// the inner loop.
+template <int N>
+static void packComponents(float* dest, const size_t &destStride,
+                           const float* src, const size_t &srcStride,
+                           const size_t &count) {
+  for (size_t i = 0; i < count; i++) {
+    for (int j = 0; j < N; j++) dest[j] = src[j];
+    dest += destStride;
+    src += srcStride;
+  }
+}
+
+static void packAttribute(float* dest, const size_t &destStride,
+                          const float* src, const size_t &srcStride,
+                          const int &components, const size_t &count) {
+  switch (components) {
+  case 2:
+    packComponents<2>(dest, destStride, src, srcStride, count);
+    break;
+  case 3:
+    packComponents<3>(dest, destStride, src, srcStride, count);
+    break;
+  case 4:
+    packComponents<4>(dest, destStride, src, srcStride, count);
+    break;
+  }
+}
+
+// Returns 3 if the fourth component of every element in a range is
+// 1.0, in which case it can be left out, and OpenGL will supply it.
+// Otherwise 4.
+static GLshort vec4Size(const std::vector<glm::vec4> &data,
+                        const size_t &begin, const size_t &end) {
+  for (size_t i = begin; i < std::min(end, data.size()); i++) {
+    if (data[i].w != 1.0f) return 4;
+  }
+  return 3;
+}
+
+// Works out how many components of a vec4 attribute go in the
+// interleaved array.  If only part of it has changed, only that part
+// has to be checked, unless the answer was 3 before.
+static GLshort vec4Size(const drawableObjData<glm::vec4> &data,
+                        const GLshort &oldSize) {
+  if (data.empty()) return 0;
+  if (!data.isDirty()) return oldSize;
+  if ((oldSize != 0) && ((data.dirtyBegin > 0) || (data.dirtyEnd < data.size()))) {
+    // A partial change can make a 3 into a 4, but telling whether a 4
+    // can become a 3 would mean looking at everything.
+    if (oldSize == 4) return 4;
+    return vec4Size(data.getData(), data.dirtyBegin, data.dirtyEnd);
+  }
+  return vec4Size(data.getData(), 0, data.size());
+}
+
+// How many components of an attribute with n of them are stored in a
+// format.  The 16-bit formats round up to an even number, to keep
+// each vertex's data on four-byte boundaries, and the packed ones
+// always hold four.  OpenGL would fill in any missing components
+// with 0, 0, 0, 1, and so do we.
+static GLshort formatComponents(const GLFORMATTYPE &format, const GLshort &n) {
+  if (n == 0) return 0;
+  switch (format) {
+  case GLFORMAT_HALF:
+  case GLFORMAT_SNORM16:
+    return (n + 1) & ~1;
+  case GLFORMAT_UNORM8:
+  case GLFORMAT_SNORM10:
+    return 4;
+  default:
+    return n;
+  }
+}
+
+// How many bytes an attribute with n components takes in a format.
+static GLshort formatBytes(const GLFORMATTYPE &format, const GLshort &n) {
+  switch (format) {
+  case GLFORMAT_HALF:
+  case GLFORMAT_SNORM16:
+    return 2 * formatComponents(format, n);
+  case GLFORMAT_UNORM8:
+  case GLFORMAT_SNORM10:
+    return formatComponents(format, n);
+  default:
+    return sizeof(float) * n;
+  }
+}
+
+// Converts one element of an attribute, with n components, to a format.
+static void packElement(GLubyte* dest, const float* src, const int &n,
+                        const GLFORMATTYPE &format) {
+
+  int packedN = formatComponents(format, n);
+  float in[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+  for (int k = 0; k < n; k++) in[k] = src[k];
+
+  switch (format) {
+  case GLFORMAT_HALF: {
+    GLushort out[4];
+    for (int k = 0; k < packedN; k++) out[k] = glm::packHalf1x16(in[k]);
+    memcpy(dest, out, packedN * sizeof(GLushort));
+    break;
+  }
+  case GLFORMAT_SNORM16: {
+    GLushort out[4];
+    for (int k = 0; k < packedN; k++) out[k] = glm::packSnorm1x16(in[k]);
+    memcpy(dest, out, packedN * sizeof(GLushort));
+    break;
+  }
+  case GLFORMAT_UNORM8:
+    for (int k = 0; k < 4; k++) dest[k] = glm::packUnorm1x8(in[k]);
+    break;
+  case GLFORMAT_SNORM10: {
+    // The x is in the low bits, as GL_INT_2_10_10_10_REV wants.
+    GLuint out = glm::packSnorm3x10_1x2(glm::vec4(in[0], in[1], in[2], in[3]));
+    memcpy(dest, &out, sizeof(GLuint));
+    break;
+  }
+  default:
+    memcpy(dest, in, packedN * sizeof(float));
+    break;
+  }
+}
+
+// Packs the dirty range of one attribute into the interleaved array,
+// converting it to the given format, and widens the range [lo, hi)
+// of vertices that have been packed.  The stride is in bytes.  For
+// quantized positions, the box center and half size are given, and
+// the positions are fit into the [-1,1] box first.
+template <class T>
+static void packDirty(GLubyte* dest, const size_t &stride,
+                      drawableObjData<T> &src, const int &components,
+                      const GLFORMATTYPE &format,
+                      const size_t &count, size_t &lo, size_t &hi,
+                      const glm::vec3* center = NULL,
+                      const glm::vec3* halfSize = NULL) {
+
+  if (src.empty() || !src.isDirty()) return;
+
+  // The attributes should have one element per vertex.  If not,
+  // pack what there is, and leave the rest zero.
+  if (src.size() < count)
+    std::cerr << "** Caution: attribute '" << src.name
+              << "' has fewer elements than there are vertices." << std::endl;
+
+  size_t begin = src.dirtyBegin;
+  size_t end = std::min(std::min(src.dirtyEnd, src.size()), count);
+
+  if (end > begin) {
+    const float* in = (const float*)(src.beginAddress() + begin);
+    size_t srcStride = sizeof(T) / sizeof(float);
+
+    if ((format == GLFORMAT_FLOAT) && !center) {
+      // The common case is just copying.
+      packAttribute((float*)(dest + begin * stride), stride / sizeof(float),
+                    in, srcStride, components, end - begin);
+    } else {
+      GLubyte* out = dest + begin * stride;
+      float element[4];
+      for (size_t i = begin; i < end; i++) {
+        for (int k = 0; k < components; k++) element[k] = in[k];
+        if (center) {
+          for (int k = 0; k < 3; k++)
+            element[k] = (element[k] - (*center)[k]) / (*halfSize)[k];
+        }
+        packElement(out, element, components, format);
+        out += stride;
+        in += srcStride;
+      }
+    }
+    lo = std::min(lo, begin);
+    hi = std::max(hi, end);
+  }
+
+  // The component arrays are not loaded into buffers of their own in
+  // interleaved mode, so this is as clean as they get.
+  src.setClean();
+}
+
+void drawableObj::_packInterleaved() {
+
+  size_t count = _vertices.size();
+
+  // Figure out the sizes of the attributes, and so the layout of each
+  // vertex's data.
+  _vertexSize = vec4Size(_vertices, _vertexSize);
+  _colorSize = vec4Size(_colors, _colorSize);
+  _normalSize = _normals.empty() ? 0 : 3;
+  _uvSize = _uvs.empty() ? 0 : 2;
+
+  bool wasQuantized = isQuantized();
+
+  GLFORMATTYPE formats[4];
+  formats[GLDATA_VERTICES] = _resolveFormat(GLDATA_VERTICES, _vertexSize);
+  formats[GLDATA_COLORS] = _resolveFormat(GLDATA_COLORS, _colorSize);
+  formats[GLDATA_NORMALS] = _resolveFormat(GLDATA_NORMALS, _normalSize);
+  formats[GLDATA_TEXCOORDS] = _resolveFormat(GLDATA_TEXCOORDS, _uvSize);
+
+  GLshort colorPos = formatBytes(formats[GLDATA_VERTICES], _vertexSize);
+  GLshort normalPos = colorPos + formatBytes(formats[GLDATA_COLORS], _colorSize);
+  GLshort uvPos = normalPos + formatBytes(formats[GLDATA_NORMALS], _normalSize);
+  GLshort stride = uvPos + formatBytes(formats[GLDATA_TEXCOORDS], _uvSize);
+
+  // If the layout has changed, everything has to be repacked.
+  bool layoutChanged = (stride != _stride) ||
+    (_interleavedData.size() != count * stride) ||
+    (colorPos != _colorPos) || (normalPos != _normalPos) || (uvPos != _uvPos);
+  for (int i = 0; i < 4; i++) {
+    if (formats[i] != _packedFormats[i]) layoutChanged = true;
+  }
+  if (layoutChanged) {
+    _interleavedData.resize(count * stride);
+    _vertices.setAllDirty();
+    _colors.setAllDirty();
+    _normals.setAllDirty();
+    _uvs.setAllDirty();
+  }
+
+  _stride = stride;
+  _colorPos = colorPos;
+  _normalPos = normalPos;
+  _uvPos = uvPos;
+  for (int i = 0; i < 4; i++) _packedFormats[i] = formats[i];
+
+  // Quantized positions need a box to be quantized in.  If it has to
+  // grow, they are all packed again.
+  if (isQuantized() && _vertices.isDirty()) {
+    bool all = !wasQuantized ||
+      ((_vertices.dirtyBegin == 0) && (_vertices.dirtyEnd >= count));
+    if (_setQuantizeBox(all)) _vertices.setAllDirty();
+  }
+
+  GLubyte* dest = _interleavedData.beginAddress();
+  size_t lo = count, hi = 0;
+
+  packDirty(dest, stride, _vertices, _vertexSize,
+            formats[GLDATA_VERTICES], count, lo, hi,
+            isQuantized() ? &_quantizeCenter : NULL, &_quantizeHalfSize);
+  packDirty(dest + _colorPos, stride, _colors, _colorSize,
+            formats[GLDATA_COLORS], count, lo, hi);
+  packDirty(dest + _normalPos, stride, _normals, _normalSize,
+            formats[GLDATA_NORMALS], count, lo, hi);
+  packDirty(dest + _uvPos, stride, _uvs, _uvSize,
+            formats[GLDATA_TEXCOORDS], count, lo, hi);
+
+  if (hi > lo) _interleavedData.setDirty(lo * stride, hi * stride);
+}
+
+bool drawableObj::formatSupported(const GLFORMATTYPE &format) {
+
+  switch (format) {
+  case GLFORMAT_HALF:
+    return GLEW_VERSION_3_0 || GLEW_ARB_half_float_vertex;
+  case GLFORMAT_SNORM10:
+    return GLEW_VERSION_3_3 || GLEW_ARB_vertex_type_2_10_10_10_rev;
+  default:
+    return true;
+  }
+}
+
+void drawableObj::setFormat(const GLDATATYPE &type, const GLFORMATTYPE &format) {
+
+  bool fits;
+  switch (format) {
+  case GLFORMAT_UNORM8:
+    fits = (type == GLDATA_COLORS);
+    break;
+  case GLFORMAT_SNORM10:
+    fits = (type == GLDATA_NORMALS);
+    break;
+  case GLFORMAT_SNORM16:
+    fits = (type == GLDATA_VERTICES) || (type == GLDATA_NORMALS);
+    break;
+  default:
+    fits = true;
+  }
+  if (!fits) {
+    std::cerr << "** Caution: format " << format
+              << " can't be used for attribute " << type << "." << std::endl;
+    return;
+  }
+
+  if (format == _formats[type]) return;
+  _formats[type] = format;
+  if (format != GLFORMAT_FLOAT) setInterleaved(true);
+
+  // The layout changes, so it all has to be packed and loaded again.
+  _vertices.setAllDirty();
+  _loadedIntoBuffer = false;
+}
+
+void drawableObj::setCompactFormats() {
+
+  setFormat(GLDATA_VERTICES, GLFORMAT_SNORM16);
+  setFormat(GLDATA_COLORS, GLFORMAT_UNORM8);
+  setFormat(GLDATA_NORMALS, GLFORMAT_SNORM10);
+  setFormat(GLDATA_TEXCOORDS, GLFORMAT_HALF);
+}
+
+GLFORMATTYPE drawableObj::_resolveFormat(const GLDATATYPE &type,
+                                         const GLshort &size) {
+
+  GLFORMATTYPE format = _formats[type];
+
+  // The quantizing box only covers x, y, and z, so positions with a
+  // w other than 1.0 stay as they are.
+  if ((type == GLDATA_VERTICES) && (format == GLFORMAT_SNORM16) && (size == 4))
+    format = GLFORMAT_FLOAT;
+
+  if ((format == GLFORMAT_SNORM10) && !formatSupported(format))
+    format = GLFORMAT_SNORM16;
+  if ((format == GLFORMAT_HALF) && !formatSupported(format))
+    format = GLFORMAT_FLOAT;
+
+  return format;
+}
+
+bool drawableObj::_setQuantizeBox(const bool &all) {
+
+  // Find a box around the changed positions, or all of them.
+  const std::vector<glm::vec4> &vertices = _vertices.getData();
+  size_t begin = all ? 0 : _vertices.dirtyBegin;
+  size_t end = all ? vertices.size() :
+    std::min(_vertices.dirtyEnd, vertices.size());
+  if (end <= begin) return false;
+
+  glm::vec3 lower = glm::vec3(vertices[begin]);
+  glm::vec3 upper = lower;
+  for (size_t i = begin + 1; i < end; i++) {
+    lower = glm::min(lower, glm::vec3(vertices[i]));
+    upper = glm::max(upper, glm::vec3(vertices[i]));
+  }
+
+  // If some positions changed, but stayed inside the old box, the
+  // rest of them needn't be packed again.
+  if (!all) {
+    if (glm::all(glm::greaterThanEqual(lower, _quantizeCenter - _quantizeHalfSize)) &&
+        glm::all(glm::lessThanEqual(upper, _quantizeCenter + _quantizeHalfSize)))
+      return false;
+    return _setQuantizeBox(true);
+  }
+
+  _quantizeCenter = 0.5f * (lower + upper);
+  _quantizeHalfSize = 0.5f * (upper - lower);
+
+  // A flat object is flat in some direction, and we don't want to
+  // divide by zero.
+  for (int k = 0; k < 3; k++) {
+    if (_quantizeHalfSize[k] <= 0.0f) _quantizeHalfSize[k] = 1.0f;
+  }
+
+  _positionMatrix = glm::scale(glm::translate(glm::mat4(1.0f), _quantizeCenter),
+                               _quantizeHalfSize);
+  return true;
+}
+
+void drawableObj::_prepareInterleaved(GLuint programID) {
+
+  // The buffers are found when the data is loaded.  Interleave the
+  // data first.
+  if (_needsPacking()) _packInterleaved();
+
+  _getAttribLocations(programID);
+
+  _loadInterleaved();
+}
+
+void drawableObj::_prepareSeparate(GLuint programID) {
+
+  _getAttribLocations(programID);
+
+  // Put the data in its buffers, for practice.  Static data goes in a
+  // bufferArena, and other data gets buffers of its own.
+  _loadSeparate();
+
+}
+
+
+void drawableObj::load() {
+
+  // if (_loadedIntoBuffer)
+  //   std::cout << "no need " << std::endl;
+  // else
+  //   std::cout << "load!!! " << std::endl;
+
+  if (_interleaved) {
+    _loadInterleaved();
+  } else {
+    _loadSeparate();
+  }
+}
+
+void drawableObj::_loadInterleaved() {
+
+  if (!_loadedIntoBuffer || _streaming()) {
+
+    // Bring the interleaved data up to date with any changes.
+    if (_needsPacking()) _packInterleaved();
+
+    _interleavedData.load(GL_ARRAY_BUFFER);
+
+    _loadIndices();
+    _loadedIntoBuffer = true;
+
+    // The layout, or where the data is, may have changed.
+    _vertexArraysNeedSetup();
+  }
+}
+
+
+void drawableObj::_loadSeparate() {
+
+  // Each array takes care of loading only what has changed.  Streamed
+  // arrays may have to be rewritten into the ring even if they have
+  // not changed.
+  if (!_loadedIntoBuffer || _streaming()) {
+    _vertices.load(GL_ARRAY_BUFFER);
+    if (!_colors.empty()) _colors.load(GL_ARRAY_BUFFER);
+    if (!_normals.empty()) _normals.load(GL_ARRAY_BUFFER);
+    if (!_uvs.empty()) _uvs.load(GL_ARRAY_BUFFER);
+
+    _loadIndices();
+    _loadedIntoBuffer = true;
+
+    // Streamed data may have moved.
+    _vertexArraysNeedSetup();
+  }
+}
+
+void drawableObj::_loadIndices() {
+
+  if (!_indices.empty()) _indices.loadBuffer(GL_ELEMENT_ARRAY_BUFFER);
+}
+
+
+void drawableObj::draw(const GLsizei &instanceCount) {
+
+  // Use the attribute locations of the program we're drawn with.
+  VertexArrayMap::iterator it =
+    _vertexArrays.find(shaderMgr::getCurrentProgram());
+  if (it != _vertexArrays.end()) {
+    vertexArray &array = it->second;
+    _useAttribLocations(array);
+
+    // With a vertex array object, the attribute setup is already
+    // done.  The instance attributes of a drawableInstanced are set
+    // up outside of it, though, so instanced draws go the long way.
+    if (array.ID && (instanceCount == 1)) {
+      glBindVertexArray(array.ID);
+      if (array.needsSetup) {
+        _setupAttributes();
+        array.needsSetup = false;
+      }
+      _setConstantColor();
+      _drawPrimitives(instanceCount);
+      _clearConstantColor();
+
+      // Unbind it, so nobody else's setup lands in it.
+      glBindVertexArray(0);
+      return;
+    }
+  }
+
+  _setupAttributes();
+  _setConstantColor();
+  _drawPrimitives(instanceCount);
+  _clearConstantColor();
+
+  // Now disable the attribute arrays so they won't interfere with the
+  // next draw.
+  glDisableVertexAttribArray(_vertices.ID);
+  if (!_colors.empty()) glDisableVertexAttribArray(_colors.ID);
+  if (!_normals.empty()) glDisableVertexAttribArray(_normals.ID);
+  if (!_uvs.empty()) glDisableVertexAttribArray(_uvs.ID);
+  if (!_indices.empty()) glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+void drawableObj::setConstantColor(const std::string &name,
+                                   const glm::vec4 &color) {
+
+  _colors = drawableObjData<glm::vec4>(name, std::vector<glm::vec4>());
+  _haveConstantColor = true;
+  _constantColor = color;
+  _loadedIntoBuffer = false;
+}
+
+void drawableObj::_setConstantColor() {
+
+  // The color array is never enabled for an object with a constant
+  // color, so the attribute takes this value at every vertex.
+  if (_haveConstantColor && (_colors.ID >= 0))
+    glVertexAttrib4fv(_colors.ID, &_constantColor[0]);
+}
+
+void drawableObj::_clearConstantColor() {
+
+  // Back to the OpenGL default, for objects that expect it.
+  if (_haveConstantColor && (_colors.ID >= 0))
+    glVertexAttrib4f(_colors.ID, 0.0f, 0.0f, 0.0f, 1.0f);
+}
+
+void drawableObj::_setupAttributes() {
+
+  // Enable all the attribute arrays we'll use.
+  glEnableVertexAttribArray(_vertices.ID);
+  if (!_colors.empty()) glEnableVertexAttribArray(_colors.ID);
+  if (!_normals.empty()) glEnableVertexAttribArray(_normals.ID);
+  if (!_uvs.empty()) glEnableVertexAttribArray(_uvs.ID);
+
+  if (_interleaved) {
+    _setupInterleaved();
+  } else {
+    _setupSeparate();
+  }
+
+  // The element buffer binding is part of the vertex array state.
+  if (!_indices.empty())
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _indices.drawBufferID);
+}
+
+// Points an attribute at interleaved data of the given format.  All
+// but the floats are normalized, which is to say mapped to [0,1] or
+// [-1,1] by OpenGL.
+static void setAttribPointer(const GLint &ID, const GLFORMATTYPE &format,
+                             const GLshort &size, const GLshort &stride,
+                             const GLintptr &offset) {
+
+  GLenum type;
+  switch (format) {
+  case GLFORMAT_HALF:
+    type = GL_HALF_FLOAT;
+    break;
+  case GLFORMAT_UNORM8:
+    type = GL_UNSIGNED_BYTE;
+    break;
+  case GLFORMAT_SNORM10:
+    type = GL_INT_2_10_10_10_REV;
+    break;
+  case GLFORMAT_SNORM16:
+    type = GL_SHORT;
+    break;
+  default:
+    type = GL_FLOAT;
+  }
+
+  glVertexAttribPointer(ID, formatComponents(format, size), type,
+                        (format == GLFORMAT_FLOAT) || (format == GLFORMAT_HALF) ?
+                        GL_FALSE : GL_TRUE,
+                        stride, BUFFER_OFFSET(offset));
+}
+
+void drawableObj::_setupInterleaved() {
+
+  glBindBuffer(GL_ARRAY_BUFFER, _interleavedData.drawBufferID);
+  GLintptr offset = _interleavedData.drawOffset;
+
+  // Since the point of the interleaving is to make the transfer of
+  // data more efficient, the w of the positions and the a of the
+  // colors are left out when they are all 1.0, and the w of the
+  // normals is always left out.  These are restored with default
+  // values by OpenGL.  The attributes may also be in one of the
+  // smaller formats.  See setFormat().
+  setAttribPointer(_vertices.ID, _packedFormats[GLDATA_VERTICES],
+                   _vertexSize, _stride, offset);
+
+  if (!_colors.empty()) {
+    setAttribPointer(_colors.ID, _packedFormats[GLDATA_COLORS],
+                     _colorSize, _stride, offset + _colorPos);
+  }
+  if (!_normals.empty()) {
+    setAttribPointer(_normals.ID, _packedFormats[GLDATA_NORMALS],
+                     _normalSize, _stride, offset + _normalPos);
+  }
+  if (!_uvs.empty()) {
+    setAttribPointer(_uvs.ID, _packedFormats[GLDATA_TEXCOORDS],
+                     _uvSize, _stride, offset + _uvPos);
+  }
+}
+
+
+void drawableObj::_setupSeparate() {
+
+  glBindBuffer(GL_ARRAY_BUFFER, _vertices.drawBufferID);
+  glVertexAttribPointer(_vertices.ID, _vertices.componentsPerVertex(),
+                        GL_FLOAT, 0, 0, BUFFER_OFFSET(_vertices.drawOffset));
+
+  if (!_colors.empty()) {
+    glBindBuffer(GL_ARRAY_BUFFER, _colors.drawBufferID);
+    glVertexAttribPointer(_colors.ID, _colors.componentsPerVertex(),
+                          GL_FLOAT, 0, 0, BUFFER_OFFSET(_colors.drawOffset));
+  }
+  if (!_normals.empty()) {
+    glBindBuffer(GL_ARRAY_BUFFER, _normals.drawBufferID);
+    glVertexAttribPointer(_normals.ID, _normals.componentsPerVertex(),
+                          GL_FLOAT, 0, 0, BUFFER_OFFSET(_normals.drawOffset));
+  }
+  if (!_uvs.empty()) {
+    glBindBuffer(GL_ARRAY_BUFFER, _uvs.drawBufferID);
+    glVertexAttribPointer(_uvs.ID, _uvs.componentsPerVertex(),
+                          GL_FLOAT, 0, 0, BUFFER_OFFSET(_uvs.drawOffset));
+  }
+}
+
+void drawableObj::_drawPrimitives(const GLsizei &instanceCount) {
+
+  // The instanced calls are core in OpenGL 3.1, and otherwise come
+  // with the instanced arrays extension.
+  if (!_firsts.empty()) {
+    // Several objects' worth of vertices, each drawn separately.
+    if (instanceCount == 1) {
+      glMultiDrawArrays(_drawType, &_firsts[0], &_counts[0], _firsts.size());
+    } else {
+      for (size_t i = 0; i < _firsts.size(); i++) {
+        if (GLEW_VERSION_3_1) {
+          glDrawArraysInstanced(_drawType, _firsts[i], _counts[i], instanceCount);
+        } else {
+          glDrawArraysInstancedARB(_drawType, _firsts[i], _counts[i], instanceCount);
+        }
+      }
+    }
+  } else if (_indices.empty()) {
+    if (instanceCount == 1) {
+      glDrawArrays(_drawType, 0, _count);
+    } else if (GLEW_VERSION_3_1) {
+      glDrawArraysInstanced(_drawType, 0, _count, instanceCount);
+    } else {
+      glDrawArraysInstancedARB(_drawType, 0, _count, instanceCount);
+    }
+  } else {
+    if (_drawRanges) {
+      // Just some ranges of the indices.  Instanced objects aren't
+      // drawn this way.
+      _rangeOffsets.resize(_rangeFirsts.size());
+      for (size_t i = 0; i < _rangeFirsts.size(); i++) {
+        _rangeOffsets[i] = BUFFER_OFFSET(_indices.drawOffset +
+                                         _rangeFirsts[i] * sizeof(GLuint));
+      }
+      if (!_rangeCounts.empty())
+        glMultiDrawElements(_drawType, &_rangeCounts[0], GL_UNSIGNED_INT,
+                            &_rangeOffsets[0], _rangeCounts.size());
+    } else if (instanceCount == 1) {
+      glDrawElements(_drawType, _count, GL_UNSIGNED_INT,
+                     BUFFER_OFFSET(_indices.drawOffset));
+    } else if (GLEW_VERSION_3_1) {
+      glDrawElementsInstanced(_drawType, _count, GL_UNSIGNED_INT,
+                              BUFFER_OFFSET(_indices.drawOffset),
+                              instanceCount);
+    } else {
+      glDrawElementsInstancedARB(_drawType, _count, GL_UNSIGNED_INT,
+                                 BUFFER_OFFSET(_indices.drawOffset),
+                                 instanceCount);
+    }
+  }
+}
+
+meshCache::MeshMap meshCache::_meshes;
+bool meshCache::_enabled = false;
+std::set<drawableObj*> meshCache::_held;
+
+bool meshCache::find(const std::string &key, bsgPtr<drawableObj> &mesh) {
+
+  if (!_enabled) return false;
+
+  MeshMap::iterator it = _meshes.find(key);
+  if (it == _meshes.end()) return false;
+
+  mesh = it->second;
+  return true;
+}
+
+void meshCache::add(const std::string &key, const bsgPtr<drawableObj> &mesh) {
+
+  if (!_enabled) return;
+
+  remove(key);
+  _meshes[key] = mesh;
+  _held.insert(mesh.ptr());
+}
+
+void meshCache::remove(const std::string &key) {
+
+  MeshMap::iterator it = _meshes.find(key);
+  if (it == _meshes.end()) return;
+
+  drawableObj* mesh = it->second.ptr();
+  _meshes.erase(it);
+
+  // The same mesh can be in the cache under more than one key.
+  for (it = _meshes.begin(); it != _meshes.end(); it++) {
+    if (it->second.ptr() == mesh) return;
+  }
+  _held.erase(mesh);
+}
+
+size_t meshCache::releaseUnused() {
+
+  size_t released = 0;
+
+  // Dropping a merged object can leave its pieces unused, so keep
+  // going until nothing more goes.
+  bool changed = true;
+  while (changed) {
+    changed = false;
+
+    // The cache's own references, one for each key the mesh is under.
+    std::map<drawableObj*, int> cacheRefs;
+    for (MeshMap::iterator it = _meshes.begin(); it != _meshes.end(); it++) {
+      cacheRefs[it->second.ptr()]++;
+    }
+
+    MeshMap::iterator it = _meshes.begin();
+    while (it != _meshes.end()) {
+      if (it->second.useCount() > cacheRefs[it->second.ptr()]) {
+        it++;
+        continue;
+      }
+      // The last key's erasure deletes the mesh.
+      if (--cacheRefs[it->second.ptr()] == 0) {
+        _held.erase(it->second.ptr());
+        released++;
+      }
+      _meshes.erase(it++);
+      changed = true;
+    }
+  }
+  return released;
+}
+
+std::string bsgName::printName() const {
+    std::string out;
+    for (std::list<std::string>::const_iterator it = this->begin();
+         it != this->end(); it++) {
+      out += *it + "/";
+    }
+    // The trailing slash is just confusing, so leave it out.
+    return out.substr(0, out.length() - 1);
+  }
+
+
+const glm::mat4 &drawableMulti::getModelMatrix() {
+
+  if (_worldMatrixNeedsReset) {
+
+    if (_modelMatrixNeedsReset) {
+      glm::mat4 translationMatrix = glm::translate(glm::mat4(1.0f), _position);
+      glm::mat4 rotationMatrix = glm::mat4_cast(_orientation);
+      glm::mat4 scaleMatrix = glm::scale(glm::mat4(1.0f), _scale);
+
+      _modelMatrix = translationMatrix * rotationMatrix * scaleMatrix;
+      _modelMatrixNeedsReset = false;
+
+      //    std::cout << glm::to_string(_modelMatrix) << std::endl;
+
+      // bsgUtils::printMat("trans:", translationMatrix);
+      // bsgUtils::printMat("rotat:", rotationMatrix);
+      // bsgUtils::printMat("scale:", scaleMatrix);
+      // bsgUtils::printMat("model:", _modelMatrix);
+    }
+
+    // If there is a parent, get the parent transformation (model)
+    // matrix and use it with this one.  The parent's matrix is cached
+    // too, so this only goes as far up the tree as things have
+    // changed.
+    if (_parent)
+      _worldMatrix = _parent->getModelMatrix() * _modelMatrix;
+    else
+      _worldMatrix = _modelMatrix;
+
+    _worldMatrixNeedsReset = false;
+  }
+
+  return _worldMatrix;
+}
+
+std::string drawableMulti::randomName(const std::string &nameRoot) {
+
+  // This is a pretty dopey method, but it seems to work, so long as
+  // the number of characters in each name is big enough.
+  std::string out = nameRoot;
+  for(int i = 0; i < 6; i++) {
+    switch(rand()%3) {
+    case 0:
+      out += ('0' + rand()%10);
+      break;
+    case 1:
+      out += ('A' + rand()%26);
+      break;
+    case 2:
+      out += ('a' + rand()%26);
+      break;
+    }
+  }
+  return out;
+}
+
+bsgNameList drawableCompound::insideBoundingBox(const glm::vec4 &testPoint) {
+
+  bsgName out;
+  bsgNameList outList;
+
+  if (containsPoint(testPoint)) {
+
+    // If we're here, the point is in the bounding box of at least
+    // one of the member objects of this compound object.  Create a
+    // one-element list of a zero-element name.
+    outList.push_back(out);
+  }
+
+  // If we're not, the answer is no, so return an empty name.
+  return outList;
+}
+
+bool drawableCompound::containsPoint(const glm::vec4 &testPoint) {
+
+  // All the component objects share the model matrix, so move the
+  // point into model space once and test it there.
+  glm::vec4 localPoint = glm::inverse(getModelMatrix()) * testPoint;
+
+  for (DrawableObjList::iterator it = _objects.begin();
+       it != _objects.end(); it++) {
+
+    if ((*it)->insideLocalBoundingBox(localPoint)) return true;
+  }
+
+  return false;
+}
+
+bool drawableCompound::raycast(const glm::vec3 &origin,
+                               const glm::vec3 &direction,
+                               float &distance, drawableObj* &object,
+                               int &triangle, int &instance) {
+
+  // Move the ray into model space.  The distance along the ray is
+  // the same in both spaces, since it's measured in units of the
+  // direction vector, which is transformed, too.
+  glm::mat4 inverse = glm::inverse(getModelMatrix());
+  glm::vec3 localOrigin = glm::vec3(inverse * glm::vec4(origin, 1.0f));
+  glm::vec3 localDirection = glm::vec3(inverse * glm::vec4(direction, 0.0f));
+
+  bool out = false;
+  for (DrawableObjList::iterator it = _objects.begin();
+       it != _objects.end(); it++) {
+
+    if ((*it)->raycast(localOrigin, localDirection, distance, triangle)) {
+      object = it->ptr();
+      instance = -1;
+      out = true;
+    }
+  }
+
+  return out;
+}
+
+
+void drawableCompound::prepare() {
+
+  _pShader->useProgram();
+  _pShader->prepare();
+
+  _modelMatrixID = _pShader->getUniformID(_modelMatrixName);
+  _normalMatrixID = _pShader->getUniformID(_normalMatrixName);
+  _viewMatrixID = _pShader->getUniformID(_viewMatrixName);
+  _projMatrixID = _pShader->getUniformID(_projMatrixName);
+
+  // A baked object's components are drawn by its batch.
+  if (_baked) return;
+
+  // Prepare each component object.
+  for (DrawableObjList::iterator it = _drawList().begin();
+       it != _drawList().end(); it++) {
+    (*it)->prepare(_pShader->getProgram());
+  }
+  _drawListNeedsPrepare = false;
+}
+
+void drawableCompound::_mergeObjects() {
+
+  // Divide the objects into runs that can be drawn together.  Only
+  // neighbors are combined, so the drawing order stays the same.
+  std::vector<DrawableObjList> groups;
+  for (DrawableObjList::iterator it = _objects.begin();
+       it != _objects.end(); it++) {
+
+    if (!groups.empty() && groups.back().front()->canMergeWith(**it)) {
+      groups.back().push_back(*it);
+    } else {
+      groups.push_back(DrawableObjList(1, *it));
+    }
+  }
+
+  _mergedObjects.clear();
+  for (std::vector<DrawableObjList>::iterator it = groups.begin();
+       it != groups.end(); it++) {
+
+    if (it->size() == 1) {
+      _mergedObjects.push_back(it->front());
+      continue;
+    }
+
+    // Compounds made of the same cached objects can share the combined
+    // object, too.  The combined object holds on to its pieces, so
+    // their addresses are a safe key.  Pieces that aren't cached
+    // belong to this compound alone, and so does the combination,
+    // which goes away with it.
+    bool shared = true;
+    std::ostringstream key;
+    key << "merged";
+    for (DrawableObjList::iterator jt = it->begin(); jt != it->end(); jt++) {
+      if (!meshCache::holds(jt->ptr())) shared = false;
+      key << ":" << jt->ptr();
+    }
+
+    bsgPtr<drawableObj> merged;
+    if (!shared || !meshCache::find(key.str(), merged)) {
+      merged = new drawableObj();
+      for (DrawableObjList::iterator jt = it->begin(); jt != it->end(); jt++) {
+        merged->append(*jt);
+      }
+      if (shared) meshCache::add(key.str(), merged);
+    }
+    _mergedObjects.push_back(merged);
+  }
+
+  _mergeNeedsUpdate = false;
+  _drawListNeedsPrepare = true;
+}
+
+void drawableCompound::load() {
+
+  if (_baked) return;
+
+  _pShader->useProgram();
+  _pShader->load();
+
+  // Review the current state of the transformation matrices, and pack
+  // them all into the total model matrix.
+  _totalModelMatrix = getModelMatrix();
+
+  // Objects put in the draw list since prepare() need preparing,
+  // too, whether they are combined ones, or the originals after
+  // merging is turned off.
+  if (_drawListNeedsPrepare) {
+    for (DrawableObjList::iterator it = _drawList().begin();
+         it != _drawList().end(); it++) {
+      (*it)->prepare(_pShader->getProgram());
+    }
+    _drawListNeedsPrepare = false;
+  }
+
+  // Load each component object.
+  for (DrawableObjList::iterator it = _drawList().begin();
+       it != _drawList().end(); it++) {
+    (*it)->load();
+  }
+}
+
+void drawableCompound::_drawSetup(const glm::mat4& modelMatrix,
+                                  const glm::mat4& viewMatrix,
+                                  const glm::mat4& projMatrix) {
+
+  _pShader->useProgram();
+  _pShader->draw();
+
+  _loadModelMatrices(modelMatrix, viewMatrix);
+  _loadViewProjMatrices(viewMatrix, projMatrix);
+
+  // std::cout << "view" << glm::to_string(viewMatrix) << std::endl;
+  // std::cout << "normal" << glm::to_string(_normalMatrix) << std::endl;
+  // std::cout << "model" << glm::to_string(_modelMatrix) << std::endl;
+  // std::cout << "proj" << glm::to_string(projMatrix) << std::endl;
+}
+
+void drawableCompound::_loadModelMatrices(const glm::mat4& modelMatrix,
+                                          const glm::mat4& viewMatrix) {
+
+  // Load the model matrix.  This adjusts the position of each object.
+  // Remember that all the objects in a compound object use the same
+  // shader and the same model matrix.
+  glUniformMatrix4fv(_modelMatrixID, 1, false, &modelMatrix[0][0]);
+
+  // Calculate the normal matrix to use for lighting.
+  _normalMatrix = glm::transpose(glm::inverse(viewMatrix * modelMatrix));
+  glUniformMatrix4fv(_normalMatrixID, 1, false, &_normalMatrix[0][0]);
+}
+
+void drawableCompound::_loadViewProjMatrices(const glm::mat4& viewMatrix,
+                                             const glm::mat4& projMatrix) {
+
+  // The view and projection matrices come from the scene object, above us.
+  glUniformMatrix4fv(_viewMatrixID, 1, false, &viewMatrix[0][0]);
+  glUniformMatrix4fv(_projMatrixID, 1, false, &projMatrix[0][0]);
+}
+
+// Two-sided objects are drawn with face culling off.  The caller asks
+// OpenGL once whether culling is wanted, and keeps track of what it
+// is now, so it only changes between objects that differ.
+static void setCullFace(const bool &cull, bool &cullFace) {
+
+  if (cull == cullFace) return;
+  if (cull) {
+    glEnable(GL_CULL_FACE);
+  } else {
+    glDisable(GL_CULL_FACE);
+  }
+  cullFace = cull;
+}
+
+void drawableCompound::draw(const glm::mat4& viewMatrix,
+                            const glm::mat4& projMatrix) {
+
+  if (_baked) return;
+
+  _drawSetup(_totalModelMatrix, viewMatrix, projMatrix);
+
+  bool cullWanted = glIsEnabled(GL_CULL_FACE);
+  bool cullFace = cullWanted;
+
+  for (DrawableObjList::iterator it = _drawList().begin();
+       it != _drawList().end(); it++) {
+    setCullFace(cullWanted && !(*it)->getTwoSided(), cullFace);
+    _drawObject(it->ptr(), _totalModelMatrix);
+  }
+
+  setCullFace(cullWanted, cullFace);
+}
+
+void drawableCompound::_drawObject(drawableObj* object,
+                                   const glm::mat4 &modelMatrix) {
+
+  // Quantized positions come with a matrix of their own, to go
+  // between the model matrix and the position.  The normal matrix
+  // stays as it is.
+  if (object->isQuantized()) {
+    glm::mat4 matrix = modelMatrix * object->getPositionMatrix();
+    glUniformMatrix4fv(_modelMatrixID, 1, false, &matrix[0][0]);
+    object->draw();
+    glUniformMatrix4fv(_modelMatrixID, 1, false, &modelMatrix[0][0]);
+  } else {
+    object->draw();
+  }
+}
+
+void drawableCompound::addToRenderQueue(renderQueue &queue) {
+
+  // A baked object gets a node, so it can be picked, but nothing to
+  // draw.
+  int node = queue.openNode(this);
+
+  if (!_baked) {
+    for (DrawableObjList::iterator it = _drawList().begin();
+         it != _drawList().end(); it++) {
+      queue.add(this, it->ptr(), _pShader.ptr(), &getModelMatrix());
+    }
+  }
+
+  queue.closeNode(node);
+}
+
+bool drawableCompound::_objectBoundsChanged() {
+
+  // The component objects don't tell us when their vertices change,
+  // but they do find their bounding boxes again.
+  unsigned int version = 0;
+  for (DrawableObjList::iterator it = _objects.begin();
+       it != _objects.end(); it++) {
+    version += (*it)->getBoundingBoxVersion();
+  }
+
+  if (version == _objectBoundsVersion) return false;
+  _objectBoundsVersion = version;
+  return true;
+}
+
+// Finds the box around a box transformed by a matrix.  Transforms the
+// center of the box, and finds the extent of the rotated box along
+// each axis.  This is cheaper than transforming all eight corners,
+// and gives the same answer.
+static void transformBox(const glm::mat4 &matrix,
+                         const glm::vec3 &lower, const glm::vec3 &upper,
+                         glm::vec3 &outLower, glm::vec3 &outUpper) {
+
+  glm::vec3 center = glm::vec3(matrix * glm::vec4(0.5f * (lower + upper), 1.0f));
+  glm::vec3 halfSize = 0.5f * (upper - lower);
+  glm::vec3 extent;
+  for (int i = 0; i < 3; i++) {
+    extent[i] = fabs(matrix[0][i]) * halfSize.x +
+      fabs(matrix[1][i]) * halfSize.y +
+      fabs(matrix[2][i]) * halfSize.z;
+  }
+
+  outLower = center - extent;
+  outUpper = center + extent;
+}
+
+bool drawableCompound::updateWorldBounds(const bool &/*childrenChanged*/) {
+
+  bool stale = _objectBoundsChanged() || _worldBoundsNeedReset;
+  if (!stale) return false;
+
+  _worldBoundsLower = glm::vec3( 1.0e35f,  1.0e35f,  1.0e35f);
+  _worldBoundsUpper = glm::vec3(-1.0e35f, -1.0e35f, -1.0e35f);
+
+  const glm::mat4 &modelMatrix = getModelMatrix();
+
+  for (DrawableObjList::iterator it = _objects.begin();
+       it != _objects.end(); it++) {
+
+    glm::vec3 lower = glm::vec3((*it)->getBoundingBoxLower());
+    glm::vec3 upper = glm::vec3((*it)->getBoundingBoxUpper());
+
+    // An object with no vertices has an inside-out box.
+    if (lower.x > upper.x) continue;
+
+    transformBox(modelMatrix, lower, upper, lower, upper);
+    _worldBoundsLower = glm::min(_worldBoundsLower, lower);
+    _worldBoundsUpper = glm::max(_worldBoundsUpper, upper);
+  }
+
+  _worldBoundsNeedReset = false;
+  return true;
+}
+
+void drawableCompound::addObjectBoundingBox(bsgPtr<drawableObj> &obj) {
+
+  obj->findBoundingBox();
+
+  bsgPtr<drawableObj> bb = new drawableObj();
+  std::vector<glm::vec4> bbCorners(24);
+  std::vector<glm::vec4> bbColors(24, glm::vec4(1.0f, 0.0f, 1.0f, 1.0f));
+
+  glm::vec4 bbLower = obj->getBoundingBoxLower();
+  glm::vec4 bbUpper = obj->getBoundingBoxUpper();
+
+  bbCorners[0] = glm::vec4(bbLower.x, bbLower.y, bbLower.z, 1.0);
+  bbCorners[1] = glm::vec4(bbLower.x, bbLower.y, bbUpper.z, 1.0);
+
+  bbCorners[2] = glm::vec4(bbLower.x, bbLower.y, bbUpper.z, 1.0);
+  bbCorners[3] = glm::vec4(bbLower.x, bbUpper.y, bbUpper.z, 1.0);
+
+  bbCorners[4] = glm::vec4(bbLower.x, bbLower.y, bbLower.z, 1.0);
+  bbCorners[5] = glm::vec4(bbLower.x, bbUpper.y, bbLower.z, 1.0);
+
+  bbCorners[6] = glm::vec4(bbLower.x, bbUpper.y, bbLower.z, 1.0);
+  bbCorners[7] = glm::vec4(bbUpper.x, bbUpper.y, bbLower.z, 1.0);
+
+  bbCorners[8] = glm::vec4(bbLower.x, bbLower.y, bbLower.z, 1.0);
+  bbCorners[9] = glm::vec4(bbUpper.x, bbLower.y, bbLower.z, 1.0);
+
+  bbCorners[10] = glm::vec4(bbUpper.x, bbLower.y, bbLower.z, 1.0);
+  bbCorners[11] = glm::vec4(bbUpper.x, bbLower.y, bbUpper.z, 1.0);
+
+  bbCorners[12] = glm::vec4(bbUpper.x, bbUpper.y, bbUpper.z, 1.0);
+  bbCorners[13] = glm::vec4(bbLower.x, bbUpper.y, bbUpper.z, 1.0);
+
+  bbCorners[14] = glm::vec4(bbLower.x, bbUpper.y, bbUpper.z, 1.0);
+  bbCorners[15] = glm::vec4(bbLower.x, bbUpper.y, bbLower.z, 1.0);
+
+  bbCorners[16] = glm::vec4(bbUpper.x, bbUpper.y, bbUpper.z, 1.0);
+  bbCorners[17] = glm::vec4(bbUpper.x, bbLower.y, bbUpper.z, 1.0);
+
+  bbCorners[18] = glm::vec4(bbUpper.x, bbLower.y, bbUpper.z, 1.0);
+  bbCorners[19] = glm::vec4(bbLower.x, bbLower.y, bbUpper.z, 1.0);
+
+  bbCorners[20] = glm::vec4(bbUpper.x, bbUpper.y, bbUpper.z, 1.0);
+  bbCorners[21] = glm::vec4(bbUpper.x, bbUpper.y, bbLower.z, 1.0);
+
+  bbCorners[22] = glm::vec4(bbUpper.x, bbUpper.y, bbLower.z, 1.0);
+  bbCorners[23] = glm::vec4(bbUpper.x, bbLower.y, bbLower.z, 1.0);
+
+  // This is a bit hackish; should query to use the same name as in
+  // obj->_vertices, etc.
+  bb->addData(GLDATA_VERTICES, "position", bbCorners);
+  bb->addData(GLDATA_COLORS, "color", bbColors);
+  bb->setDrawType(GL_LINES);
+
+  // std::cout << bb << std::endl;
+
+  // for (int i = 0; i < 24; i++) {
+  //   std::cout << "corner:" << bbCorners[i].x << "," << bbCorners[i].y << "," << bbCorners[i].z << " color:" << bbColors[i].r << "," << bbColors[i].g << "," << bbColors[i].b << std::endl;
+  // }
+
+  addObject(bb);
+}
+
+
+
+int drawableInstanced::addInstance(const glm::mat4 &matrix,
+                                   const glm::vec4 &color) {
+
+  instanceData instance;
+  instance.matrix = matrix;
+  instance.color = color;
+  _instances.push_back(instance);
+
+  _instancesChanged();
+  return _instances.size() - 1;
+}
+
+bool drawableInstanced::instancingSupported() {
+
+  return GLEW_VERSION_3_3 || GLEW_ARB_instanced_arrays;
+}
+
+void drawableInstanced::prepare() {
+
+  // Quantized positions would need their matrix between the instance
+  // matrix and the position, and there's no place for it there.
+  for (DrawableObjList::iterator it = _objects.begin();
+       it != _objects.end(); it++) {
+    if ((*it)->getFormat(GLDATA_VERTICES) == GLFORMAT_SNORM16)
+      (*it)->setFormat(GLDATA_VERTICES, GLFORMAT_FLOAT);
+  }
+
+  drawableCompound::prepare();
+
+  _instanceMatrixID = _pShader->getAttribID(_instanceMatrixName);
+  if (_instanceMatrixID < 0) {
+    std::cerr << "** Caution: Bad ID for instance matrix attribute '"
+              << _instanceMatrixName << "'" << std::endl;
+  }
+  _instanceColorID = _pShader->getAttribID(_instanceColorName);
+
+  if (_instanceBufferID == 0) glGenBuffers(1, &_instanceBufferID);
+  _instancesLoaded = false;
+}
+
+void drawableInstanced::load() {
+
+  drawableCompound::load();
+
+  if (!_instancesLoaded) {
+    glBindBuffer(GL_ARRAY_BUFFER, _instanceBufferID);
+    glBufferData(GL_ARRAY_BUFFER, _instances.size() * sizeof(instanceData),
+                 _instances.empty() ? NULL : &_instances[0], GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    _instancesLoaded = true;
+  }
+}
+
+void drawableInstanced::draw(const glm::mat4 &viewMatrix,
+                             const glm::mat4 &projMatrix) {
+
+  if (_instances.empty() || (_instanceMatrixID < 0)) return;
+
+  _drawSetup(_totalModelMatrix, viewMatrix, projMatrix);
+
+  // A single instance may as well be drawn the plain way, which also
+  // lets the objects use their vertex array objects.
+  bool cullWanted = glIsEnabled(GL_CULL_FACE);
+  if (_useInstancing && instancingSupported() && (_instances.size() > 1)) {
+    _drawInstanced(cullWanted);
+  } else {
+    _drawOneAtATime(cullWanted);
+  }
+}
+
+// Sets the per-instance rate of an attribute, with the core function
+// or the extension, whichever is there.
+static void setAttribDivisor(const GLuint &index, const GLuint &divisor) {
+
+  if (GLEW_VERSION_3_3) {
+    glVertexAttribDivisor(index, divisor);
+  } else {
+    glVertexAttribDivisorARB(index, divisor);
+  }
+}
+
+void drawableInstanced::_drawInstanced(const bool &cullWanted) {
+
+  // A mat4 attribute takes four attribute slots, one per column.
+  glBindBuffer(GL_ARRAY_BUFFER, _instanceBufferID);
+  for (int i = 0; i < 4; i++) {
+    glEnableVertexAttribArray(_instanceMatrixID + i);
+    glVertexAttribPointer(_instanceMatrixID + i, 4, GL_FLOAT, GL_FALSE,
+                          sizeof(instanceData),
+                          BUFFER_OFFSET(i * sizeof(glm::vec4)));
+    setAttribDivisor(_instanceMatrixID + i, 1);
+  }
+  if (_instanceColorID >= 0) {
+    glEnableVertexAttribArray(_instanceColorID);
+    glVertexAttribPointer(_instanceColorID, 4, GL_FLOAT, GL_FALSE,
+                          sizeof(instanceData),
+                          BUFFER_OFFSET(sizeof(glm::mat4)));
+    setAttribDivisor(_instanceColorID, 1);
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  bool cullFace = cullWanted;
+  for (DrawableObjList::iterator it = _drawList().begin();
+       it != _drawList().end(); it++) {
+    setCullFace(cullWanted && !(*it)->getTwoSided(), cullFace);
+    (*it)->draw(_instances.size());
+  }
+  setCullFace(cullWanted, cullFace);
+
+  // Put things back the way they were, so the next object drawn
+  // doesn't get our instance data.
+  for (int i = 0; i < 4; i++) {
+    setAttribDivisor(_instanceMatrixID + i, 0);
+    glDisableVertexAttribArray(_instanceMatrixID + i);
+  }
+  if (_instanceColorID >= 0) {
+    setAttribDivisor(_instanceColorID, 0);
+    glDisableVertexAttribArray(_instanceColorID);
+  }
+}
+
+void drawableInstanced::_drawOneAtATime(const bool &cullWanted) {
+
+  // With the attribute arrays disabled, the shader gets the same value
+  // of an attribute for every vertex, which we can set by hand.  So
+  // the shader doesn't need to know which way we're drawing.
+  bool cullFace = cullWanted;
+  for (std::vector<instanceData>::iterator it = _instances.begin();
+       it != _instances.end(); it++) {
+
+    for (int i = 0; i < 4; i++) {
+      glVertexAttrib4fv(_instanceMatrixID + i, &(it->matrix[i][0]));
+    }
+    if (_instanceColorID >= 0) glVertexAttrib4fv(_instanceColorID, &(it->color[0]));
+
+    for (DrawableObjList::iterator jt = _drawList().begin();
+         jt != _drawList().end(); jt++) {
+      setCullFace(cullWanted && !(*jt)->getTwoSided(), cullFace);
+      (*jt)->draw();
+    }
+  }
+  setCullFace(cullWanted, cullFace);
+}
+
+void drawableInstanced::addToRenderQueue(renderQueue &queue) {
+
+  int node = queue.openNode(this);
+  queue.add(this, NULL, _pShader.ptr(), &getModelMatrix());
+  queue.closeNode(node);
+}
+
+bool drawableInstanced::updateWorldBounds(const bool &/*childrenChanged*/) {
+
+  bool stale = _objectBoundsChanged() || _worldBoundsNeedReset;
+  if (!stale) return false;
+
+  // Start with a box around all the components, in model space.
+  glm::vec3 lower = glm::vec3( 1.0e35f,  1.0e35f,  1.0e35f);
+  glm::vec3 upper = glm::vec3(-1.0e35f, -1.0e35f, -1.0e35f);
+  for (DrawableObjList::iterator it = _objects.begin();
+       it != _objects.end(); it++) {
+    lower = glm::min(lower, glm::vec3((*it)->getBoundingBoxLower()));
+    upper = glm::max(upper, glm::vec3((*it)->getBoundingBoxUpper()));
+  }
+
+  _worldBoundsLower = glm::vec3( 1.0e35f,  1.0e35f,  1.0e35f);
+  _worldBoundsUpper = glm::vec3(-1.0e35f, -1.0e35f, -1.0e35f);
+
+  if (lower.x <= upper.x) {
+
+    glm::vec3 center = 0.5f * (lower + upper);
+    glm::vec3 halfSize = 0.5f * (upper - lower);
+
+    // Then put a copy of that box at each instance.  See
+    // drawableCompound::updateWorldBounds().
+    for (std::vector<instanceData>::iterator it = _instances.begin();
+         it != _instances.end(); it++) {
+
+      glm::mat4 matrix = getModelMatrix() * it->matrix;
+      glm::vec3 c = glm::vec3(matrix * glm::vec4(center, 1.0f));
+      glm::vec3 extent;
+      for (int i = 0; i < 3; i++) {
+        extent[i] = fabs(matrix[0][i]) * halfSize.x +
+          fabs(matrix[1][i]) * halfSize.y +
+          fabs(matrix[2][i]) * halfSize.z;
+      }
+
+      _worldBoundsLower = glm::min(_worldBoundsLower, c - extent);
+      _worldBoundsUpper = glm::max(_worldBoundsUpper, c + extent);
+    }
+  }
+
+  _worldBoundsNeedReset = false;
+  return true;
+}
+
+void drawableInstanced::_updateInverseMatrices() {
+
+  if (!_inverseMatricesNeedReset) return;
+
+  _inverseMatrices.resize(_instances.size());
+  for (size_t i = 0; i < _instances.size(); i++) {
+    _inverseMatrices[i] = glm::inverse(_instances[i].matrix);
+  }
+  _inverseMatricesNeedReset = false;
+}
+
+bool drawableInstanced::containsPoint(const glm::vec4 &testPoint) {
+
+  _updateInverseMatrices();
+
+  // The inverse of the model matrix times an instance matrix is the
+  // instance's inverse times the model's, so the model's need only be
+  // found once.
+  glm::vec4 modelPoint = glm::inverse(getModelMatrix()) * testPoint;
+
+  for (std::vector<glm::mat4>::iterator it = _inverseMatrices.begin();
+       it != _inverseMatrices.end(); it++) {
+
+    glm::vec4 localPoint = (*it) * modelPoint;
+
+    for (DrawableObjList::iterator jt = _objects.begin();
+         jt != _objects.end(); jt++) {
+      if ((*jt)->insideLocalBoundingBox(localPoint)) return true;
+    }
+  }
+
+  return false;
+}
+
+bool drawableInstanced::raycast(const glm::vec3 &origin,
+                                const glm::vec3 &direction,
+                                float &distance, drawableObj* &object,
+                                int &triangle, int &instance) {
+
+  bool out = false;
+
+  _updateInverseMatrices();
+
+  glm::mat4 inverseModel = glm::inverse(getModelMatrix());
+  glm::vec4 modelOrigin = inverseModel * glm::vec4(origin, 1.0f);
+  glm::vec4 modelDirection = inverseModel * glm::vec4(direction, 0.0f);
+
+  for (size_t i = 0; i < _instances.size(); i++) {
+
+    const glm::mat4 &inverse = _inverseMatrices[i];
+    glm::vec3 localOrigin = glm::vec3(inverse * modelOrigin);
+    glm::vec3 localDirection = glm::vec3(inverse * modelDirection);
+
+    for (DrawableObjList::iterator it = _objects.begin();
+         it != _objects.end(); it++) {
+
+      if ((*it)->raycast(localOrigin, localDirection, distance, triangle)) {
+        object = it->ptr();
+        instance = i;
+        out = true;
+      }
+    }
+  }
+
+  return out;
+}
+
+
+bool drawableStaticBatch::addCompound(drawableCompound* compound) {
+
+  // Check everything first, so a compound goes in whole or not at
+  // all.  Anything that can be batched with itself can be batched.
+  for (DrawableObjList::iterator it = compound->_objects.begin();
+       it != compound->_objects.end(); it++) {
+    if (!(*it)->canBatchWith(**it)) return false;
+  }
+
+  // The shader's matrix names come along with the first compound.
+  if (_numSources == 0) {
+    _modelMatrixName = compound->_modelMatrixName;
+    _normalMatrixName = compound->_normalMatrixName;
+    _viewMatrixName = compound->_viewMatrixName;
+    _projMatrixName = compound->_projMatrixName;
+  }
+
+  // The batch is drawn with its parent's matrix, so that must not be
+  // applied twice.
+  glm::mat4 matrix = compound->getModelMatrix();
+  if (_parent) matrix = glm::inverse(_parent->getModelMatrix()) * matrix;
+
+  for (DrawableObjList::iterator it = compound->_objects.begin();
+       it != compound->_objects.end(); it++) {
+
+    DrawableObjList::iterator jt;
+    for (jt = _objects.begin(); jt != _objects.end(); jt++) {
+      if ((*jt)->canBatchWith(**it)) break;
+    }
+    if (jt == _objects.end()) {
+      bsgPtr<drawableObj> batch = new drawableObj();
+      batch->setSelectable(false);
+      addObject(batch);
+      jt = --_objects.end();
+    }
+
+    part p;
+    p.object = jt->ptr();
+    p.first = (*jt)->getNumIndices();
+    (*jt)->appendTransformed(**it, matrix);
+    p.count = (*jt)->getNumIndices() - p.first;
+    transformBox(matrix, glm::vec3((*it)->getBoundingBoxLower()),
+                 glm::vec3((*it)->getBoundingBoxUpper()), p.lower, p.upper);
+    _parts.push_back(p);
+  }
+
+  _numSources++;
+  _worldBoundsNeedReset = true;
+  return true;
+}
+
+void drawableStaticBatch::_cullComponents(const std::vector<viewFrustum>* frusta) {
+
+  if (!frusta) {
+    for (DrawableObjList::iterator it = _objects.begin();
+         it != _objects.end(); it++) {
+      (*it)->drawAllRanges();
+    }
+    return;
+  }
+
+  for (DrawableObjList::iterator it = _objects.begin();
+       it != _objects.end(); it++) {
+    (*it)->clearDrawRanges();
+  }
+
+  // The parts of each batch object are in order, so the ones in view
+  // make a list of ranges in order, too.
+  const glm::mat4 &modelMatrix = getModelMatrix();
+  for (std::vector<part>::iterator it = _parts.begin();
+       it != _parts.end(); it++) {
+
+    glm::vec3 lower, upper;
+    transformBox(modelMatrix, it->lower, it->upper, lower, upper);
+
+    for (std::vector<viewFrustum>::const_iterator jt = frusta->begin();
+         jt != frusta->end(); jt++) {
+      if (jt->classify(lower, upper) != viewFrustum::OUTSIDE) {
+        it->object->addDrawRange(it->first, it->count);
+        break;
+      }
+    }
+  }
+}
+
+drawableCollection::drawableCollection() {
+  // Seed a random number generator to generate default names randomly.
+  #ifdef WIN32
+  srand(GetTickCount());
+  #else
+  srand(time(NULL));
+  #endif
+  _name = randomName("coll");
+}
+
+drawableCollection::drawableCollection (const std::string name) :
+  drawableMulti(name) {
+  // Seed a random number generator to generate default names randomly.
+  #ifdef WIN32
+  srand(GetTickCount());
+  #else
+  srand(time(NULL));
+  #endif
+}
+
+std::string drawableCollection::addObject(const std::string name,
+                                   const bsgPtr<drawableMulti> &pMultiObject) {
+  pMultiObject->setParent(this);
+  _collection[name] = pMultiObject;
+  pMultiObject->setName(name);
+  _markTreeChanged();
+
+  return name;
+}
+
+std::string drawableCollection::addObject(const bsgPtr<drawableMulti> &pMultiObject) {
+
+  // Get the name of the input object.
+  if (pMultiObject->getName().empty()) {
+
+    // All objects should have a name, so this should not happen.
+    return addObject(randomName("err"), pMultiObject);
+
+  } else {
+    // Is the name already used?
+    if (_collection.find(pMultiObject->getName()) != _collection.end()) {
+
+      std::cerr << "You have already used " << pMultiObject->getName()
+                << " in " << getName()
+                << ".  Assigning a random name." << std::endl;
+
+      return addObject(randomName(pMultiObject->getName()), pMultiObject);
+
+    } else {
+
+      // Add the object with the given name.
+      return addObject(pMultiObject->getName(), pMultiObject);
+    }
+  }
+}
+
+bsgPtr<drawableMulti> drawableCollection::delObject(const std::string &name) {
+
+  CollectionMap::iterator it = _collection.find(name);
+
+  if (it == _collection.end()) {
+    return NULL;
+  } else {
+    bsgPtr<drawableMulti> out = it->second;
+    _collection.erase(it);
+    out->setParent(NULL);
+    _markTreeChanged();
+    return out;
+  }
+}
+
+bsgPtr<drawableMulti> drawableCollection::delObject(bsgName name) {
+
+  if (name.size() > 0) {
+
+    CollectionMap::iterator it = _collection.find(name.front());
+
+    if (it == _collection.end()) {
+
+      // No match.
+      return NULL;
+
+    } else {
+
+      if (name.size() > 1) {
+
+        // Step down a level.
+        name.pop_front();
+        return it->second->delObject(name);
+
+      } else {
+
+        bsgPtr<drawableMulti> out = it->second;
+        _collection.erase(it);
+        out->setParent(NULL);
+        _markTreeChanged();
+        return out;
+      }
+    }
+  } else {
+
+    // This was called with an empty list for some reason.
+    return NULL;
+  }
+}
+
+
+bsgPtr<drawableMulti> drawableCollection::getObject(const std::string &name) {
+
+  CollectionMap::iterator it = _collection.find(name);
+
+  if (it == _collection.end()) {
+    return NULL;
+  } else {
+    return it->second;
+  }
+}
+
+bsgPtr<drawableMulti> drawableCollection::getObject(bsgName name) {
+
+  if (name.size() > 1) {
+
+    CollectionMap::iterator it = _collection.find(name.front());
+
+    if (it == _collection.end()) {
+
+      // No match.
+      return NULL;
+
+    } else {
+
+      // Step down a level.
+      name.pop_front();
+      return it->second->getObject(name);
+
+    }
+  } else if (name.size() > 0) {
+
+    return getObject(name.front());
+
+  } else {
+
+    // This was called with an empty list for some reason.
+    return NULL;
+  }
+}
+
+bsgNameList drawableCollection::getNames() {
+
+  // Our output.
+  bsgNameList out;
+
+  // Loop through the collection, running getNames() on all the members.
+  for (CollectionMap::iterator it = _collection.begin();
+       it != _collection.end(); it++) {
+    bsgNameList sublist = it->second->getNames();
+
+    if (!sublist.empty()) {
+      for (bsgNameList::iterator jt = sublist.begin();
+           jt != sublist.end(); jt++) {
+        jt->push_front(it->first);
+      }
+    } else {
+      bsgName b;
+      b.push_back(it->first);
+      sublist.push_back(b);
+    }
+
+    // If any of them reply, add them to the output list.
+    out.splice(out.end(), sublist);
+  }
+
+  return out;
+}
+
+void drawableCollection::invalidateWorldMatrix() {
+
+  // A flagged collection has already flagged everything below it:
+  // nothing gets unflagged until its parents have been recalculated.
+  // So there is no need to go further down.
+  if (_worldMatrixNeedsReset) return;
+
+  _worldMatrixNeedsReset = true;
+
+  for (CollectionMap::iterator it = _collection.begin();
+       it != _collection.end(); it++) {
+    it->second->invalidateWorldMatrix();
+  }
+}
+
+bsgNameList drawableCollection::insideBoundingBox(const glm::vec4 &testPoint) {
+
+  bsgNameList out;
+
+  for (CollectionMap::iterator it = _collection.begin();
+       it != _collection.end(); it++) {
+    bsgNameList sublist = it->second->insideBoundingBox(testPoint);
+
+    // Check if the list is empty.  Note that the list might have one
+    // zero-length entry, if this child is a drawableCompound and the
+    // condition is met.
+    if (!sublist.empty()) {
+
+      for (bsgNameList::iterator jt = sublist.begin();
+           jt != sublist.end(); jt++) {
+        jt->push_front(it->first);
+      }
+    }
+
+    out.splice(out.end(), sublist);
+  }
+
+  // If we're here, the answer is no, so this should be an empty list.
+  return out;
+}
+
+std::string drawableCollection::printObj (const std::string &prefix) const {
+
+  std::string out = prefix + "<drawableCollection:" + _name + ">";
+
+  for (CollectionMap::const_iterator it = _collection.begin();
+       it != _collection.end(); it++) {
+
+    out += "\n" + it->second->printObj(prefix + "| ");
+  }
+
+  return out;
+}
+
+
+void drawableCollection::prepare() {
+
+  for (CollectionMap::iterator it =  _collection.begin();
+       it != _collection.end(); it++) {
+    it->second->prepare();
+  }
+}
+
+void drawableCollection::load() {
+
+  // Then draw all the objects.
+  for (CollectionMap::iterator it =  _collection.begin();
+       it != _collection.end(); it++) {
+    it->second->load();
+  }
+}
+
+void drawableCollection::draw(const glm::mat4 &viewMatrix,
+                              const glm::mat4 &projMatrix) {
+
+  // Then draw all the objects.
+  for (CollectionMap::iterator it =  _collection.begin();
+       it != _collection.end(); it++) {
+    it->second->draw(viewMatrix, projMatrix);
+  }
+}
+
+
+void drawableCollection::addToRenderQueue(renderQueue &queue) {
+
+  int node = queue.openNode(this);
+
+  for (CollectionMap::iterator it =  _collection.begin();
+       it != _collection.end(); it++) {
+    it->second->addToRenderQueue(queue);
+  }
+
+  queue.closeNode(node);
+}
+
+bool drawableCollection::updateWorldBounds(const bool &childrenChanged) {
+
+  if (!childrenChanged && !_worldBoundsNeedReset) return false;
+
+  _worldBoundsLower = glm::vec3( 1.0e35f,  1.0e35f,  1.0e35f);
+  _worldBoundsUpper = glm::vec3(-1.0e35f, -1.0e35f, -1.0e35f);
+
+  for (CollectionMap::iterator it =  _collection.begin();
+       it != _collection.end(); it++) {
+    _worldBoundsLower = glm::min(_worldBoundsLower,
+                                 it->second->getWorldBoundsLower());
+    _worldBoundsUpper = glm::max(_worldBoundsUpper,
+                                 it->second->getWorldBoundsUpper());
+  }
+
+  _worldBoundsNeedReset = false;
+  return true;
+}
+
+viewFrustum::viewFrustum(const glm::mat4 &viewProjMatrix) {
+
+  // Each plane is the last row of the matrix plus or minus one of the
+  // others.  (Gribb and Hartmann.)  Remember that glm matrices are
+  // indexed by column first.
+  glm::vec4 rows[4];
+  for (int i = 0; i < 4; i++) {
+    rows[i] = glm::vec4(viewProjMatrix[0][i], viewProjMatrix[1][i],
+                        viewProjMatrix[2][i], viewProjMatrix[3][i]);
+  }
+
+  _planes[0] = rows[3] + rows[0];   // left
+  _planes[1] = rows[3] - rows[0];   // right
+  _planes[2] = rows[3] + rows[1];   // bottom
+  _planes[3] = rows[3] - rows[1];   // top
+  _planes[4] = rows[3] + rows[2];   // near
+  _planes[5] = rows[3] - rows[2];   // far
+}
+
+int viewFrustum::classify(const glm::vec3 &lower,
+                          const glm::vec3 &upper) const {
+
+  // An empty box is nowhere.
+  if (lower.x > upper.x) return OUTSIDE;
+
+  int out = INSIDE;
+
+  for (int i = 0; i < 6; i++) {
+    const glm::vec4 &p = _planes[i];
+
+    // The corners of the box farthest along the plane normal, and
+    // farthest against it.
+    glm::vec3 farCorner = glm::vec3(p.x > 0.0f ? upper.x : lower.x,
+                                    p.y > 0.0f ? upper.y : lower.y,
+                                    p.z > 0.0f ? upper.z : lower.z);
+    glm::vec3 nearCorner = glm::vec3(p.x > 0.0f ? lower.x : upper.x,
+                                     p.y > 0.0f ? lower.y : upper.y,
+                                     p.z > 0.0f ? lower.z : upper.z);
+
+    if (glm::dot(glm::vec3(p), farCorner) + p.w < 0.0f) return OUTSIDE;
+    if (glm::dot(glm::vec3(p), nearCorner) + p.w < 0.0f) out = INTERSECTS;
+  }
+
+  return out;
+}
+
+int renderQueue::openNode(drawableMulti* node) {
+
+  cullNode n;
+  n.node = node;
+  n.compound = NULL;
+  n.parent = _currentNode;
+  n.end = 0;
+  _cullNodes.push_back(n);
+  _moved.push_back(0);
+
+  _currentNode = _cullNodes.size() - 1;
+  return _currentNode;
 }
 
-std::string drawableCollection::addObject(const std::string name,
-                                   const bsgPtr<drawableMulti> &pMultiObject) {
-  pMultiObject->setParent(this);
-  _collection[name] = pMultiObject;
-  pMultiObject->setName(name);
+int renderQueue::openNode(drawableCompound* node) {
 
-  return name;
+  int index = openNode((drawableMulti*)node);
+  _cullNodes[index].compound = node;
+  return index;
 }
 
-std::string drawableCollection::addObject(const bsgPtr<drawableMulti> &pMultiObject) {
+void renderQueue::closeNode(const int &index) {
 
-  // Get the name of the input object.
-  if (pMultiObject->getName().empty()) {
+  _cullNodes[index].end = _cullNodes.size();
+  _currentNode = _cullNodes[index].parent;
+}
 
-    // All objects should have a name, so this should not happen.
-    return addObject(randomName("err"), pMultiObject);
+void renderQueue::updateBounds() {
 
-  } else {
-    // Is the name already used?
-    if (_collection.find(pMultiObject->getName()) != _collection.end()) {
+  _childrenChanged.assign(_cullNodes.size(), 0);
 
-      std::cerr << "You have already used " << pMultiObject->getName()
-                << " in " << getName()
-                << ".  Assigning a random name." << std::endl;
+  // Children come after their parents in the list, so going
+  // backwards means each node is done before its parent.
+  for (int i = _cullNodes.size() - 1; i >= 0; i--) {
 
-      return addObject(randomName(pMultiObject->getName()), pMultiObject);
+    if (!_cullNodes[i].node->updateWorldBounds(_childrenChanged[i] != 0))
+      continue;
 
-    } else {
+    if (_cullNodes[i].parent >= 0)
+      _childrenChanged[_cullNodes[i].parent] = 1;
 
-      // Add the object with the given name.
-      return addObject(pMultiObject->getName(), pMultiObject);
+    if (_cullNodes[i].compound && !_moved[i]) {
+      _moved[i] = 1;
+      _movedNodes.push_back(i);
     }
   }
 }
 
-bsgPtr<drawableMulti> drawableCollection::delObject(const std::string &name) {
-
-  CollectionMap::iterator it = _collection.find(name);
+void renderQueue::clearMovedNodes() {
 
-  if (it == _collection.end()) {
-    return NULL;
-  } else {
-    bsgPtr<drawableMulti> out = it->second;
-    _collection.erase(it);
-    return out;
+  for (std::vector<int>::iterator it = _movedNodes.begin();
+       it != _movedNodes.end(); it++) {
+    _moved[*it] = 0;
   }
+  _movedNodes.clear();
 }
 
-bsgPtr<drawableMulti> drawableCollection::delObject(bsgName name) {
+void renderQueue::_drawAllComponents() {
 
-  if (name.size() > 0) {
+  for (std::vector<cullNode>::iterator it = _cullNodes.begin();
+       it != _cullNodes.end(); it++) {
+    if (it->compound) it->compound->_cullComponents(NULL);
+  }
+  _componentsCulled = false;
+}
 
-    CollectionMap::iterator it = _collection.find(name.front());
+void renderQueue::cull(const std::vector<glm::mat4> &viewProjMatrices) {
 
-    if (it == _collection.end()) {
+  if (!_culling) {
+    _visible.clear();
+    if (_componentsCulled) _drawAllComponents();
+    return;
+  }
 
-      // No match.
-      return NULL;
+  updateBounds();
 
-    } else {
+  _frusta.clear();
+  for (std::vector<glm::mat4>::const_iterator it = viewProjMatrices.begin();
+       it != viewProjMatrices.end(); it++) {
+    _frusta.push_back(viewFrustum(*it));
+  }
 
-      if (name.size() > 1) {
+  _visible.assign(_cullNodes.size(), 0);
 
-        // Step down a level.
-        name.pop_front();
-        return it->second->delObject(name);
+  size_t i = 0;
+  while (i < _cullNodes.size()) {
 
-      } else {
+    const glm::vec3 &lower = _cullNodes[i].node->getWorldBoundsLower();
+    const glm::vec3 &upper = _cullNodes[i].node->getWorldBoundsUpper();
 
-        bsgPtr<drawableMulti> out = it->second;
-        _collection.erase(it);
-        return out;
-      }
+    int result = viewFrustum::OUTSIDE;
+    for (std::vector<viewFrustum>::iterator it = _frusta.begin();
+         it != _frusta.end(); it++) {
+      int r = it->classify(lower, upper);
+      if (r > result) result = r;
+      if (result == viewFrustum::INSIDE) break;
     }
-  } else {
 
-    // This was called with an empty list for some reason.
-    return NULL;
+    switch (result) {
+    case viewFrustum::OUTSIDE:
+      // Skip everything below this node.  It's already invisible.
+      i = _cullNodes[i].end;
+      break;
+    case viewFrustum::INSIDE:
+      // Everything below is inside, too, so no need to test it.
+      std::fill(_visible.begin() + i, _visible.begin() + _cullNodes[i].end, 1);
+      if (_componentsCulled) {
+        for (size_t j = i; j < _cullNodes[i].end; j++) {
+          if (_cullNodes[j].compound)
+            _cullNodes[j].compound->_cullComponents(NULL);
+        }
+      }
+      i = _cullNodes[i].end;
+      break;
+    default:
+      // Partly in, so look at the children, and the components.
+      _visible[i] = 1;
+      if (_cullNodes[i].compound) {
+        _cullNodes[i].compound->_cullComponents(&_frusta);
+        _componentsCulled = true;
+      }
+      i++;
+    }
   }
 }
 
+void renderQueue::add(drawableCompound* compound, drawableObj* object,
+                      shaderMgr* shader, const glm::mat4* worldMatrix) {
 
-bsgPtr<drawableMulti> drawableCollection::getObject(const std::string &name) {
+  renderItem item;
+  item.compound = compound;
+  item.object = object;
+  item.shader = shader;
+  item.program = shader->getProgram();
+  item.worldMatrix = worldMatrix;
+  item.key = 0;
+  item.order = _items.size();
+  item.cullNode = _currentNode;
 
-  CollectionMap::iterator it = _collection.find(name);
+  _items.push_back(item);
+}
 
-  if (it == _collection.end()) {
-    return NULL;
+// Orders render items by their keys, and then by scene order.  With
+// the tie broken this way, an in-place sort gives the same result as a
+// stable one, without the stable sort's temporary buffer.
+static bool renderItemLess(const renderItem &a, const renderItem &b) {
+  return (a.key < b.key) || ((a.key == b.key) && (a.order < b.order));
+}
+
+// Orders render items by their places in the scene.
+static bool renderItemSceneOrder(const renderItem &a, const renderItem &b) {
+  return a.order < b.order;
+}
+
+void renderQueue::finish() {
+
+  // The keys are packed program, texture, buffer, depth, 16 bits
+  // each.  OpenGL hands out IDs starting from one, so the low bits of
+  // the IDs are plenty to tell them apart.
+  for (std::vector<renderItem>::iterator it = _items.begin();
+       it != _items.end(); it++) {
+
+    uint64_t program = it->program & 0xFFFF;
+    uint64_t texture = it->shader->getTextureID() & 0xFFFF;
+    uint64_t buffer = it->object ? (it->object->getBufferID() & 0xFFFF) : 0;
+
+    it->key = (program << 48) | (texture << 32) | (buffer << 16);
+  }
+
+  // That took out the depths, so they need doing again.
+  _depthSorted = false;
+  _sort();
+}
+
+void renderQueue::_sort() {
+
+  if (_sortDraws) {
+    std::sort(_items.begin(), _items.end(), renderItemLess);
   } else {
-    return it->second;
+    std::sort(_items.begin(), _items.end(), renderItemSceneOrder);
   }
 }
 
-bsgPtr<drawableMulti> drawableCollection::getObject(bsgName name) {
+void renderQueue::_updateDepthKeys(const glm::mat4 &viewMatrix) {
 
-  if (name.size() > 1) {
+  for (std::vector<renderItem>::iterator it = _items.begin();
+       it != _items.end(); it++) {
 
-    CollectionMap::iterator it = _collection.find(name.front());
+    // The distance in front of the camera of the object's origin,
+    // which is the last column of its world matrix.
+    float dist = -(viewMatrix * (*it->worldMatrix)[3]).z;
+    dist = glm::clamp(dist / _depthRange, 0.0f, 1.0f);
 
-    if (it == _collection.end()) {
+    it->key = (it->key & ~((uint64_t)0xFFFF)) | (uint64_t)(dist * 65535.0f);
+  }
 
-      // No match.
-      return NULL;
+  _sort();
+}
 
-    } else {
+void renderQueue::load() {
 
-      // Step down a level.
-      name.pop_front();
-      return it->second->getObject(name);
+  // The entries for a compound object are loaded together, so if the
+  // compound is the same as the last one, skip it.  A compound that
+  // has been split up by the sort will be loaded more than once,
+  // which is harmless.
+  drawableCompound* current = NULL;
 
+  for (std::vector<renderItem>::iterator it = _items.begin();
+       it != _items.end(); it++) {
+    if (it->compound != current) {
+      current = it->compound;
+      current->load();
     }
-  } else if (name.size() > 0) {
+  }
 
-    return getObject(name.front());
+  // A new frame, so a new depth order.
+  _depthSorted = false;
+}
 
-  } else {
+void renderQueue::draw(const glm::mat4 &viewMatrix,
+                       const glm::mat4 &projMatrix) {
 
-    // This was called with an empty list for some reason.
-    return NULL;
+  if (_depthSort && _sortDraws && !_depthSorted) {
+    _updateDepthKeys(viewMatrix);
+    _depthSorted = true;
   }
-}
 
-bsgNameList drawableCollection::getNames() {
+  // An out-of-date cull is no cull at all.
+  bool culling = _visible.size() == _cullNodes.size();
+  if (!culling && _componentsCulled) _drawAllComponents();
 
-  // Our output.
-  bsgNameList out;
+  // What's in place right now.  Zero means we don't know.
+  drawableCompound* currentCompound = NULL;
+  GLuint currentProgram = 0;
+  GLuint currentTexture = 0;
 
-  // Loop through the collection, running getNames() on all the members.
-  for (CollectionMap::iterator it = _collection.begin();
-       it != _collection.end(); it++) {
-    bsgNameList sublist = it->second->getNames();
+  // Culling is off for two-sided objects, and back to what it was
+  // after them.
+  bool cullWanted = glIsEnabled(GL_CULL_FACE);
+  bool cullFace = cullWanted;
 
-    if (!sublist.empty()) {
-      for (bsgNameList::iterator jt = sublist.begin();
-           jt != sublist.end(); jt++) {
-        jt->push_front(it->first);
+  for (std::vector<renderItem>::iterator it = _items.begin();
+       it != _items.end(); it++) {
+
+    if (culling && (it->cullNode >= 0) && !_visible[it->cullNode]) {
+      _stats.drawsCulled++;
+      continue;
+    }
+
+    if (!it->object) {
+      // This compound wants to draw itself, so after it is done we
+      // can't know what state it left behind.
+      setCullFace(cullWanted, cullFace);
+      it->compound->draw(viewMatrix, projMatrix);
+      currentCompound = NULL;
+      currentProgram = currentTexture = 0;
+      continue;
+    }
+
+    if (it->compound != currentCompound) {
+      currentCompound = it->compound;
+
+      // A uniform's value belongs to the program, so the lights and
+      // the view and projection matrices need only be loaded when we
+      // switch to a new program.  The queue is sorted by program, so
+      // each one gets switched to about once per draw.
+      if (it->program != currentProgram) {
+        it->shader->useProgram();
+        it->shader->drawLights();
+        currentCompound->_loadViewProjMatrices(viewMatrix, projMatrix);
+        currentProgram = it->program;
+        _stats.programChanges++;
+        _stats.uniformLoads++;
+
+        // The texture sampler is also a uniform of the program.
+        currentTexture = 0;
+      } else {
+        _stats.programChangesAvoided++;
+        _stats.uniformLoadsAvoided++;
       }
-    } else {
-      bsgName b;
-      b.push_back(it->first);
-      sublist.push_back(b);
+
+      GLuint texture = it->shader->getTextureID();
+      if (texture) {
+        if (texture != currentTexture) {
+          it->shader->drawTexture();
+          currentTexture = texture;
+          _stats.textureBinds++;
+        } else {
+          _stats.textureBindsAvoided++;
+        }
+      }
+
+      // Every compound has its own model matrix.
+      currentCompound->_loadModelMatrices(*it->worldMatrix, viewMatrix);
     }
 
-    // If any of them reply, add them to the output list.
-    out.splice(out.end(), sublist);
+    setCullFace(cullWanted && !it->object->getTwoSided(), cullFace);
+    currentCompound->_drawObject(it->object, *it->worldMatrix);
+    _stats.draws++;
   }
 
-  return out;
+  setCullFace(cullWanted, cullFace);
 }
 
-bsgNameList drawableCollection::insideBoundingBox(const glm::vec4 &testPoint) {
+int selectionTree::_build(std::vector<int> &leaves,
+                          const int &first, const int &last,
+                          const int &parent,
+                          const std::vector<glm::vec3> &centers) {
+
+  int index = _nodes.size();
+  _nodes.push_back(bvhNode());
+  _nodes[index].parent = parent;
+  _nodes[index].left = _nodes[index].right = -1;
+
+  if (last - first == 1) {
+    drawableCompound* compound = _leaves[leaves[first]];
+    _nodes[index].leaf = leaves[first];
+    _nodes[index].lower = compound->getWorldBoundsLower();
+    _nodes[index].upper = compound->getWorldBoundsUpper();
+    return index;
+  }
 
-  bsgNameList out;
+  // Split at the median along the axis where the centers are most
+  // spread out.  Splitting at the median keeps the tree balanced, so
+  // it is never deeper than about log2 of the number of leaves.
+  glm::vec3 lower = centers[leaves[first]];
+  glm::vec3 upper = lower;
+  for (int i = first + 1; i < last; i++) {
+    lower = glm::min(lower, centers[leaves[i]]);
+    upper = glm::max(upper, centers[leaves[i]]);
+  }
+  glm::vec3 spread = upper - lower;
 
-  for (CollectionMap::iterator it = _collection.begin();
-       it != _collection.end(); it++) {
-    bsgNameList sublist = it->second->insideBoundingBox(testPoint);
+  centerCompare compare;
+  compare.centers = &centers;
+  compare.axis = (spread.x > spread.y) ?
+    ((spread.x > spread.z) ? 0 : 2) : ((spread.y > spread.z) ? 1 : 2);
 
-    // Check if the list is empty.  Note that the list might have one
-    // zero-length entry, if this child is a drawableCompound and the
-    // condition is met.
-    if (!sublist.empty()) {
+  int middle = (first + last) / 2;
+  std::nth_element(leaves.begin() + first, leaves.begin() + middle,
+                   leaves.begin() + last, compare);
 
-      for (bsgNameList::iterator jt = sublist.begin();
-           jt != sublist.end(); jt++) {
-        jt->push_front(it->first);
-      }
-    }
+  int left = _build(leaves, first, middle, index, centers);
+  int right = _build(leaves, middle, last, index, centers);
 
-    out.splice(out.end(), sublist);
-  }
+  // Careful: _nodes may have been reallocated by the recursion.
+  _nodes[index].left = left;
+  _nodes[index].right = right;
+  _nodes[index].leaf = -1;
+  _nodes[index].lower = glm::min(_nodes[left].lower, _nodes[right].lower);
+  _nodes[index].upper = glm::max(_nodes[left].upper, _nodes[right].upper);
 
-  // If we're here, the answer is no, so this should be an empty list.
-  return out;
+  return index;
 }
 
-std::string drawableCollection::printObj (const std::string &prefix) const {
+// Empty objects have inside-out boxes, and can't be selected.
+static bool hasWorldBounds(drawableCompound* compound) {
+  return compound->getWorldBoundsLower().x <= compound->getWorldBoundsUpper().x;
+}
 
-  std::string out = prefix + "<drawableCollection:" + _name + ">";
+void selectionTree::build(renderQueue &queue) {
 
-  for (CollectionMap::const_iterator it = _collection.begin();
-       it != _collection.end(); it++) {
+  _nodes.clear();
+  _leaves.clear();
+  _leafNodes.assign(queue.numNodes(), -1);
 
-    out += "\n" + it->second->printObj(prefix + "| ");
+  std::vector<int> queueIndices;
+  std::vector<glm::vec3> centers;
+
+  for (size_t i = 0; i < queue.numNodes(); i++) {
+    drawableCompound* compound = queue.getCompound(i);
+    if (!compound) continue;
+
+    if (!hasWorldBounds(compound)) continue;
+
+    queueIndices.push_back(i);
+    _leaves.push_back(compound);
+    centers.push_back(0.5f * (compound->getWorldBoundsLower() +
+                              compound->getWorldBoundsUpper()));
   }
 
-  return out;
-}
+  if (!_leaves.empty()) {
 
+    std::vector<int> leaves(_leaves.size());
+    for (size_t i = 0; i < leaves.size(); i++) leaves[i] = i;
 
-void drawableCollection::prepare() {
+    _nodes.reserve(2 * _leaves.size() - 1);
+    _build(leaves, 0, leaves.size(), -1, centers);
 
-  for (CollectionMap::iterator it =  _collection.begin();
-       it != _collection.end(); it++) {
-    it->second->prepare();
+    for (size_t i = 0; i < _nodes.size(); i++) {
+      if (_nodes[i].leaf >= 0) _leafNodes[queueIndices[_nodes[i].leaf]] = i;
+    }
   }
+
+  _dirty.assign(_nodes.size(), 0);
+  queue.clearMovedNodes();
 }
 
-void drawableCollection::load() {
+bool selectionTree::refit(renderQueue &queue) {
 
-  // Then draw all the objects.
-  for (CollectionMap::iterator it =  _collection.begin();
-       it != _collection.end(); it++) {
-    it->second->load();
+  const std::vector<int> &moved = queue.getMovedNodes();
+  if (moved.empty()) return true;
+
+  // Update the moved leaves, and flag the nodes above them.
+  for (std::vector<int>::const_iterator it = moved.begin();
+       it != moved.end(); it++) {
+
+    int index = ((size_t)*it < _leafNodes.size()) ? _leafNodes[*it] : -1;
+    if (index < 0) {
+      // Not in the tree, so it was empty at the last build.  If it
+      // isn't anymore, it needs a leaf of its own.
+      drawableCompound* compound = queue.getCompound(*it);
+      if (compound && hasWorldBounds(compound)) return false;
+      continue;
+    }
+
+    drawableCompound* compound = _leaves[_nodes[index].leaf];
+    _nodes[index].lower = compound->getWorldBoundsLower();
+    _nodes[index].upper = compound->getWorldBoundsUpper();
+
+    for (int p = _nodes[index].parent; (p >= 0) && !_dirty[p];
+         p = _nodes[p].parent) {
+      _dirty[p] = 1;
+    }
+  }
+
+  // Children have higher indices than their parents, so going
+  // backwards does the children first.
+  for (int i = _nodes.size() - 1; i >= 0; i--) {
+    if (!_dirty[i]) continue;
+
+    const bvhNode &left = _nodes[_nodes[i].left];
+    const bvhNode &right = _nodes[_nodes[i].right];
+    _nodes[i].lower = glm::min(left.lower, right.lower);
+    _nodes[i].upper = glm::max(left.upper, right.upper);
+    _dirty[i] = 0;
   }
+
+  queue.clearMovedNodes();
+  return true;
 }
 
-void drawableCollection::draw(const glm::mat4 &viewMatrix,
-                              const glm::mat4 &projMatrix) {
+bool selectionTree::raycast(const glm::vec3 &origin,
+                            const glm::vec3 &direction,
+                            rayHit &hit) const {
+
+  if (_nodes.empty()) return false;
+
+  glm::vec3 invDirection = 1.0f / direction;
+  float distance = 1.0e35f;
+  float entry;
+  bool out = false;
+
+  int stack[64];
+  int top = 0;
+  stack[top++] = 0;
+
+  while (top > 0) {
+    const bvhNode &node = _nodes[stack[--top]];
+
+    if (!rayHitsBox(origin, invDirection, node.lower, node.upper,
+                    distance, entry)) continue;
+
+    if (node.leaf >= 0) {
+      drawableObj* object;
+      int triangle, instance;
+      if (_leaves[node.leaf]->raycast(origin, direction, distance,
+                                      object, triangle, instance)) {
+        hit.compound = _leaves[node.leaf];
+        hit.object = object;
+        hit.triangle = triangle;
+        hit.instance = instance;
+        out = true;
+      }
+    } else {
+      stack[top++] = node.right;
+      stack[top++] = node.left;
+    }
+  }
 
-  // Then draw all the objects.
-  for (CollectionMap::iterator it =  _collection.begin();
-       it != _collection.end(); it++) {
-    it->second->draw(viewMatrix, projMatrix);
+  if (out) {
+    hit.distance = distance;
+    hit.position = origin + distance * direction;
   }
+  return out;
 }
 
+void selectionTree::query(const glm::vec4 &testPoint,
+                          std::vector<drawableCompound*> &hits) const {
+
+  if (_nodes.empty()) return;
+
+  // The tree is balanced when it is built, and refitting doesn't
+  // change its shape, so this is deep enough for any scene that will
+  // fit in memory.
+  int stack[64];
+  int top = 0;
+  stack[top++] = 0;
+
+  while (top > 0) {
+    const bvhNode &node = _nodes[stack[--top]];
+
+    if ((testPoint.x < node.lower.x) || (testPoint.x > node.upper.x) ||
+        (testPoint.y < node.lower.y) || (testPoint.y > node.upper.y) ||
+        (testPoint.z < node.lower.z) || (testPoint.z > node.upper.z))
+      continue;
+
+    if (node.leaf >= 0) {
+      if (_leaves[node.leaf]->containsPoint(testPoint))
+        hits.push_back(_leaves[node.leaf]);
+    } else {
+      stack[top++] = node.right;
+      stack[top++] = node.left;
+    }
+  }
+}
 
 /// \brief Adjust camera position according to input Euler angles.
 ///
@@ -1363,13 +5035,153 @@ bsgPtr<drawableMulti> scene::getObject(bsgName &name) {
 
 bsgNameList scene::insideBoundingBox(const glm::vec4 &testPoint) {
 
-  return _sceneRoot.insideBoundingBox(testPoint);
+  bsgNameList out;
+
+  pick(testPoint, _hits);
+
+  for (std::vector<drawableCompound*>::iterator it = _hits.begin();
+       it != _hits.end(); it++) {
+    out.push_back(getFullName(*it));
+  }
+
+  return out;
+}
+
+void scene::_updateSelectionTree() {
+
+  _updateRenderQueue();
+  _renderQueue.updateBounds();
+
+  if (!_selectionTreeNeedsBuild && !_selectionTree.refit(_renderQueue))
+    _selectionTreeNeedsBuild = true;
+
+  if (_selectionTreeNeedsBuild) {
+    _selectionTree.build(_renderQueue);
+    _selectionTreeNeedsBuild = false;
+  }
+}
+
+void scene::pick(const glm::vec4 &testPoint,
+                 std::vector<drawableCompound*> &hits) {
+
+  hits.clear();
+
+  _updateSelectionTree();
+  _selectionTree.query(testPoint, hits);
+}
+
+bool scene::raycast(const glm::vec3 &origin, const glm::vec3 &direction,
+                    rayHit &hit) {
+
+  _updateSelectionTree();
+
+  if (!_selectionTree.raycast(origin, glm::normalize(direction), hit))
+    return false;
+
+  hit.name = getFullName(hit.compound);
+  return true;
+}
+
+bsgName scene::getFullName(drawableMulti* object) {
+
+  // The scene root has no parent, and its name is not part of the
+  // full name.
+  bsgName out;
+  for (drawableMulti* p = object; p && p->getParent(); p = p->getParent()) {
+    out.push_front(p->getName());
+  }
+  return out;
+}
+
+
+void scene::_updateRenderQueue() {
+
+  if (_sceneRoot.treeChanged()) {
+    _renderQueue.clear();
+    _sceneRoot.addToRenderQueue(_renderQueue);
+    _renderQueue.finish();
+    _culledThisFrame = false;
+    _selectionTreeNeedsBuild = true;
+    _sceneRoot.clearTreeChanged();
+  }
+}
+
+void scene::_findStatic(drawableMulti* object, const bool &parentStatic,
+                        std::vector<drawableCompound*> &found) {
+
+  bool isStatic = parentStatic || object->getStatic();
+
+  drawableCollection* collection = dynamic_cast<drawableCollection*>(object);
+  if (collection) {
+    for (drawableCollection::iterator it = collection->begin();
+         it != collection->end(); it++) {
+      _findStatic(it->second.ptr(), isStatic, found);
+    }
+    return;
+  }
+
+  // Instanced objects are already drawn in one call, and batches
+  // are what we're making.
+  if (dynamic_cast<drawableInstanced*>(object) ||
+      dynamic_cast<drawableStaticBatch*>(object)) return;
+
+  drawableCompound* compound = dynamic_cast<drawableCompound*>(object);
+  if (compound) {
+    compound->_baked = false;
+    if (isStatic) found.push_back(compound);
+  }
 }
 
+int scene::bakeStatic() {
+
+  // Take out the batches from last time.
+  for (std::vector<std::string>::iterator it = _staticBatchNames.begin();
+       it != _staticBatchNames.end(); it++) {
+    _sceneRoot.delObject(*it);
+  }
+  _staticBatchNames.clear();
+
+  std::vector<drawableCompound*> found;
+  _findStatic(&_sceneRoot, false, found);
+
+  // One batch for each shader.
+  std::vector<bsgPtr<drawableMulti> > batches;
+  std::map<shaderMgr*, int> batchIndex;
+
+  for (std::vector<drawableCompound*>::iterator it = found.begin();
+       it != found.end(); it++) {
+
+    shaderMgr* shader = (*it)->_pShader.ptr();
+    std::map<shaderMgr*, int>::iterator jt = batchIndex.find(shader);
+    if (jt == batchIndex.end()) {
+      batches.push_back(new drawableStaticBatch(
+                            drawableMulti::randomName("staticBatch"),
+                            (*it)->_pShader));
+
+      // It goes under the root, so the sources are put in the root's
+      // space.
+      batches.back()->setParent(&_sceneRoot);
+      jt = batchIndex.insert(std::make_pair(shader,
+                                            (int)batches.size() - 1)).first;
+    }
+
+    drawableStaticBatch* batch = bPtr(drawableStaticBatch, batches[jt->second]);
+    if (batch->addCompound(*it)) (*it)->_baked = true;
+  }
+
+  for (std::vector<bsgPtr<drawableMulti> >::iterator it = batches.begin();
+       it != batches.end(); it++) {
+    if (bPtr(drawableStaticBatch, (*it))->getNumSources() == 0) continue;
+    _staticBatchNames.push_back(_sceneRoot.addObject(*it));
+  }
+
+  return _staticBatchNames.size();
+}
 
 void scene::prepare() {
 
   _sceneRoot.prepare();
+  _updateRenderQueue();
 }
 
 glm::mat4 scene::getProjMatrix() {
@@ -1389,13 +5201,40 @@ glm::mat4 scene::getViewMatrix() {
 
 void scene::load() {
 
-  _sceneRoot.load();
+  // Bring in any textures that have arrived.
+  textureLoader::uploadReady();
+
+  // Shared meshes can only have fallen out of use if the tree
+  // changed, so only look for them then.
+  bool treeChanged = _sceneRoot.treeChanged();
+
+  _updateRenderQueue();
+  if (treeChanged) meshCache::releaseUnused();
+
+  _renderQueue.resetStats();
+  _renderQueue.load();
+  _culledThisFrame = false;
+}
+
+void scene::cull(const std::vector<glm::mat4> &viewProjMatrices) {
+
+  _updateRenderQueue();
+  _renderQueue.cull(viewProjMatrices);
+  _culledThisFrame = true;
 }
 
 void scene::draw(const glm::mat4 &viewMatrix,
                  const glm::mat4 &projMatrix) {
 
-  _sceneRoot.draw(viewMatrix, projMatrix);
+  _updateRenderQueue();
+
+  // Without a cull() for the whole frame, cull for this view alone.
+  if (!_culledThisFrame) {
+    _viewProjMatrices.assign(1, projMatrix * viewMatrix);
+    _renderQueue.cull(_viewProjMatrices);
+  }
+
+  _renderQueue.draw(viewMatrix, projMatrix);
 }
 
 }
@@ -6,14 +6,21 @@
 #include <stdexcept>
 #include <memory.h>
 #include <math.h>
+#include <stdint.h>
 #include <GL/glew.h>
 #include <GL/freeglut.h>
 #include <string>
 #include <vector>
 #include <list>
 #include <map>
+#include <set>
+#include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 // Include GLM
 #include <glm/glm.hpp>
@@ -40,6 +47,14 @@ typedef enum {
   GLDATA_TEXCOORDS  = 3   //! Texture coordinates, also called UVs.
 } GLDATATYPE;
 
+typedef enum {
+  GLFORMAT_FLOAT    = 0,  //! 32-bit floats, as given.  The default.
+  GLFORMAT_HALF     = 1,  //! 16-bit floats.
+  GLFORMAT_UNORM8   = 2,  //! Bytes, mapped to [0,1].  For colors.
+  GLFORMAT_SNORM10  = 3,  //! 10 bits a component, mapped to [-1,1].  Normals.
+  GLFORMAT_SNORM16  = 4   //! Shorts, mapped to [-1,1].  Normals, positions.
+} GLFORMATTYPE;
+
 typedef enum {
   GLSHADER_VERTEX   = 0,  //! This is a vertex shader.
   GLSHADER_FRAGMENT = 1,  //! This is a fragment shader.
@@ -130,6 +145,9 @@ class bsgPtrRC {
 
   // Decrement and return count.
   int release() { return --count; }
+
+  /// The number of pointers sharing the object.
+  int getCount() const { return count; }
 };
 
 /// \brief A smart pointer to a bsg object.
@@ -167,6 +185,9 @@ class bsgPtr {
   T* operator->() const { return _pData; };
   T* ptr() const { return _pData; }; // Use this for casts.
 
+  /// How many bsgPtrs point to this same object, this one included?
+  int useCount() const { return _reference->getCount(); };
+
   /// Assignment operator.
   bsgPtr<T>& operator=(const bsgPtr<T> &sp) {
     if (this != &sp) {
@@ -200,6 +221,184 @@ class bsgUtils {
 
 };
 
+/// \brief A ring of buffer space for data that changes every frame.
+///
+/// Data that is rewritten every frame is expensive to put in buffers
+/// of its own: each glBufferData() call allocates new storage, and
+/// writing into storage the GPU is still drawing from makes the driver
+/// wait.  Instead, this class keeps one big buffer divided into three
+/// regions, one for each of the last three frames.  Each frame's data
+/// is written into the next region, which the GPU finished with two
+/// frames ago.  A fence placed at the end of each frame makes sure of
+/// that, in case the GPU falls further behind.  Since a region is only
+/// fenced for the frame it was written in, data in the ring is good
+/// for that one frame, and has to be written again for the next.
+///
+/// The buffer is mapped once and left mapped where OpenGL 4.4 or the
+/// ARB_buffer_storage extension allows, and otherwise mapped with
+/// glMapBufferRange() for each write, with no synchronization, since
+/// the fences take care of it.  Without glMapBufferRange() and fences
+/// (OpenGL 3.0 and 3.2), the ring is not available, and streamed data
+/// goes in ordinary buffers.
+///
+/// There is one ring, shared by everything, and nothing moves it
+/// along on its own, since a program may load several scenes, or load
+/// one more than once, in a frame.  Call advanceRing() once per frame,
+/// after the last draw that uses this frame's data.  The ring's
+/// buffer belongs to the OpenGL context it was made in, so call
+/// deleteRing() before that context goes away.
+class streamBuffer {
+ private:
+
+  static const int _numRegions = 3;
+
+  GLuint _bufferID;
+  size_t _regionSize;
+  int _region;
+  size_t _offset;
+  unsigned long _frame;
+
+  GLsync _fences[_numRegions];
+
+  // Where the buffer is mapped, if it's mapped for good.
+  char* _mapped;
+
+  static streamBuffer* _ring;
+  static size_t _defaultRegionSize;
+
+  /// Frame numbers carry on from one ring to the next, so data written
+  /// into a deleted ring is never mistaken for current.
+  static unsigned long _nextFrame;
+
+  void _waitForRegion(const int &region);
+
+ public:
+  streamBuffer(const size_t &regionSize);
+  ~streamBuffer();
+
+  /// \brief Is streaming supported by this OpenGL context?
+  static bool supported();
+
+  /// \brief The shared ring, or NULL if it isn't supported.
+  ///
+  /// The ring is created the first time this is called, so call it
+  /// only once there is an OpenGL context.
+  static streamBuffer* getRing();
+
+  /// \brief Set the size of each frame's region of the shared ring.
+  ///
+  /// This has to be done before the ring is first used.  The default
+  /// is 4MB per frame.
+  static void setRegionSize(const size_t &regionSize) {
+    _defaultRegionSize = regionSize;
+  };
+
+  /// \brief Copy some data into this frame's region.
+  ///
+  /// Returns the offset of the data in the buffer, or -1 if there was
+  /// no room for it, in which case the caller should find somewhere
+  /// else to put it.
+  GLintptr write(const void* data, const size_t &size);
+
+  /// \brief Finish this frame and move on to the next region.
+  void nextFrame();
+
+  /// \brief Was something written in the given frame written this frame?
+  ///
+  /// Only this frame's region is protected by a fence, so data from
+  /// an earlier frame may be overwritten while the GPU still needs it.
+  bool isCurrent(const unsigned long &frame) const {
+    return frame == _frame;
+  };
+
+  /// \brief Move the shared ring along to the next frame.
+  ///
+  /// Call this exactly once per frame, when all of the frame's
+  /// drawing has been done.  Does nothing if the ring hasn't been
+  /// created.
+  static void advanceRing() { if (_ring) _ring->nextFrame(); };
+
+  /// \brief Has the shared ring been created?
+  static bool haveRing() { return _ring != NULL; };
+
+  /// \brief Delete the shared ring.
+  ///
+  /// Call this while the context it was created in is still current.
+  /// A new ring is created the next time one is needed.
+  static void deleteRing();
+
+  GLuint getBufferID() const { return _bufferID; };
+  unsigned long getFrame() const { return _frame; };
+};
+
+/// \brief A few big buffers to hold the data of many static meshes.
+///
+/// Giving every attribute of every object a buffer of its own makes
+/// for a great many small buffers, which is hard on the driver, and
+/// means binding a different buffer for nearly every draw.  Instead,
+/// static data is placed in ranges of a few large buffers (the
+/// "blocks"), and objects differ only in their offsets.
+///
+/// Freed ranges go on a free list, where they are coalesced with any
+/// free neighbors, and new ranges come from the smallest free range
+/// that fits.  Ranges in use are never moved, so a block can be left
+/// in pieces too small to use; it is not compacted.  There is one
+/// arena for vertex data and one for index data.  Anything bigger
+/// than a block gets its own buffer.
+class bufferArena {
+ private:
+
+  struct block {
+    GLuint bufferID;
+    // The free ranges, as offset -> size.
+    std::map<size_t, size_t> freeRanges;
+  };
+  std::vector<block> _blocks;
+
+  GLenum _target;
+
+  static std::map<GLenum, bufferArena*> _arenas;
+  static size_t _blockSize;
+  static bool _enabled;
+
+  void _addBlock();
+
+ public:
+  bufferArena(const GLenum &target) : _target(target) {};
+
+  /// \brief The shared arena for a buffer target.
+  ///
+  /// The target is GL_ARRAY_BUFFER or GL_ELEMENT_ARRAY_BUFFER.
+  /// Returns NULL if the arenas are disabled.
+  static bufferArena* getArena(const GLenum &target);
+
+  /// \brief Set the size of each block.  The default is 64MB.
+  ///
+  /// This only affects blocks allocated after the call.
+  static void setBlockSize(const size_t &blockSize) { _blockSize = blockSize; };
+
+  /// \brief Turn the arenas on or off.  They are on by default.
+  ///
+  /// Data already in an arena stays there.
+  static void setEnabled(const bool &enabled) { _enabled = enabled; };
+
+  /// \brief Find room for some data.
+  ///
+  /// Sets the buffer ID and offset, and returns true, or returns false
+  /// if the data is too big for a block.
+  bool allocate(const size_t &size, GLuint &bufferID, GLintptr &offset);
+
+  /// \brief Give back a range from allocate().
+  void release(const GLuint &bufferID, const GLintptr &offset,
+               const size_t &size);
+
+  /// \brief How many blocks are in use?
+  size_t getNumBlocks() const { return _blocks.size(); };
+
+  /// \brief The total free space in all the blocks, in bytes.
+  size_t getFreeSpace() const;
+};
+
 /// \brief Some data for an OpenGL object.
 ///
 /// For most OpenGL objects referencing data used in a shader, there
@@ -222,28 +421,99 @@ class drawableObjData {
   std::vector<T> _data;
 
  public:
- drawableObjData(): name("") {
+ drawableObjData(): name(""), ID(0), bufferID(0),
+    dirtyBegin(0), dirtyEnd(0), bufferSize(0), usage(GL_STATIC_DRAW),
+    drawBufferID(0), drawOffset(0), streamFrame(0), arena(NULL),
+    arenaSize(0) {
     _data.reserve(50);
-    ID = 0; bufferID = 0;
   };
- drawableObjData(const std::string inName, const std::vector<T> inData) :
-  name(inName), _data(inData) {}
+ drawableObjData(const std::string inName, const std::vector<T> &inData) :
+  _data(inData), name(inName), ID(0), bufferID(0),
+    dirtyBegin(0), dirtyEnd(inData.size()), bufferSize(0),
+    usage(GL_STATIC_DRAW), drawBufferID(0), drawOffset(0), streamFrame(0),
+    arena(NULL), arenaSize(0) {}
+
+  /// This one takes over the caller's vector instead of copying it.
+ drawableObjData(const std::string inName, std::vector<T> &&inData) :
+  _data(std::move(inData)), name(inName), ID(0), bufferID(0),
+    dirtyBegin(0), dirtyEnd(_data.size()), bufferSize(0),
+    usage(GL_STATIC_DRAW), drawBufferID(0), drawOffset(0), streamFrame(0),
+    arena(NULL), arenaSize(0) {}
+
+  // A range of an arena can only have one owner, or it would be given
+  // back twice, so these can be moved but not copied.
+  drawableObjData(const drawableObjData &objData) = delete;
+  drawableObjData &operator=(const drawableObjData &objData) = delete;
+
+  // Move constructor
+ drawableObjData(drawableObjData &&objData) :
+  _data(std::move(objData._data)), name(std::move(objData.name)),
+    ID(objData.ID), bufferID(objData.bufferID),
+    dirtyBegin(objData.dirtyBegin), dirtyEnd(objData.dirtyEnd),
+    bufferSize(objData.bufferSize), usage(objData.usage),
+    drawBufferID(objData.drawBufferID), drawOffset(objData.drawOffset),
+    streamFrame(objData.streamFrame), arena(objData.arena),
+    arenaSize(objData.arenaSize) {
+    objData.bufferID = 0;
+    objData.arena = NULL;
+    objData.arenaSize = 0;
+  };
 
-  // Copy constructor
- drawableObjData(const drawableObjData &objData) :
-  _data(objData.getData()), name(objData.name), ID(objData.ID),
-    bufferID(objData.bufferID) {};
+  // Move assignment.  Any buffer or arena range we had is given back
+  // first.
+  drawableObjData &operator=(drawableObjData &&objData) {
+    if (this == &objData) return *this;
+    deleteBuffer();
+    _data = std::move(objData._data);
+    name = std::move(objData.name);
+    ID = objData.ID;
+    bufferID = objData.bufferID;
+    dirtyBegin = objData.dirtyBegin;
+    dirtyEnd = objData.dirtyEnd;
+    bufferSize = objData.bufferSize;
+    usage = objData.usage;
+    drawBufferID = objData.drawBufferID;
+    drawOffset = objData.drawOffset;
+    streamFrame = objData.streamFrame;
+    arena = objData.arena;
+    arenaSize = objData.arenaSize;
+    objData.bufferID = 0;
+    objData.arena = NULL;
+    objData.arenaSize = 0;
+    return *this;
+  };
 
   /// The name of that data inside a shader.
   std::string name;
 
-  std::vector<T> getData() const { return _data; };
-  void addData(T d) { _data.push_back(d); };
-  void setData(const std::vector<T> data) { _data = data; };
+  /// \brief Read access to the whole array, without copying it.
+  const std::vector<T> &getData() const { return _data; };
+  void addData(const T &d) {
+    _data.push_back(d);
+    setDirty(_data.size() - 1, _data.size());
+  };
+  void setData(const std::vector<T> &data) { _data = data; setAllDirty(); };
+  /// Replaces the data with the caller's vector, which is left empty.
+  void setData(std::vector<T> &&data) {
+    _data = std::move(data);
+    setAllDirty();
+  };
+  /// Adds the elements of another array to the end of this one.
+  void append(const drawableObjData &other) {
+    size_t oldSize = _data.size();
+    _data.insert(_data.end(), other._data.begin(), other._data.end());
+    setDirty(oldSize, _data.size());
+  };
+  /// Changes the number of elements.  New ones are zero.
+  void resize(const size_t &n) { _data.resize(n); setAllDirty(); };
 
-  T* beginAddress() { return &_data[0]; };
+  T* beginAddress() { return _data.data(); };
+  const T* beginAddress() const { return _data.data(); };
 
-  T operator[](const int i) { return _data[i]; };
+  /// Element access by reference, so you can also write through it.
+  /// If you do, use setDirty() so the change gets to the buffer.
+  T &operator[](const size_t i) { return _data[i]; };
+  const T &operator[](const size_t i) const { return _data[i]; };
 
   // The ID that goes with that name.
   GLint ID;
@@ -251,17 +521,192 @@ class drawableObjData {
   /// The ID of the buffer containing that data.
   GLuint bufferID;
 
+  /// The range of elements, [dirtyBegin, dirtyEnd), changed since
+  /// the data was last loaded into the buffer.
+  size_t dirtyBegin, dirtyEnd;
+
+  /// The number of elements the buffer was last allocated for.
+  size_t bufferSize;
+
+  /// The usage hint for the buffer: GL_STATIC_DRAW, GL_DYNAMIC_DRAW,
+  /// or GL_STREAM_DRAW.  Stream data goes in the shared streamBuffer
+  /// ring, if there is one.
+  GLenum usage;
+
+  /// Where to draw the data from.  That's the start of its own
+  /// buffer, unless it is static, in which case it is somewhere in a
+  /// bufferArena, or streamed, in which case it is somewhere in the
+  /// ring.
+  GLuint drawBufferID;
+  GLintptr drawOffset;
+
+  /// The frame in which the data was last written to the ring.
+  unsigned long streamFrame;
+
+  /// The arena holding the data, if any, and the number of bytes
+  /// allocated in it.  The arena is kept so the range can be given
+  /// back even if the arenas have since been disabled.
+  bufferArena* arena;
+  size_t arenaSize;
+
+  /// Add a range of elements to the dirty range.
+  void setDirty(const size_t &begin, const size_t &end) {
+    if (dirtyEnd <= dirtyBegin) {
+      dirtyBegin = begin;
+      dirtyEnd = end;
+    } else {
+      dirtyBegin = std::min(dirtyBegin, begin);
+      dirtyEnd = std::max(dirtyEnd, end);
+    }
+  };
+  void setAllDirty() { dirtyBegin = 0; dirtyEnd = _data.size(); };
+  bool isDirty() const { return dirtyEnd > dirtyBegin; };
+  void setClean() { dirtyBegin = dirtyEnd = 0; };
+
+  /// \brief Load the changed part of the data into the buffer.
+  ///
+  /// If the size has changed, or all of it has changed, the buffer is
+  /// given a whole new data store.  (This is called "orphaning", and
+  /// lets OpenGL keep drawing from the old one without waiting.)
+  /// Otherwise just the dirty range is copied with glBufferSubData().
+  /// A static buffer that is loaded a second time is changed to
+  /// dynamic, since it evidently is.
+  ///
+  /// Static data goes into a range of a bufferArena instead, if the
+  /// arenas are enabled and there is room.  If it changes after that,
+  /// it too is made dynamic, and moved out to a buffer of its own, so
+  /// the changes don't stall the draws from the rest of the arena.
+  void loadBuffer(const GLenum &target) {
+
+    if ((usage == GL_STATIC_DRAW) && !_data.empty()) {
+      if (arena && isDirty()) {
+        usage = GL_DYNAMIC_DRAW;
+      } else {
+        bufferArena* staticArena = bufferArena::getArena(target);
+        if (staticArena && loadArena(staticArena, target)) return;
+      }
+    }
+    if (arena) {
+      releaseArena();
+      setAllDirty();
+    }
+
+    // The buffer is made the first time it's needed.
+    if (bufferID == 0) glGenBuffers(1, &bufferID);
+    drawBufferID = bufferID;
+    drawOffset = 0;
+
+    if (!isDirty() && (bufferSize == _data.size())) return;
+
+    glBindBuffer(target, bufferID);
+    if ((bufferSize != _data.size()) ||
+        ((dirtyBegin == 0) && (dirtyEnd >= _data.size()))) {
+      if ((bufferSize > 0) && (usage == GL_STATIC_DRAW))
+        usage = GL_DYNAMIC_DRAW;
+      glBufferData(target, byteSize(), beginAddress(), usage);
+      bufferSize = _data.size();
+    } else {
+      glBufferSubData(target, dirtyBegin * sizeof(T),
+                      (std::min(dirtyEnd, _data.size()) - dirtyBegin) * sizeof(T),
+                      &_data[dirtyBegin]);
+    }
+    glBindBuffer(target, 0);
+
+    setClean();
+  };
+
+  /// \brief Put the data in its arena range, allocating the range
+  /// if the data is new or has changed size.  Returns false if there
+  /// is no room.
+  bool loadArena(bufferArena* staticArena, const GLenum &target) {
+
+    if ((arena != staticArena) || (arenaSize != byteSize())) {
+      releaseArena();
+      if (!staticArena->allocate(byteSize(), drawBufferID, drawOffset))
+        return false;
+      arena = staticArena;
+      arenaSize = byteSize();
+      setAllDirty();
+    }
+
+    if (isDirty()) {
+      glBindBuffer(target, drawBufferID);
+      glBufferSubData(target, drawOffset + dirtyBegin * sizeof(T),
+                      (std::min(dirtyEnd, _data.size()) - dirtyBegin) * sizeof(T),
+                      &_data[dirtyBegin]);
+      glBindBuffer(target, 0);
+      setClean();
+    }
+    return true;
+  };
+
+  /// \brief Give back the data's range in an arena, if it has one.
+  void releaseArena() {
+    if (!arena) return;
+    arena->release(drawBufferID, drawOffset, arenaSize);
+    arena = NULL;
+    arenaSize = 0;
+  };
+
+  /// \brief Delete our buffer, and give back any arena range.
+  ///
+  /// The data stays, and goes into a new buffer at the next load.
+  /// This needs the OpenGL context, if there was a buffer.
+  void deleteBuffer() {
+    releaseArena();
+    if (bufferID) glDeleteBuffers(1, &bufferID);
+    bufferID = 0;
+    bufferSize = 0;
+    drawBufferID = 0;
+    drawOffset = 0;
+    setAllDirty();
+  };
+
+  /// \brief Load the data wherever it belongs.
+  ///
+  /// Stream data is written into the shared ring, unless it was
+  /// already written there this frame and hasn't changed.  If there
+  /// is no ring, or no room in it, the data goes into its own buffer
+  /// like any other.
+  void load(const GLenum &target) {
+
+    streamBuffer* ring = NULL;
+    if ((usage == GL_STREAM_DRAW) && !_data.empty())
+      ring = streamBuffer::getRing();
+
+    if (ring) {
+      if (!isDirty() && (drawBufferID == ring->getBufferID()) &&
+          ring->isCurrent(streamFrame)) return;
+
+      releaseArena();
+
+      GLintptr offset = ring->write(beginAddress(), byteSize());
+      if (offset >= 0) {
+        drawBufferID = ring->getBufferID();
+        drawOffset = offset;
+        streamFrame = ring->getFrame();
+        setClean();
+        return;
+      }
+
+      // The buffer of our own may be out of date, too.
+      setAllDirty();
+    }
+
+    loadBuffer(target);
+  };
+
   /// Is there any data in here?
-  bool empty() { return _data.empty(); };
+  bool empty() const { return _data.empty(); };
 
   /// A size calculator. Total number of bytes.
-  size_t byteSize() { return _data.size() * sizeof(T); };
+  size_t byteSize() const { return _data.size() * sizeof(T); };
 
   /// Another size calculator.
-  size_t size() { return _data.size(); };
+  size_t size() const { return _data.size(); };
 
   /// Yet another size calculator.
-  size_t componentsPerVertex() { return sizeof(T) / sizeof(float); };
+  size_t componentsPerVertex() const { return sizeof(T) / sizeof(float); };
 };
 
 /// \class lightList
@@ -328,16 +773,18 @@ class lightList {
     return addLight(position, white);
   };
 
-  int getNumLights() { return _lightPositions.size(); };
+  int getNumLights() const { return _lightPositions.size(); };
 
   // We have mutators and accessors for all the pieces...
-  std::vector<glm::vec4> getPositions() { return _lightPositions.getData(); };
-  void setPositions(const std::vector<glm::vec4> positions) {
+  const std::vector<glm::vec4> &getPositions() const {
+    return _lightPositions.getData(); };
+  void setPositions(const std::vector<glm::vec4> &positions) {
     _lightPositions.setData(positions);
   };
   GLuint getPositionID() { return _lightPositions.ID; };
 
-  std::vector<glm::vec4> getColors() { return _lightColors.getData(); };
+  const std::vector<glm::vec4> &getColors() const {
+    return _lightColors.getData(); };
   void setColors(const std::vector<glm::vec4> &colors) {
     _lightColors.setData(colors);
   };
@@ -347,12 +794,13 @@ class lightList {
   void setPosition(const int &i, const glm::vec4 &position) {
     _lightPositions[i] = position;
   };
-  glm::vec4 getPosition(const int &i) { return _lightPositions[i]; };
+  const glm::vec4 &getPosition(const int &i) const {
+    return _lightPositions[i]; };
 
   /// \brief Change a light's color.
   void setColor(const int &i, const glm::vec4 &color) {
     _lightColors[i] = color; };
-  glm::vec4 getColor(const int &i) { return _lightColors[i]; };
+  const glm::vec4 &getColor(const int &i) const { return _lightColors[i]; };
 
   /// \brief Link the light data with whatever shader is in use.
   ///
@@ -376,11 +824,12 @@ class lightList {
 
 typedef enum {
   texturePNG = 0, //! Use for a PNG file.
-  textureDDS = 1, //! Not implemented.
+  textureDDS = 1, //! A DDS file, compressed as BC1, BC2, BC3, or BC7.
   textureBMP = 2, //! Not implemented.
   textureCHK = 3, //! Will provide a checkerboard texture.
   textureJPG = 4, //! Not implemented.
-  textureTTF = 5  //! Not implemented yet (MKE)
+  textureTTF = 5, //! Not implemented yet (MKE)
+  textureKTX = 6  //! A KTX (version 1) file, compressed or not.
 } textureType;
 
 
@@ -393,6 +842,10 @@ class textureMgr {
  private:
   GLfloat _width, _height;
 
+  // Is the image still coming from the textureLoader?
+  bool _loading;
+  friend class textureLoader;
+
   GLuint _textureAttribID;
   std::string _textureAttribName;
 
@@ -403,19 +856,68 @@ class textureMgr {
   GLuint _textureBufferID;
 
   GLuint _loadPNG(const std::string imagePath);
+  GLuint _loadDDS(const std::string imagePath);
+  GLuint _loadKTX(const std::string imagePath);
   GLuint _loadCheckerBoard (const int size, int numFields);
+
+  static bool _mipmaps;
+  static float _maxAnisotropy;
   GLuint _loadTTF(const std::string ttfPath); // MKE
 
  public:
-  textureMgr() { _setupDefaultNames(); };
+  textureMgr() : _loading(false), _textureBufferID(0) {
+    _setupDefaultNames(); };
+  ~textureMgr();
 
   /// \brief Reads a texture from an image file.
   ///
   /// The type can be texturePNG, in which case fileName better be a
   /// PNG file name, or textureCHK, in which case you get a
   /// checkerboard pattern, and the file name is ignored.
+  ///
+  /// It can also be textureDDS or textureKTX, for images that are
+  /// already compressed for the graphics card (BC1, BC3, BC7, and so
+  /// on), which take a quarter to an eighth of the memory.  Those
+  /// are loaded as they are, mipmaps and all, so store them with
+  /// their bottom row first, the way OpenGL counts, or they'll come
+  /// out upside down.  Throws an exception if the file can't be read
+  /// or the OpenGL context can't handle its format.
   void readFile(const textureType &type, const std::string &fileName);
 
+  /// \brief Reads a texture from an image file, in the background.
+  ///
+  /// Like readFile(), but returns right away, and the image is
+  /// decoded and loaded later, by the textureLoader.  Until then, the
+  /// texture shows whatever it showed before, or a checkerboard if it
+  /// is new.  Only texturePNG is read in the background; the other
+  /// types are read by readFile().
+  void readFileAsync(const textureType &type, const std::string &fileName);
+
+  /// \brief Is a background read still under way?
+  bool isLoading() const { return _loading; };
+
+  /// \brief Make mipmaps for the images that are read.
+  ///
+  /// A PNG image gets a full set of mipmaps, made by OpenGL, and is
+  /// sampled with trilinear filtering, so it doesn't shimmer when it
+  /// is small on the screen, and reads less memory to draw.  DDS and
+  /// KTX files bring their own mipmaps.  With this off, a texture has
+  /// just the one image, sampled with GL_NEAREST.  This is on by
+  /// default, and needs OpenGL 3.0 or one of the framebuffer object
+  /// extensions, for glGenerateMipmap().
+  static void setMipmaps(const bool &mipmaps) { _mipmaps = mipmaps; };
+  static bool getMipmaps() { return _mipmaps; };
+
+  /// \brief Use anisotropic filtering on mipmapped textures.
+  ///
+  /// Surfaces seen at a glancing angle stay sharp with up to this
+  /// many samples.  One, the default, means no anisotropic filtering.
+  /// Needs the EXT_texture_filter_anisotropic extension, and is
+  /// limited to what it can do.
+  static void setMaxAnisotropy(const float &maxAnisotropy) {
+    _maxAnisotropy = maxAnisotropy; };
+  static float getMaxAnisotropy() { return _maxAnisotropy; };
+
   /// \brief Prepare the texture to be rendered.
   ///
   /// Meant to be used during the shaderMgr.load() step.
@@ -436,6 +938,97 @@ class textureMgr {
   GLfloat getHeight() { return _height; };
 };
 
+/// \brief Reads image files for textures in the background.
+///
+/// Decoding a big image takes a while, and many of them at startup
+/// can freeze an application for seconds.  textureMgr::readFileAsync()
+/// hands its file to this instead, and a pool of worker threads
+/// decodes it.  The decoded images wait in a queue until
+/// uploadReady(), on the OpenGL thread, copies them into their
+/// textures through a pixel buffer object.  It only copies so many
+/// bytes each frame, so no one frame takes the whole hit.
+///
+/// The scene calls uploadReady() at each load().  If you are drawing
+/// without a scene, call it yourself, once per frame.
+class textureLoader {
+ private:
+
+  struct job {
+    std::string fileName;
+    textureMgr* texture;
+    unsigned char* pixels;
+    int width, height;
+  };
+
+  // Jobs waiting to be decoded, being decoded, and decoded.  A job
+  // whose texture is deleted while it is being decoded is left with
+  // a NULL texture, and thrown away when it's done.
+  static std::deque<job*> _waiting, _ready;
+  static std::vector<job*> _decoding;
+  static std::mutex _mutex;
+  static std::condition_variable _wakeup;
+  static std::vector<std::thread> _workers;
+  static bool _stopping;
+
+  static int _numThreads;
+  static size_t _bytesPerFrame;
+  static GLuint _pixelBufferID;
+
+  static void _work();
+  static void _upload(job* finished);
+  static void _freeJob(job* finished);
+
+ public:
+
+  /// \brief How many threads decode images.
+  ///
+  /// Zero, the default, means one fewer than the number of cores, but
+  /// at least one.  This has to be set before the first image is
+  /// read.
+  static void setNumThreads(const int &numThreads) {
+    _numThreads = numThreads; };
+
+  /// \brief How many bytes of images to upload each frame.
+  ///
+  /// At least one image is uploaded at every uploadReady(), however
+  /// big it is.  The default is 16MB.
+  static void setBytesPerFrame(const size_t &bytesPerFrame) {
+    _bytesPerFrame = bytesPerFrame; };
+
+  /// \brief Read an image file into a texture, in the background.
+  ///
+  /// Use textureMgr::readFileAsync() instead of calling this.
+  static void add(textureMgr* texture, const std::string &fileName);
+
+  /// \brief Forget the images on their way to a texture.
+  static void cancel(textureMgr* texture);
+
+  /// \brief Load the images that are ready into their textures.
+  ///
+  /// Call this on the OpenGL thread, once a frame.  Returns the
+  /// number of images loaded.
+  static int uploadReady();
+
+  /// \brief How many images are still to be loaded?
+  static size_t getNumPending();
+
+  /// \brief Wait until every image is read, and load them all.
+  static void finish();
+
+  /// \brief Stop the worker threads.
+  ///
+  /// Images still waiting are thrown away.  This happens by itself
+  /// when the program exits.
+  static void stop();
+
+  /// \brief Delete the pixel buffer the images are uploaded through.
+  ///
+  /// It belongs to the OpenGL context, so call this on the OpenGL
+  /// thread before that context goes away.  Another is made if more
+  /// images are loaded.
+  static void deletePixelBuffer();
+};
+
 
 ///  /brief A collection of shaders that work together as a shader program.
 ///
@@ -457,6 +1050,9 @@ class shaderMgr {
 
   GLuint _programID;
 
+  /// The program last put to use, by any shaderMgr.
+  static GLuint _currentProgram;
+
   /// Tells us whether the shaders have been loaded and compiled yet.
   bool _compiled;
 
@@ -540,7 +1136,16 @@ class shaderMgr {
   /// on this shader program, like enabling a buffer or loading an
   /// attribute's data.  OpenGL uses "state", and this call puts the
   /// GPU in a state of being ready to use this shader.
-  void useProgram() { glUseProgram(_programID); };
+  void useProgram() {
+    glUseProgram(_programID);
+    _currentProgram = _programID;
+  };
+
+  /// \brief The program of the shaderMgr last used.
+  ///
+  /// Objects use this to find the attribute setup that goes with the
+  /// program they are being drawn with.
+  static GLuint getCurrentProgram() { return _currentProgram; };
 
   /// \brief Sanity check could go here.
   ///
@@ -558,6 +1163,174 @@ class shaderMgr {
   ///
   /// Actually loads data like the light list to be used in the shader.
   void draw();
+
+  /// \brief Loads just the light data.
+  ///
+  /// The first half of draw().  Uniform values stick to a program, so
+  /// the render queue only needs to do this once for each program,
+  /// not for every object drawn with it.
+  void drawLights() { _lightList->draw(); };
+
+  /// \brief Binds just the texture, if there is one.
+  ///
+  /// The other half of draw().
+  void drawTexture() { if (_textureLoaded) _texture->draw(); };
+
+  /// \brief Returns the ID of the texture, or zero if there isn't one.
+  GLuint getTextureID() {
+    return _textureLoaded ? _texture->getTextureID() : 0; };
+};
+
+/// \brief A bounding volume hierarchy over the triangles of a mesh.
+///
+/// Used for ray casting against a drawableObj.  The triangles are
+/// sorted into a binary tree of boxes, with up to four triangles at
+/// each leaf.  The four are stored side by side, one coordinate at a
+/// time, so that all four can be tested against a ray at once with
+/// SSE instructions, where they are available.  The tree is made from
+/// the same vertex data that is sent to OpenGL, in model space.
+class triangleTree {
+ private:
+  struct treeNode {
+    glm::vec3 lower, upper;
+    /// The children, for an interior node.
+    int left, right;
+    /// The triangles, for a leaf, or -1.
+    int block;
+  };
+
+  /// Four triangles, as a corner and two edges each.  Unused slots
+  /// have zero edges, which no ray can hit.
+  struct triangleBlock {
+    float v0[3][4];
+    float e1[3][4];
+    float e2[3][4];
+    int id[4];
+  };
+
+  std::vector<treeNode> _nodes;
+  std::vector<triangleBlock> _blocks;
+
+  int _build(std::vector<int> &triangles, const int &first, const int &last,
+             const std::vector<glm::vec3> &corners,
+             const std::vector<glm::vec3> &centers);
+
+  bool _intersectBlock(const triangleBlock &block,
+                       const glm::vec3 &origin, const glm::vec3 &direction,
+                       float &distance, int &triangle) const;
+
+ public:
+  triangleTree() {};
+
+  /// \brief Throw the tree away.
+  void clear() { _nodes.clear(); _blocks.clear(); };
+
+  /// \brief Is there anything in the tree?
+  bool empty() const { return _nodes.empty(); };
+
+  /// \brief Build the tree.
+  ///
+  /// The draw type and count are the ones used to draw the mesh, so
+  /// triangles, triangle strips, and triangle fans are understood,
+  /// with or without an index array.  Anything else (lines, points)
+  /// makes an empty tree.
+  void build(const std::vector<glm::vec4> &vertices,
+             const std::vector<GLuint> &indices,
+             const GLenum &drawType, const GLsizei &count);
+
+  /// \brief Finds the nearest triangle hit by a ray.
+  ///
+  /// Only hits nearer than the input distance count, and if one is
+  /// found, the distance and triangle are set and the return is true.
+  /// The distance is in units of the direction vector's length.  The
+  /// triangle is its order in the mesh, e.g. triangle n of a strip
+  /// uses vertices n, n+1, and n+2.
+  bool intersect(const glm::vec3 &origin, const glm::vec3 &direction,
+                 float &distance, int &triangle) const;
+};
+
+/// \brief Writes plain data to a binary file.
+///
+/// Values go out in the machine's own byte order, and each write is
+/// padded to a multiple of four bytes, so the arrays of floats and
+/// ints that follow stay aligned.  Read it back with a binaryReader.
+class binaryWriter {
+ private:
+  std::ostream &_out;
+
+ public:
+  binaryWriter(std::ostream &out) : _out(out) {};
+
+  void putBytes(const void* data, const size_t &n) {
+    static const char zeros[4] = { 0, 0, 0, 0 };
+    _out.write((const char*)data, n);
+    _out.write(zeros, (4 - n % 4) % 4);
+  };
+  template <class T>
+  void putValue(const T &value) { putBytes(&value, sizeof(T)); };
+  void putString(const std::string &s) {
+    putValue<uint32_t>(s.size());
+    putBytes(s.data(), s.size());
+  };
+  template <class T>
+  void putArray(const std::vector<T> &data) {
+    putValue<uint32_t>(data.size());
+    putBytes(data.data(), data.size() * sizeof(T));
+  };
+
+  bool good() const { return _out.good(); };
+};
+
+/// \brief Reads what a binaryWriter wrote, from memory.
+///
+/// Every read checks that it stays inside the memory.  If one
+/// doesn't, it fails, and so does every read after it, so a string of
+/// reads can be checked once, with good(), at the end.
+class binaryReader {
+ private:
+  const char* _p;
+  const char* _end;
+  bool _good;
+
+ public:
+  binaryReader(const char* begin, const char* end) :
+    _p(begin), _end(end), _good(true) {};
+
+  /// Returns where the bytes are, or NULL if there aren't enough.
+  const char* getBytes(const size_t &n) {
+    size_t padded = (n + 3) & ~(size_t)3;
+    if (!_good || ((size_t)(_end - _p) < padded)) {
+      _good = false;
+      return NULL;
+    }
+    const char* out = _p;
+    _p += padded;
+    return out;
+  };
+  template <class T>
+  bool getValue(T &value) {
+    const char* p = getBytes(sizeof(T));
+    if (p) memcpy(&value, p, sizeof(T));
+    return p != NULL;
+  };
+  bool getString(std::string &s) {
+    uint32_t n = 0;
+    const char* p = getValue(n) ? getBytes(n) : NULL;
+    if (p) s.assign(p, n);
+    return p != NULL;
+  };
+  template <class T>
+  bool getArray(std::vector<T> &data) {
+    uint32_t n = 0;
+    const char* p = getValue(n) ? getBytes((size_t)n * sizeof(T)) : NULL;
+    if (p) {
+      data.resize(n);
+      memcpy(data.data(), p, (size_t)n * sizeof(T));
+    }
+    return p != NULL;
+  };
+
+  bool good() const { return _good; };
 };
 
 /// \brief The information necessary to draw an object.
@@ -586,6 +1359,12 @@ class drawableObj {
   drawableObjData<glm::vec4> _normals;
   drawableObjData<glm::vec2> _uvs;
 
+  // An optional index array.  If this is empty, the object is drawn
+  // with glDrawArrays, and the vertex arrays above are taken in order.
+  // If there are indices, the object is drawn with glDrawElements and
+  // the indices refer to positions in the arrays above.
+  drawableObjData<GLuint> _indices;
+
   std::string print() const { return std::string("drawableObj"); };
   friend std::ostream &operator<<(std::ostream &os, const drawableObj &obj);
 
@@ -596,33 +1375,225 @@ class drawableObj {
   bool _haveBoundingBox;
   glm::vec4 _vertexBoundingBoxLower, _vertexBoundingBoxUpper;
   float _boundingBoxMin;
+  unsigned int _boundingBoxVersion;
+
+  /// For ray casting.  Built the first time it is needed, and again
+  /// after the vertices or indices change.
+  triangleTree _triangleTree;
+  bool _haveTriangleTree;
 
   // This data is for taking the component data and creating an
   // interleaved buffer with an index array.  This is supposed to be
   // an optimization.  The vertex position is always zero, and the
   // vertices array is not optional, so there is no vertexPos variable.
+  // The positions are in bytes, and there is a count of the floats
+  // used for each attribute.  A position or color whose last
+  // component is always 1.0 leaves it out, since OpenGL fills in that
+  // value anyway, and so do normals, which don't use it.
   bool _interleaved;
   GLshort _colorPos, _normalPos, _uvPos, _stride;
-  drawableObjData<float> _interleavedData;
+  GLshort _vertexSize, _colorSize, _normalSize, _uvSize;
+  drawableObjData<GLubyte> _interleavedData;
+
+  // The storage format of each attribute in the interleaved data,
+  // indexed by GLDATATYPE.  The packed format is the one asked for,
+  // unless the OpenGL context can't do it.
+  GLFORMATTYPE _formats[4];
+  GLFORMATTYPE _packedFormats[4];
+  GLFORMATTYPE _resolveFormat(const GLDATATYPE &type, const GLshort &size);
+
+  // Quantized positions are stored relative to a box around the
+  // vertices, and this matrix takes them back to model space.
+  glm::vec3 _quantizeCenter, _quantizeHalfSize;
+  glm::mat4 _positionMatrix;
+  bool _setQuantizeBox(const bool &all);
+
+  // The component data keeps track of what has changed since it was
+  // last packed into the interleaved data.
+  void _packInterleaved();
+  bool _needsPacking() {
+    return _vertices.isDirty() || _colors.isDirty() ||
+      _normals.isDirty() || _uvs.isDirty();
+  };
+
+  // Is any of the data streamed through the ring?  If so, it has to
+  // be checked at every load.
+  bool _streaming() {
+    return (_vertices.usage == GL_STREAM_DRAW) ||
+      (_colors.usage == GL_STREAM_DRAW) ||
+      (_normals.usage == GL_STREAM_DRAW) ||
+      (_uvs.usage == GL_STREAM_DRAW);
+  };
 
   void _getAttribLocations(GLuint programID);
   void _prepareSeparate(GLuint programID);
   void _prepareInterleaved(GLuint programID);
   void _loadSeparate();
   void _loadInterleaved();
-  void _drawSeparate();
-  void _drawInterleaved();
+  void _loadIndices();
+  void _setupAttributes();
+  void _setupSeparate();
+  void _setupInterleaved();
+  void _drawPrimitives(const GLsizei &instanceCount);
+
+  // A vertex array object records all the attribute setup, so a draw
+  // is just a bind and a glDraw*() call.  There is one for each
+  // program the object has been prepared with, since the attribute
+  // locations belong to the program, and draw() uses the one for the
+  // program in use.  Each needs to be set up again whenever the
+  // buffers or the layout of the data change.  Without vertex array
+  // objects, the ID is zero, and only the locations are used.  The
+  // ones for programs that no longer exist are deleted when the
+  // object is prepared for a new program.
+  struct vertexArray {
+    GLuint ID;
+    bool needsSetup;
+    GLint locations[4];
+  };
+  typedef std::map<GLuint, vertexArray> VertexArrayMap;
+  VertexArrayMap _vertexArrays;
+  void _vertexArraysNeedSetup();
+  void _deleteStaleVertexArrays();
+  void _useAttribLocations(const vertexArray &array);
+
+  // Drawn with face culling off, so the back shows too.
+  bool _twoSided;
+
+  // One color for the whole object, instead of a color array.  It is
+  // given to the color attribute with glVertexAttrib4fv() at each
+  // draw, which acts like a uniform, and needs no change to the
+  // shaders.
+  bool _haveConstantColor;
+  glm::vec4 _constantColor;
+  void _setConstantColor();
+  void _clearConstantColor();
+
+  // An object made by append()ing others together draws each of them
+  // as a separate range of vertices, all with one glMultiDrawArrays()
+  // call.  It keeps the originals, too.
+  std::vector<GLint> _firsts;
+  std::vector<GLsizei> _counts;
+  std::vector<bsgPtr<drawableObj> > _sources;
+
+  // An indexed object can be told to draw only some ranges of its
+  // indices, all with one glMultiDrawElements() call.  The offsets
+  // are worked out from the firsts at each draw.
+  bool _drawRanges;
+  std::vector<GLuint> _rangeFirsts;
+  std::vector<GLsizei> _rangeCounts;
+  std::vector<const GLvoid*> _rangeOffsets;
 
  public:
  drawableObj() :
   _loadedIntoBuffer(false),
-    _interleaved(false),
     _selectable(true),
+    _haveBoundingBox(false),
     _boundingBoxMin(0.1),
-    _haveBoundingBox(false) {};
+    _boundingBoxVersion(0),
+    _haveTriangleTree(false),
+    _interleaved(false),
+    _colorPos(0), _normalPos(0), _uvPos(0), _stride(0),
+    _vertexSize(0), _colorSize(0), _normalSize(0), _uvSize(0),
+    _twoSided(false),
+    _haveConstantColor(false),
+    _drawRanges(false) {
+    for (int i = 0; i < 4; i++) _formats[i] = _packedFormats[i] = GLFORMAT_FLOAT;
+  };
+
+  /// Deletes the vertex array objects and buffers, and gives back any
+  /// arena space used by the data.  The OpenGL context must be
+  /// current.
+  ~drawableObj();
+
+  /// \brief Are vertex array objects supported by this OpenGL context?
+  ///
+  /// They are core in OpenGL 3.0, and otherwise come with the
+  /// ARB_vertex_array_object extension.  Without them, the attributes
+  /// are set up again at every draw.
+  static bool vertexArraysSupported();
 
   /// \brief Set up the buffers to be interleaved,
-  void setInterleaved(bool interleaved) { _interleaved = interleaved; };
+  void setInterleaved(bool interleaved) {
+    if (interleaved != _interleaved) _loadedIntoBuffer = false;
+    _interleaved = interleaved;
+  };
+
+  /// \brief Show both sides of the surface with one copy of it.
+  ///
+  /// A two-sided object is drawn with GL_CULL_FACE turned off, so its
+  /// back faces show, instead of needing a second copy of every
+  /// triangle, wound the other way, with the normals reversed.  The
+  /// shader has to light the back, though, by reversing the normal
+  /// when gl_FrontFacing is false.  See textureShader.fp.  The
+  /// compound or render queue drawing the object turns culling off
+  /// and on, and only between objects that differ.
+  ///
+  /// gl_FrontFacing is only seen by the fragment shader, so this is
+  /// only right for shaders that light there, like textureShader.fp,
+  /// or don't light at all, like shader.vp and shader2.vp, which show
+  /// both sides in the same color.  A shader that lights each vertex
+  /// lights the back with the front's normals; objects drawn with one
+  /// of those need real back faces instead.
+  void setTwoSided(const bool &twoSided) { _twoSided = twoSided; };
+  bool getTwoSided() const { return _twoSided; };
+
+  /// \brief Give the whole object one color.
+  ///
+  /// Instead of a color array with the same value at every vertex,
+  /// the shader's color attribute, with the given name, is set to this
+  /// value for each draw.  This takes the place of any color array.
+  /// Objects of different colors are not merged or batched together.
+  void setConstantColor(const std::string &name, const glm::vec4 &color);
+  bool haveConstantColor() const { return _haveConstantColor; };
+  const glm::vec4 &getConstantColor() const { return _constantColor; };
+
+  /// \brief Store an attribute in a smaller format.
+  ///
+  /// Everything is given to us as floats, but the buffers don't have
+  /// to hold it that way.  Colors fit in four bytes (GLFORMAT_UNORM8),
+  /// normals in four (GLFORMAT_SNORM10) or eight (GLFORMAT_SNORM16),
+  /// and positions in eight (GLFORMAT_SNORM16), which is stored
+  /// relative to a box around the object, to 1/65535 of its size.
+  /// GLFORMAT_HALF works for anything.  The conversion happens when
+  /// the data is packed into the interleaved buffer, so this turns on
+  /// interleaving.  The component data is kept as floats, for
+  /// bounding boxes and ray casting.
+  ///
+  /// Formats the context can't handle fall back to something it can.
+  /// Quantized positions need their own model matrix (see
+  /// getPositionMatrix()), which drawableCompound takes care of.  A
+  /// format that makes no sense for an attribute, like bytes for a
+  /// normal, is ignored with a caution.
+  void setFormat(const GLDATATYPE &type, const GLFORMATTYPE &format);
+  GLFORMATTYPE getFormat(const GLDATATYPE &type) const {
+    return _formats[type]; };
+
+  /// \brief Use the smallest formats for everything.
+  ///
+  /// Quantized positions, 10-bit normals, byte colors, and half-float
+  /// texture coordinates.  That's 20 bytes a vertex instead of 48.
+  void setCompactFormats();
+
+  /// \brief Can the OpenGL context draw from data in this format?
+  ///
+  /// Half floats need OpenGL 3.0 or the ARB_half_float_vertex
+  /// extension, and the 10-bit format needs OpenGL 3.3 or the
+  /// ARB_vertex_type_2_10_10_10_rev extension.
+  static bool formatSupported(const GLFORMATTYPE &format);
+
+  /// \brief Are the positions in the buffer quantized?
+  ///
+  /// As of the last time they were packed.
+  bool isQuantized() const {
+    return _interleaved &&
+      (_packedFormats[GLDATA_VERTICES] == GLFORMAT_SNORM16); };
+
+  /// \brief Takes quantized positions back to model space.
+  ///
+  /// When isQuantized(), the model matrix given to the shader must be
+  /// multiplied by this one, on the right.  The normal matrix is
+  /// unaffected.
+  const glm::mat4 &getPositionMatrix() const { return _positionMatrix; };
 
   /// \brief Specify the draw type of the shape.
   ///
@@ -633,16 +1604,19 @@ class drawableObj {
   /// http://www.falloutsoftware.com/tutorials/gl/gl3.htm
   void setDrawType(const GLenum drawType) {
     _drawType = drawType;
-    _count = _vertices.size();
+    _count = _indices.empty() ? _vertices.size() : _indices.size();
+    _haveTriangleTree = false;
   };
 
   /// \brief Specify the draw type and the vertex count.
   ///
   /// The count refers here to the number of vertices, *not* the
-  /// number of triangles, line segments, quads, whatever.
+  /// number of triangles, line segments, quads, whatever.  For an
+  /// indexed object, it is the number of indices.
   void setDrawType(const GLenum drawType, const GLsizei count) {
     _drawType = drawType;
     _count = count;
+    _haveTriangleTree = false;
   };
 
   /// \brief Set bounding box minimum dimension.
@@ -672,6 +1646,20 @@ class drawableObj {
                const std::string &name,
                const std::vector<glm::vec2> &data);
 
+  /// \brief Add some vec4 data, taking over the caller's vector.
+  ///
+  /// Same as the other addData(), but the data is moved into the
+  /// object instead of copied, and the input vector is left empty.
+  /// Use it with std::move() or a temporary for big arrays.
+  void addData(const GLDATATYPE type,
+               const std::string &name,
+               std::vector<glm::vec4> &&data);
+
+  /// \brief Add some vec2 texture coordinates, taking over the vector.
+  void addData(const GLDATATYPE type,
+               const std::string &name,
+               std::vector<glm::vec2> &&data);
+
   /// \brief Change the underlying data of an object.
   ///
   /// Use this to reset the vec4 data inside an object.
@@ -682,6 +1670,159 @@ class drawableObj {
   /// Use this to reset the vec2 data inside an object.
   void setData(const GLDATATYPE type, const std::vector<glm::vec2>& data);
 
+  /// \brief Change the vec4 data, taking over the caller's vector.
+  void setData(const GLDATATYPE type, std::vector<glm::vec4>&& data);
+
+  /// \brief Change the vec2 data, taking over the caller's vector.
+  void setData(const GLDATATYPE type, std::vector<glm::vec2>&& data);
+
+  /// \brief Change part of the vec4 data.
+  ///
+  /// Replaces the elements starting at the given one with the given
+  /// data, which must fit in the existing array.  Only the part that
+  /// changed is sent to the graphics card at the next load().
+  void setDataRange(const GLDATATYPE type, const size_t &first,
+                    const std::vector<glm::vec4>& data);
+
+  /// \brief Change part of the vec2 data.
+  void setDataRange(const GLDATATYPE type, const size_t &first,
+                    const std::vector<glm::vec2>& data);
+
+  /// \brief Give OpenGL a hint about how often some data will change.
+  ///
+  /// Use GL_STATIC_DRAW (the default) for data that is set once,
+  /// GL_DYNAMIC_DRAW for data that changes now and then, and
+  /// GL_STREAM_DRAW for data that changes every frame.  Data that is
+  /// loaded more than once is switched to GL_DYNAMIC_DRAW anyway.
+  /// Stream data is written into the shared streamBuffer ring instead
+  /// of a buffer of its own, once in every frame that loads it, so
+  /// only use GL_STREAM_DRAW in a program that calls
+  /// streamBuffer::advanceRing() once per frame.  Otherwise the ring
+  /// fills up and the data ends up in buffers of its own anyway.
+  void setUsage(const GLDATATYPE type, const GLenum usage);
+
+  /// \brief Can this object be drawn in one call with another?
+  ///
+  /// See append().  Both objects must be static, have no indices,
+  /// have the same draw type and attributes, and be two-sided or not.
+  bool canMergeWith(const drawableObj &other) const;
+
+  /// \brief Adds another object's vertices to the end of this one.
+  ///
+  /// The other object's vertices are drawn as a separate range, so
+  /// strips and fans don't run into each other, but all the ranges
+  /// are drawn with a single glMultiDrawArrays() call.  Check with
+  /// canMergeWith() first.  The data is copied, so later changes to
+  /// the other object don't show up here.
+  void append(const bsgPtr<drawableObj> &other);
+
+  /// \brief The separate primitive that a draw type is made of.
+  ///
+  /// GL_TRIANGLES for triangles, strips, and fans, GL_LINES for
+  /// lines, strips, and loops, GL_POINTS for points, and zero for
+  /// anything else.
+  static GLenum basePrimitive(const GLenum &drawType);
+
+  /// \brief Can another object be added with appendTransformed()?
+  ///
+  /// It can if its draw type has the same base primitive as this
+  /// object's, it has the same attributes and two-sidedness, and its
+  /// data is static.
+  bool canBatchWith(const drawableObj &other) const;
+
+  /// \brief Adds a transformed copy of another object to this one.
+  ///
+  /// The vertices are multiplied by the matrix, and the normals by
+  /// its inverse transpose.  Strips, fans, and loops are converted to
+  /// indexed triangles, lines, or points, so any number of objects
+  /// can be drawn together with one glDrawElements() call.  Check
+  /// with canBatchWith() first.  Returns false if the draw type can't
+  /// be converted.  Used by drawableStaticBatch.
+  bool appendTransformed(const drawableObj &other, const glm::mat4 &matrix);
+
+  /// \brief The number of indices, or zero if there is no index array.
+  GLsizei getNumIndices() const { return _indices.size(); };
+
+  /// \brief Draw only the ranges of indices added after this.
+  ///
+  /// Until drawAllRanges() is called, draw() uses just the ranges
+  /// given to addDrawRange(), which may be none.  This is how
+  /// drawableStaticBatch leaves out the parts of it that are out of
+  /// view.  Only for indexed objects.
+  void clearDrawRanges() {
+    _drawRanges = true;
+    _rangeFirsts.clear();
+    _rangeCounts.clear();
+  };
+
+  /// \brief Add a range of indices to be drawn.
+  ///
+  /// A range that starts where the last one ends is merged with it.
+  void addDrawRange(const GLuint &first, const GLsizei &count) {
+    if (!_rangeFirsts.empty() &&
+        (_rangeFirsts.back() + _rangeCounts.back() == first)) {
+      _rangeCounts.back() += count;
+    } else {
+      _rangeFirsts.push_back(first);
+      _rangeCounts.push_back(count);
+    }
+  };
+
+  /// \brief Go back to drawing all the indices.
+  void drawAllRanges() { _drawRanges = false; };
+
+  /// \brief Add an index array.
+  ///
+  /// With an index array in place, the object is drawn with
+  /// glDrawElements instead of glDrawArrays.  Each index refers to a
+  /// position in the vertex, color, normal, and texture coordinate
+  /// arrays, so a vertex shared by several triangles need only be
+  /// stored once.  The indices are loaded into a
+  /// GL_ELEMENT_ARRAY_BUFFER alongside the other data.
+  void addIndices(const std::vector<GLuint> &indices);
+
+  /// \brief Change the index array of an object.
+  void setIndices(const std::vector<GLuint> &indices);
+
+  /// \brief Does this object use an index array?
+  bool isIndexed() { return !_indices.empty(); };
+
+  /// \brief Merge identical vertices.
+  ///
+  /// Finds the vertices whose position, color, normal, and texture
+  /// coordinates are all identical, keeps one copy of each, and
+  /// builds (or rewrites) the index array to refer to the survivors.
+  /// The draw type is unaffected.  This is most useful for meshes
+  /// that arrive fully expanded, like the ones built from an OBJ
+  /// file, where every vertex of every triangle is its own copy.
+  /// Call it after all the data is in place, and before prepare().
+  void weld();
+
+  /// \brief Write the object's data to a binary file.
+  ///
+  /// The component arrays, indices, and bounding box are written,
+  /// and, if the object is interleaved, the packed interleaved data
+  /// and its layout, so readBinary() can restore it ready to load
+  /// without looking at each vertex.  Used for the mesh files of
+  /// drawableObjModel.
+  void writeBinary(binaryWriter &out);
+
+  /// \brief Restore the object's data from what writeBinary() wrote.
+  ///
+  /// Returns false if the data is cut short or doesn't make sense,
+  /// in which case the object is left unusable.  Packed data in a
+  /// format this OpenGL context can't draw is packed again, from the
+  /// components, at prepare().
+  bool readBinary(binaryReader &in);
+
+  /// \brief Returns the ID of the buffer holding the vertex data.
+  ///
+  /// This is zero until prepare() has been called.  Objects whose data
+  /// is in the same bufferArena block have the same ID.
+  GLuint getBufferID() {
+    return _interleaved ?
+      _interleavedData.drawBufferID : _vertices.drawBufferID; };
+
   /// \brief Set whether the object is selectable.
   ///
   /// Often used for things like axes that you probably don't want to
@@ -693,6 +1834,21 @@ class drawableObj {
   /// Scans the vertex array to come up with a bounding box.
   void findBoundingBox();
 
+  /// \brief Is the bounding box up to date?
+  ///
+  /// Goes false when the vertices are changed, so the things that
+  /// cache bounding boxes derived from this one know to recalculate.
+  bool haveBoundingBox() { return _haveBoundingBox; };
+
+  /// \brief Counts the times the bounding box has been found.
+  ///
+  /// The box may be found again before anyone asks haveBoundingBox(),
+  /// so this is the way to tell for sure whether it has changed.
+  unsigned int getBoundingBoxVersion() {
+    if (!_haveBoundingBox) findBoundingBox();
+    return _boundingBoxVersion;
+  };
+
   /// \brief Returns the upper limit of the bounding box.
   glm::vec4 getBoundingBoxUpper() {
       if (!_haveBoundingBox) findBoundingBox();
@@ -707,10 +1863,24 @@ class drawableObj {
   /// \brief Test whether a test point is inside the bounding box.
   ///
   /// There are two arguments here.  Because the test is done in world
-  /// space, the vertices of the bounding box must be transformed with
-  /// the model matrix before testing.
+  /// space and the box is in model space, the point is transformed
+  /// into model space with the inverse of the model matrix before
+  /// testing.  This is correct for any rotation, where transforming
+  /// the box corners would not be.
   bool insideBoundingBox(const glm::vec4 &testPoint,
-                         const glm::mat4 &modelMatrix);
+                         const glm::mat4 &modelMatrix) {
+    return insideLocalBoundingBox(glm::inverse(modelMatrix) * testPoint);
+  };
+
+  /// \brief Test whether a point in model space is in the bounding box.
+  bool insideLocalBoundingBox(const glm::vec4 &localPoint);
+
+  /// \brief Finds the nearest triangle hit by a ray in model space.
+  ///
+  /// See triangleTree::intersect().  Objects that are not selectable
+  /// are never hit.
+  bool raycast(const glm::vec3 &origin, const glm::vec3 &direction,
+               float &distance, int &triangle);
 
   /// \brief One-time-only draw preparation.
   ///
@@ -726,6 +1896,12 @@ class drawableObj {
   ///
   /// Call this function after all the data is in place and we know
   /// whether we have colors or textures or normals to worry about.
+  ///
+  /// An object can be shared by several compound objects (see
+  /// meshCache), each of which prepares it.  Once it has been
+  /// prepared and loaded for a program, preparing it again for the
+  /// same program does nothing.  Preparing it for another program as
+  /// well gives that program an attribute setup of its own.
   void prepare(GLuint programID);
 
   /// \brief Loads the shape about to be drawn.
@@ -741,7 +1917,89 @@ class drawableObj {
   /// The method binds each OpenGL buffer, then enables the arrays.
   /// We assume the data we want to draw is already in the buffer, via
   /// the load() method.
-  void draw();
+  ///
+  /// If the instance count is more than one, the object is drawn that
+  /// many times with one instanced draw call.  The caller is
+  /// responsible for setting up the per-instance attributes; see
+  /// drawableInstanced.
+  void draw(const GLsizei &instanceCount = 1);
+};
+
+/// \brief A place to keep meshes so they can be shared.
+///
+/// A drawableObj can be used by any number of compound objects, since
+/// they only hold pointers to it, and it's loaded into its buffers
+/// only once.  This cache lets the code that creates a mesh find out
+/// whether an identical one has been made already.  The key is any
+/// string that identifies the mesh, like a file name, or the shape
+/// and tesselation of one of the menagerie objects.  Ten copies of
+/// the same model then share one copy of the data, both in memory and
+/// on the graphics card.
+///
+/// Since the meshes are shared, changing one changes them all, so the
+/// cache is off until you turn it on with setEnabled().  Use it when
+/// the copies will not be changed after they are made.  The key
+/// depends only on where the mesh came from, not on the shader: every
+/// program puts the usual attributes at the same locations (see
+/// shaderMgr::compileShaders()), and a mesh is prepared for the
+/// programs of all the objects that use it.
+///
+/// A mesh that nothing but the cache points to any more is dropped
+/// by releaseUnused(), which deletes its buffers.  The scene does
+/// that at a load() after its tree has changed.
+///
+/// The meshes' buffers belong to the OpenGL context, and the cache
+/// itself is static, so call clear() on the OpenGL thread before that
+/// context goes away.  Otherwise the meshes are deleted after it is
+/// gone.
+class meshCache {
+ private:
+  typedef std::map<std::string, bsgPtr<drawableObj> > MeshMap;
+  static MeshMap _meshes;
+  static bool _enabled;
+
+  /// The meshes in the cache, for holds().
+  static std::set<drawableObj*> _held;
+
+ public:
+  /// \brief Look up a mesh.
+  ///
+  /// If there is one with the given key, sets the pointer to it and
+  /// returns true.
+  static bool find(const std::string &key, bsgPtr<drawableObj> &mesh);
+
+  /// \brief Add a mesh to the cache.
+  static void add(const std::string &key, const bsgPtr<drawableObj> &mesh);
+
+  /// \brief Is this mesh in the cache?
+  static bool holds(drawableObj* mesh) { return _held.count(mesh) > 0; };
+
+  /// \brief Removes a mesh from the cache.
+  ///
+  /// The objects that use it still have it.
+  static void remove(const std::string &key);
+
+  /// \brief Empties the cache.
+  ///
+  /// Meshes no object is using are deleted, along with their
+  /// buffers, so the OpenGL context must be current.
+  static void clear() { _meshes.clear(); _held.clear(); };
+
+  /// \brief How many meshes are in the cache?
+  static size_t size() { return _meshes.size(); };
+
+  /// \brief Drop the meshes only the cache is using.
+  ///
+  /// Their buffers are deleted, so the OpenGL context must be
+  /// current.  Returns the number of meshes dropped.
+  static size_t releaseUnused();
+
+  /// \brief Turn the cache on or off.  It's off by default.
+  ///
+  /// With the cache off, find() never finds anything, and add() does
+  /// nothing.
+  static void setEnabled(const bool &enabled) { _enabled = enabled; };
+  static bool getEnabled() { return _enabled; };
 };
 
 /// \brief The name of an object as it exists in the scene hierarchy.
@@ -767,6 +2025,9 @@ class bsgName : public std::list<std::string> {
 /// hierarchy of the scene graph.
 typedef std::list<bsgName> bsgNameList;
 
+class renderQueue;
+class viewFrustum;
+
 /// \brief An abstract class to handle transformation matrices.
 ///
 /// This class is the common root of drawableCompound and
@@ -805,12 +2066,53 @@ class drawableMulti {
   glm::mat4 _modelMatrix;
   bool _modelMatrixNeedsReset;
 
+  /// The model matrix multiplied by the model matrices of all the
+  /// parents, i.e. the transformation from this object's model space
+  /// to world space.  Its flag is set when this object's model matrix
+  /// changes, or when any parent's does, so the product is only
+  /// recalculated when something above it in the tree has moved.
+  glm::mat4 _worldMatrix;
+  bool _worldMatrixNeedsReset;
+
+  /// An axis-aligned box in world space containing this object and
+  /// everything below it.  Used for view frustum culling.  The flag
+  /// is set along with the world matrix flag, and when objects are
+  /// added or removed.
+  glm::vec3 _worldBoundsLower, _worldBoundsUpper;
+  bool _worldBoundsNeedReset;
+
+  /// Set when objects are added to or removed from this node, or any
+  /// node below it.  The scene uses the flag on its root to decide
+  /// when to rebuild its render queue.
+  bool _treeChanged;
+
+  /// Marks an object that never moves.  See scene::bakeStatic().
+  bool _static;
+
+  /// Flags this object and all its parents as having a changed tree.
+  void _markTreeChanged() {
+    _treeChanged = true;
+    _worldBoundsNeedReset = true;
+    if (_parent) _parent->_markTreeChanged();
+  };
+
   void _init() {
     _position = glm::vec3(0.0f, 0.0f, 0.0f);
     _scale = glm::vec3(1.0f, 1.0f, 1.0f);
     // The glm::quat constructor initializes orientation to be zero
     // rotation by default, so need not be mentioned here.
     _modelMatrixNeedsReset = true;
+    _worldMatrixNeedsReset = true;
+    _worldBoundsNeedReset = true;
+    _treeChanged = true;
+    _static = false;
+  };
+
+  /// Flags the model matrix for recalculation, and the world matrices
+  /// of this object and everything below it.
+  void _setModelMatrixNeedsReset() {
+    _modelMatrixNeedsReset = true;
+    invalidateWorldMatrix();
   };
 
  public:
@@ -822,7 +2124,32 @@ class drawableMulti {
   ///
   /// Our scene graph is doubly connected in order to provide the
   /// correct nested transformation from model space to world space.
-  void setParent(drawableMulti* p) { _parent = p; }
+  void setParent(drawableMulti* p) {
+    _parent = p;
+    invalidateWorldMatrix();
+  }
+
+  /// \brief Returns the parent object, or NULL at the top of the tree.
+  drawableMulti* getParent() { return _parent; };
+
+  /// \brief Mark this object as one that will not move.
+  ///
+  /// Static objects, and everything below a static collection, are
+  /// combined into batches by scene::bakeStatic().  The flag does
+  /// nothing until that is called.
+  void setStatic(const bool &isStatic) { _static = isStatic; };
+  bool getStatic() const { return _static; };
+
+  /// \brief Mark the world matrix as needing recalculation.
+  ///
+  /// This is called automatically when the position, scale, or
+  /// orientation of this object or one of its parents changes.  The
+  /// drawableCollection version passes the news along to its
+  /// children.
+  virtual void invalidateWorldMatrix() {
+    _worldMatrixNeedsReset = true;
+    _worldBoundsNeedReset = true;
+  };
 
   /// \brief Set the name of this object.
   void setName(const std::string name) { _name = name; };
@@ -833,14 +2160,16 @@ class drawableMulti {
   /// \brief Calculate the model matrix.
   ///
   /// Uses the current position, rotation, and scale to calculate a
-  /// new model matrix.  There is an internal flag used to set whether
-  /// the model matrix needs to be recalculated or not.
-  glm::mat4 getModelMatrix();
+  /// new model matrix, and multiplies it by the model matrices of the
+  /// parents.  Both this object's own matrix and the product are
+  /// cached, and there are internal flags to say whether either needs
+  /// to be recalculated, so in a static scene this is just a lookup.
+  const glm::mat4 &getModelMatrix();
 
     /// \brief Set the model position using a vector.
   void setPosition(glm::vec3 position) {
     _position = position;
-    _modelMatrixNeedsReset = true;
+    _setModelMatrixNeedsReset();
   };
   /// \brief Set the model position using three floats.
   void setPosition(GLfloat x, GLfloat y, GLfloat z) {
@@ -849,24 +2178,24 @@ class drawableMulti {
   /// \brief Set the scale using a vector.
   void setScale(glm::vec3 scale) {
     _scale = scale;
-    _modelMatrixNeedsReset = true;
+    _setModelMatrixNeedsReset();
   };
   /// \brief Set the scale using a single float, applied in three dimensions.
   void setScale(float scale) {
     _scale = glm::vec3(scale, scale, scale);
-    _modelMatrixNeedsReset = true;
+    _setModelMatrixNeedsReset();
   };
   /// \brief Set the rotation with a quaternion.
   void setOrientation(glm::quat orientation) {
     _orientation = orientation;
-    _modelMatrixNeedsReset = true;
+    _setModelMatrixNeedsReset();
   };
   /// \brief Set the rotation with Euler angles.
   ///
   /// Uses a 3-vector of (pitch, yaw, roll) in radians.
   void setRotation(glm::vec3 pitchYawRoll) {
     _orientation = glm::quat(pitchYawRoll);
-    _modelMatrixNeedsReset = true;
+    _setModelMatrixNeedsReset();
   };
   /// \brief Set the rotation with Euler angles.
   ///
@@ -874,7 +2203,7 @@ class drawableMulti {
   /// individually, in radians.
   void setRotation(GLfloat pitch, GLfloat yaw, GLfloat roll) {
     _orientation = glm::quat(glm::vec3(pitch, yaw, roll));
-    _modelMatrixNeedsReset = true;
+    _setModelMatrixNeedsReset();
   };
 
   /// \brief Returns the vector position.
@@ -967,6 +2296,35 @@ class drawableMulti {
   virtual void draw(const glm::mat4 &viewMatrix,
                     const glm::mat4 &projMatrix) = 0;
 
+  /// \brief Adds the drawable pieces of this object to a render queue.
+  ///
+  /// Used by the scene to flatten the tree into a list of things to
+  /// draw.  See renderQueue.
+  virtual void addToRenderQueue(renderQueue &queue) = 0;
+
+  /// \brief Recalculate the world-space bounding box, if necessary.
+  ///
+  /// Returns true if the box was recalculated.  A collection's box is
+  /// made from the boxes of its children, so they must be brought up
+  /// to date first, and the argument says whether any of them
+  /// changed.  The render queue takes care of the ordering.
+  virtual bool updateWorldBounds(const bool &childrenChanged) = 0;
+
+  /// \brief The lower corner of the world-space bounding box.
+  ///
+  /// As of the last updateWorldBounds().
+  const glm::vec3 &getWorldBoundsLower() const { return _worldBoundsLower; };
+  /// \brief The upper corner of the world-space bounding box.
+  const glm::vec3 &getWorldBoundsUpper() const { return _worldBoundsUpper; };
+
+  /// \brief Has the tree below this object changed?
+  ///
+  /// True if objects have been added or removed anywhere below this
+  /// one since the flag was last cleared.
+  bool treeChanged() { return _treeChanged; };
+
+  /// \brief Clear the flag returned by treeChanged().
+  void clearTreeChanged() { _treeChanged = false; };
 };
 
 
@@ -1015,6 +2373,38 @@ class drawableCompound : public drawableMulti {
   typedef std::list<bsgPtr<drawableObj> > DrawableObjList;
   DrawableObjList _objects;
 
+  /// With merging on, the objects are combined where possible and
+  /// drawn from this list instead.  Picking and ray casting still use
+  /// the originals.  The list is made again when it is next needed
+  /// after the merging is turned on or an object is added.
+  bool _merged;
+  DrawableObjList _mergedObjects;
+  bool _mergeNeedsUpdate;
+  void _mergeObjects();
+
+  /// Set whenever the draw list changes, merged or not, so the objects
+  /// now in it are prepared at the next load().
+  bool _drawListNeedsPrepare;
+
+  /// The list of objects to prepare, load, and draw.
+  DrawableObjList &_drawList() {
+    if (!_merged) return _objects;
+    if (_mergeNeedsUpdate) _mergeObjects();
+    return _mergedObjects;
+  };
+
+  /// The sum of the components' bounding box versions, as of the last
+  /// updateWorldBounds().  The versions only go up, so if the sum is
+  /// the same, none of the boxes have changed.
+  unsigned int _objectBoundsVersion;
+  bool _objectBoundsChanged();
+
+  /// Set by scene::bakeStatic() when this object's components have
+  /// been copied into a drawableStaticBatch, which draws them
+  /// instead.  The object stays in the tree, so it can still be
+  /// picked.
+  bool _baked;
+
   /// The shader that will be used to render all the pieces of this
   /// compound object.  Or at least the one they will start with.  You
   /// can always go back and change the shader for an individual
@@ -1048,9 +2438,41 @@ class drawableCompound : public drawableMulti {
                                   const drawableCompound &comp) {
     return os << comp.printObj("");  }
 
+  /// Gets the shader going and loads the matrices, everything that
+  /// has to happen before the component objects can be drawn.
+  void _drawSetup(const glm::mat4 &modelMatrix,
+                  const glm::mat4 &viewMatrix,
+                  const glm::mat4 &projMatrix);
+
+  /// The pieces of _drawSetup() that load the matrices.  The view and
+  /// projection matrices are the same for every object drawn with a
+  /// given program, but the model and normal matrices are not.
+  void _loadViewProjMatrices(const glm::mat4 &viewMatrix,
+                             const glm::mat4 &projMatrix);
+  void _loadModelMatrices(const glm::mat4 &modelMatrix,
+                          const glm::mat4 &viewMatrix);
+
+  /// Draws one component, after the matrices are loaded.
+  void _drawObject(drawableObj* object, const glm::mat4 &modelMatrix);
+
+  /// Called by the render queue's cull() for a compound that is at
+  /// least partly in view, with the frusta if it is only partly in
+  /// view, or NULL if all of it should be drawn.  An ordinary
+  /// compound has nothing to do with it; a static batch uses it to
+  /// leave out the parts of itself that are out of view.
+  virtual void _cullComponents(const std::vector<viewFrustum>* /*frusta*/) {};
+  friend class renderQueue;
+  friend class drawableStaticBatch;
+  friend class scene;
+
  public:
  drawableCompound(bsgPtr<shaderMgr> pShader) :
   drawableMulti(),
+    _merged(false),
+    _mergeNeedsUpdate(true),
+    _drawListNeedsPrepare(false),
+    _objectBoundsVersion(0),
+    _baked(false),
     _pShader(pShader),
     // Set the default names for our matrices.
     _modelMatrixName("modelMatrix"),
@@ -1061,6 +2483,11 @@ class drawableCompound : public drawableMulti {
   };
  drawableCompound(const std::string name, bsgPtr<shaderMgr> pShader) :
   drawableMulti(name),
+    _merged(false),
+    _mergeNeedsUpdate(true),
+    _drawListNeedsPrepare(false),
+    _objectBoundsVersion(0),
+    _baked(false),
     _pShader(pShader),
     // Set the default names for our matrices.
     _modelMatrixName("modelMatrix"),
@@ -1110,8 +2537,35 @@ class drawableCompound : public drawableMulti {
   /// rendering with.
   void addObject(bsgPtr<drawableObj> &pObj) {
     _objects.push_back(pObj);
+    _mergeNeedsUpdate = true;
+    _drawListNeedsPrepare = true;
+    _markTreeChanged();
   };
 
+  /// \brief Draw the component objects together where possible.
+  ///
+  /// With this on, runs of component objects that have the same draw
+  /// type and attributes are combined into one object each, whose
+  /// pieces are drawn with a single glMultiDrawArrays() call.  A cube,
+  /// for example, becomes one draw instead of six.  Objects with
+  /// indices, or with data that changes, are drawn as usual.  Only
+  /// neighbors are combined, so the objects are drawn in the order
+  /// they were added, which matters for transparency.
+  ///
+  /// The combined objects are copies, made when the object is next
+  /// prepared or loaded, so don't use this if you will change the
+  /// component objects after that.
+  void setMerged(const bool &merged) {
+    _merged = merged;
+    _mergeNeedsUpdate = true;
+    _drawListNeedsPrepare = true;
+    _markTreeChanged();
+  };
+  bool getMerged() const { return _merged; };
+
+  /// \brief Is this object drawn by a drawableStaticBatch?
+  bool getBaked() const { return _baked; };
+
   /// \brief Add an object's bounding box to a compound object.
   ///
   /// Does not add the object, but just an outline of its bounding box.
@@ -1130,6 +2584,22 @@ class drawableCompound : public drawableMulti {
   /// empty, but the bsgName it contains is empty.)
   bsgNameList insideBoundingBox(const glm::vec4 &testPoint);
 
+  /// \brief The same test as insideBoundingBox(), but with no list.
+  ///
+  /// Only selectable component objects count.
+  virtual bool containsPoint(const glm::vec4 &testPoint);
+
+  /// \brief Finds the nearest selectable component hit by a ray.
+  ///
+  /// The ray is in world space, and the direction should be a unit
+  /// vector.  Only hits nearer than the input distance count.  If
+  /// there is one, the distance, object, triangle, and instance are
+  /// set, and the return is true.  The instance is -1 except for a
+  /// drawableInstanced object.
+  virtual bool raycast(const glm::vec3 &origin, const glm::vec3 &direction,
+                       float &distance, drawableObj* &object,
+                       int &triangle, int &instance);
+
   /// \brief A printable representation of the object.
   std::string printObj(const std::string &prefix) const {
     return prefix + "<drawableCompound:" + _name + ">"; }
@@ -1151,6 +2621,241 @@ class drawableCompound : public drawableMulti {
   void draw(const glm::mat4 &viewMatrix,
             const glm::mat4 &projMatrix);
 
+  /// \brief Adds one render queue entry for each component object.
+  void addToRenderQueue(renderQueue &queue);
+
+  /// \brief Finds a world-space box around all the component objects.
+  bool updateWorldBounds(const bool &childrenChanged);
+};
+
+/// \brief Many copies of the same objects, drawn in one call.
+///
+/// A scene with thousands of identical spheres or cubes could be made
+/// of thousands of drawableCompound objects, but each would have its
+/// own buffers and its own draw call, and the draw calls are what
+/// slows things down.  This is a compound object whose components are
+/// drawn over and over, once for each of a list of instances, each
+/// with its own transformation matrix and color.  The instance data
+/// goes to the shader as two vertex attributes that change once per
+/// instance instead of once per vertex, so the whole lot can be drawn
+/// with a single glDrawArraysInstanced() or glDrawElementsInstanced()
+/// call.
+///
+/// The shader must declare the two attributes, like this:
+///
+/// \code
+/// attribute mat4 instanceMatrix;
+/// attribute vec4 instanceColor;
+/// \endcode
+///
+/// and apply the matrix after the model matrix and before the
+/// position.  See shaders/instanceShader.vp.  The instance matrix is
+/// relative to the model matrix of this object, so the whole group
+/// can be moved around like any other object.
+///
+/// If the OpenGL context does not support instancing (it is part of
+/// OpenGL 3.3, or the ARB_instanced_arrays extension), the instances
+/// are drawn one at a time instead, with the same shader.
+class drawableInstanced : public drawableCompound {
+ private:
+
+  /// The per-instance data, laid out the way it goes in the buffer.
+  struct instanceData {
+    glm::mat4 matrix;
+    glm::vec4 color;
+  };
+  std::vector<instanceData> _instances;
+
+  /// The inverses of the instance matrices, for picking and ray
+  /// casting.  Found when first needed after the matrices change.
+  std::vector<glm::mat4> _inverseMatrices;
+  bool _inverseMatricesNeedReset;
+  void _updateInverseMatrices();
+
+  GLuint _instanceBufferID;
+  GLint _instanceMatrixID, _instanceColorID;
+  std::string _instanceMatrixName, _instanceColorName;
+
+  bool _instancesLoaded;
+  bool _useInstancing;
+
+  void _instancesChanged() {
+    _instancesLoaded = false;
+    _worldBoundsNeedReset = true;
+    _inverseMatricesNeedReset = true;
+  };
+
+  void _drawInstanced(const bool &cullWanted);
+  void _drawOneAtATime(const bool &cullWanted);
+
+ public:
+  drawableInstanced(const std::string name, bsgPtr<shaderMgr> pShader) :
+    drawableCompound(name, pShader),
+    _inverseMatricesNeedReset(true),
+    _instanceBufferID(0), _instanceMatrixID(-1), _instanceColorID(-1),
+    _instanceMatrixName("instanceMatrix"), _instanceColorName("instanceColor"),
+    _instancesLoaded(false), _useInstancing(true) {};
+
+  /// \brief Set the names of the instance attributes in the shader.
+  void setInstanceAttributeNames(const std::string &matrixName,
+                                 const std::string &colorName) {
+    _instanceMatrixName = matrixName;
+    _instanceColorName = colorName;
+  };
+
+  /// \brief Add an instance.  Returns its index.
+  int addInstance(const glm::mat4 &matrix,
+                  const glm::vec4 &color = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f));
+
+  /// \brief Add an instance at a position.  Returns its index.
+  int addInstance(const glm::vec3 &position,
+                  const glm::vec4 &color = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f)) {
+    return addInstance(glm::translate(glm::mat4(1.0f), position), color);
+  };
+
+  /// \brief Change an instance's transformation matrix.
+  void setInstanceMatrix(const int &index, const glm::mat4 &matrix) {
+    _instances[index].matrix = matrix;
+    _instancesChanged();
+  };
+
+  /// \brief Change an instance's color.
+  void setInstanceColor(const int &index, const glm::vec4 &color) {
+    _instances[index].color = color;
+    _instancesLoaded = false;
+  };
+
+  /// \brief Returns an instance's transformation matrix.
+  const glm::mat4 &getInstanceMatrix(const int &index) const {
+    return _instances[index].matrix; };
+
+  /// \brief Returns an instance's color.
+  const glm::vec4 &getInstanceColor(const int &index) const {
+    return _instances[index].color; };
+
+  /// \brief Removes all the instances.
+  void clearInstances() {
+    _instances.clear();
+    _instancesChanged();
+  };
+
+  /// \brief How many instances are there?
+  size_t getNumInstances() const { return _instances.size(); };
+
+  /// \brief Use instanced drawing, if it is available.
+  ///
+  /// It's on by default.  Turning it off draws the instances one at a
+  /// time, which is mostly useful for checking the results.
+  void setUseInstancing(const bool &useInstancing) {
+    _useInstancing = useInstancing;
+  };
+
+  /// \brief Is instanced drawing supported by this OpenGL context?
+  static bool instancingSupported();
+
+  /// \brief Returns a printable representation of the object.
+  std::string printObj(const std::string &prefix) const {
+    return prefix + "<drawableInstanced:" + _name + ">"; }
+
+  /// \brief Gets ready for the drawing sequence.
+  void prepare();
+
+  /// \brief Loads the objects and the instance data.
+  void load();
+
+  /// \brief Draws all the instances.
+  void draw(const glm::mat4 &viewMatrix,
+            const glm::mat4 &projMatrix);
+
+  /// \brief Adds a single render queue entry for the whole object.
+  ///
+  /// The entry has no drawableObj, so the queue calls our draw().
+  void addToRenderQueue(renderQueue &queue);
+
+  /// \brief Finds a world-space box around all the instances.
+  bool updateWorldBounds(const bool &childrenChanged);
+
+  /// \brief Does any instance contain the test point?
+  bool containsPoint(const glm::vec4 &testPoint);
+
+  /// \brief Finds the nearest instance hit by a ray.
+  bool raycast(const glm::vec3 &origin, const glm::vec3 &direction,
+               float &distance, drawableObj* &object,
+               int &triangle, int &instance);
+};
+
+/// \brief Many static compound objects, drawn as one.
+///
+/// A scene full of furniture, walls, and floor tiles that never move
+/// still pays for a shader switch, two matrix uploads, and a draw
+/// call for every component of every object.  This object takes the
+/// components of many compound objects that use the same shader,
+/// transforms their vertices into world space, and copies them into
+/// a few big indexed objects, one for each kind of primitive
+/// (triangles, lines, points) and set of attributes.  Its own model
+/// matrix is the identity, so the whole lot is drawn with one matrix
+/// upload and a draw call or two.
+///
+/// The copies are made when the compounds are added, so the
+/// originals must not move or change afterward.  They stay in the
+/// scene graph, where they are used for picking, but don't draw
+/// themselves.  The batch itself can't be picked.
+///
+/// Each source object's indices are kept together, with a box around
+/// them, so when the batch is only partly in view the render queue's
+/// cull() can leave out the parts that are out of view.  The ones in
+/// view are drawn with one glMultiDrawElements() call per batch
+/// object, adjacent ones merged into a single range.
+///
+/// You will not usually make one of these yourself.  Mark objects
+/// with setStatic() and use scene::bakeStatic().
+class drawableStaticBatch : public drawableCompound {
+ private:
+
+  /// How many compounds have been added.
+  int _numSources;
+
+  /// One source object's range of indices in one of the batch
+  /// objects, with a box around it in the batch's model space.
+  struct part {
+    drawableObj* object;
+    GLuint first;
+    GLsizei count;
+    glm::vec3 lower, upper;
+  };
+  std::vector<part> _parts;
+
+  void _cullComponents(const std::vector<viewFrustum>* frusta);
+
+ public:
+  drawableStaticBatch(const std::string name, bsgPtr<shaderMgr> pShader) :
+    drawableCompound(name, pShader), _numSources(0) {};
+
+  /// \brief Copies a compound object into the batch.
+  ///
+  /// The object's current world matrix is used, relative to the
+  /// batch's parent, if it has one yet.  Returns false, and
+  /// leaves the batch alone, if any of the components have data that
+  /// changes or a draw type that can't be batched.
+  bool addCompound(drawableCompound* compound);
+
+  /// \brief How many compounds have been added?
+  int getNumSources() const { return _numSources; };
+
+  /// \brief How many separately culled parts are there?
+  size_t getNumParts() const { return _parts.size(); };
+
+  /// \brief Returns a printable representation of the object.
+  std::string printObj(const std::string &prefix) const {
+    return prefix + "<drawableStaticBatch:" + _name + ">"; }
+
+  /// \brief The batch can't be picked.  Its sources can.
+  bool containsPoint(const glm::vec4 &/*testPoint*/) { return false; };
+
+  /// \brief The batch can't be hit by a ray.  Its sources can.
+  bool raycast(const glm::vec3 &/*origin*/, const glm::vec3 &/*direction*/,
+               float &/*distance*/, drawableObj* &/*object*/,
+               int &/*triangle*/, int &/*instance*/) { return false; };
 };
 
 /// \brief A collection of drawable objects.
@@ -1260,6 +2965,9 @@ class drawableCollection : public drawableMulti {
   /// \brief Return a list of object names in the collection.
   bsgNameList getNames();
 
+  /// \brief Mark this world matrix and all the ones below as stale.
+  void invalidateWorldMatrix();
+
   /// \brief Returns the names of objects containing the test point.
   ///
   /// Returns a collection of the names of objects containing the test
@@ -1288,6 +2996,329 @@ class drawableCollection : public drawableMulti {
   void draw(const glm::mat4 &viewMatrix,
             const glm::mat4 &projMatrix);
 
+  /// \brief Adds everything in the collection to a render queue.
+  void addToRenderQueue(renderQueue &queue);
+
+  /// \brief Finds a world-space box around all the children.
+  bool updateWorldBounds(const bool &childrenChanged);
+};
+
+/// \brief The six planes of a view frustum, for culling.
+///
+/// Extracted from a combined projection and view matrix, so they are
+/// in world space.  The plane normals point inward.
+class viewFrustum {
+ private:
+  glm::vec4 _planes[6];
+
+ public:
+  viewFrustum(const glm::mat4 &viewProjMatrix);
+
+  enum { OUTSIDE, INTERSECTS, INSIDE };
+
+  /// \brief Where is the given world-space box?
+  ///
+  /// Returns OUTSIDE, INSIDE, or INTERSECTS.  This is conservative:
+  /// a box near a corner of the frustum can be called INTERSECTS when
+  /// it is actually outside.
+  int classify(const glm::vec3 &lower, const glm::vec3 &upper) const;
+};
+
+/// \brief One entry in a render queue.
+///
+/// Everything needed to draw a single drawableObj, collected in one
+/// place.  The compound is there because it owns the shader uniform
+/// IDs.  The world matrix pointer refers to the matrix cached in the
+/// compound (see drawableMulti::getModelMatrix()), so it stays
+/// current as things move around.  If the object pointer is NULL,
+/// the compound is drawn whole with its own draw() method.
+///
+/// The key is used to sort the queue, see renderQueue.  The order is
+/// the item's place in the scene, which breaks ties between keys.
+struct renderItem {
+  drawableCompound* compound;
+  drawableObj* object;
+  shaderMgr* shader;
+  GLuint program;
+  const glm::mat4* worldMatrix;
+  uint64_t key;
+  unsigned int order;
+  int cullNode;
+};
+
+/// \brief Counts of the OpenGL state changes made by a render queue.
+///
+/// The "avoided" numbers count the changes that would have been made
+/// if every compound object had set up its own shader state, as
+/// drawableCompound::draw() does.
+struct renderStats {
+  unsigned int draws;
+  unsigned int programChanges, programChangesAvoided;
+  unsigned int textureBinds, textureBindsAvoided;
+  unsigned int uniformLoads, uniformLoadsAvoided;
+  unsigned int drawsCulled;
+
+  renderStats() { reset(); };
+  void reset() {
+    draws = drawsCulled = 0;
+    programChanges = programChangesAvoided = 0;
+    textureBinds = textureBindsAvoided = 0;
+    uniformLoads = uniformLoadsAvoided = 0;
+  };
+};
+
+/// \brief A flattened list of things to draw.
+///
+/// Walking the scene graph to draw it means chasing pointers through
+/// maps and lists every frame.  Since the structure of a scene
+/// changes much less often than the positions of the things in it,
+/// the scene walks the tree once to build one of these, a plain
+/// array with one entry per drawableObj, and uses it to load and draw
+/// until something is added or removed.
+///
+/// The entries are sorted by a 64-bit key made of the program, the
+/// texture, the vertex buffer, and (optionally) the distance from the
+/// camera, in that order of importance, so that everything using the
+/// same shader is drawn together.  The queue keeps track of what
+/// program and texture are in place, and only changes them, or
+/// reloads the light and view uniforms, when it has to.  The
+/// renderStats say how much that saved.  Entries with the same key
+/// stay in scene order.  If the order of drawing matters to you,
+/// e.g. for transparency, turn the sorting off with setSortDraws(),
+/// which puts everything back in scene order.
+///
+/// The queue also keeps the tree structure around for view frustum
+/// culling, as a list of the nodes in depth-first order.  Each node
+/// knows where its subtree ends in the list, so a node found to be
+/// outside the frustum can be skipped along with everything below
+/// it, and each knows its parent, so the bounding boxes can be
+/// brought up to date with one pass through the list in reverse.
+class renderQueue {
+ private:
+  std::vector<renderItem> _items;
+
+  struct cullNode {
+    drawableMulti* node;
+    drawableCompound* compound;
+    int parent;
+    size_t end;
+  };
+  std::vector<cullNode> _cullNodes;
+  int _currentNode;
+
+  /// One entry per node, set by cull().
+  std::vector<char> _visible;
+  /// The frusta of the last cull(), kept to save reallocating them.
+  std::vector<viewFrustum> _frusta;
+  std::vector<char> _childrenChanged;
+  bool _culling;
+
+  /// Set when cull() has left some compound's components out (see
+  /// drawableCompound::_cullComponents()), so they can all be put
+  /// back if the cull goes out of date or culling is turned off.
+  bool _componentsCulled;
+  void _drawAllComponents();
+
+  /// The compound nodes whose bounds have changed since the last
+  /// clearMovedNodes(), with a flag per node to keep the list short.
+  std::vector<int> _movedNodes;
+  std::vector<char> _moved;
+
+  bool _sortDraws;
+  bool _depthSort;
+  float _depthRange;
+
+  /// Set when the depth keys have been brought up to date this frame.
+  bool _depthSorted;
+
+  renderStats _stats;
+
+  void _sort();
+  void _updateDepthKeys(const glm::mat4 &viewMatrix);
+
+ public:
+  renderQueue() : _currentNode(-1), _culling(true),
+    _componentsCulled(false), _sortDraws(true), _depthSort(false), _depthRange(100.0f),
+    _depthSorted(false) {};
+
+  /// \brief Empty the queue.
+  void clear() {
+    _items.clear();
+    _cullNodes.clear();
+    _visible.clear();
+    _movedNodes.clear();
+    _moved.clear();
+    _currentNode = -1;
+  };
+
+  /// \brief Start a node of the tree.
+  ///
+  /// Entries added after this belong to this node, until closeNode()
+  /// is called with the value returned.
+  int openNode(drawableMulti* node);
+  int openNode(drawableCompound* node);
+
+  /// \brief Finish a node.
+  void closeNode(const int &index);
+
+  /// \brief Add an entry for one component of a compound object.
+  void add(drawableCompound* compound, drawableObj* object,
+           shaderMgr* shader, const glm::mat4* worldMatrix);
+
+  /// \brief Computes the sort keys and sorts the queue.
+  ///
+  /// Call after all the entries have been added, and after the
+  /// objects have been prepared, so the buffer IDs are known.
+  void finish();
+
+  /// \brief The number of entries in the queue.
+  size_t size() { return _items.size(); };
+
+  /// \brief The number of tree nodes in the queue.
+  size_t numNodes() { return _cullNodes.size(); };
+
+  /// \brief Returns a node of the tree, in depth-first order.
+  drawableMulti* getNode(const int &index) { return _cullNodes[index].node; };
+
+  /// \brief Returns a node if it is a compound, otherwise NULL.
+  drawableCompound* getCompound(const int &index) {
+    return _cullNodes[index].compound; };
+
+  /// \brief Bring the world bounding boxes of all the nodes up to date.
+  void updateBounds();
+
+  /// \brief Which compound nodes have new bounds?
+  ///
+  /// Lists the nodes, by index, whose bounds have been changed by
+  /// updateBounds() since the list was last cleared.
+  const std::vector<int> &getMovedNodes() const { return _movedNodes; };
+
+  /// \brief Empty the list of moved nodes.
+  void clearMovedNodes();
+
+  /// \brief Turn view frustum culling on or off.
+  void setCulling(const bool &culling) { _culling = culling; };
+
+  /// \brief Decides which nodes are visible.
+  ///
+  /// A node is drawn if its bounding box is at least partly inside
+  /// any of the frusta described by the given projection times view
+  /// matrices.  In a stereo or multi-wall setup, pass one matrix for
+  /// each eye, and each node is tested once for all of them.  The
+  /// result is used by draw() until cull() is called again.
+  void cull(const std::vector<glm::mat4> &viewProjMatrices);
+
+  /// \brief Turn the sorting by state on or off.
+  void setSortDraws(const bool &sortDraws) { _sortDraws = sortDraws; };
+
+  /// \brief Sort objects front to back within the same state.
+  ///
+  /// Uses the distance of each compound object's origin from the
+  /// camera, out to the given range, as the least important part of
+  /// the sort key.  This means a re-sort every frame, done in the
+  /// first draw() after load(), so it is off by default.  Other views
+  /// of the same frame use the same order.
+  void setDepthSort(const bool &depthSort, const float &range = 100.0f) {
+    _depthSort = depthSort;
+    _depthRange = range;
+  };
+
+  /// \brief Loads all the compound objects in the queue.
+  void load();
+
+  /// \brief Draws everything in the queue.
+  void draw(const glm::mat4 &viewMatrix, const glm::mat4 &projMatrix);
+
+  /// \brief The state change counts since the last resetStats().
+  const renderStats &getStats() const { return _stats; };
+
+  /// \brief Zero the state change counts.
+  void resetStats() { _stats.reset(); };
+};
+
+/// \brief The result of a ray cast.  See scene::raycast().
+struct rayHit {
+  /// The object hit, and the component of it.
+  drawableCompound* compound;
+  drawableObj* object;
+  /// The name of the object, relative to the scene root.
+  bsgName name;
+  /// Which triangle of the component, see triangleTree::intersect().
+  int triangle;
+  /// Which instance, for a drawableInstanced object, otherwise -1.
+  int instance;
+  /// The distance along the ray, in world units.
+  float distance;
+  /// Where the ray hit, in world space.
+  glm::vec3 position;
+};
+
+/// \brief A bounding volume hierarchy for selecting objects.
+///
+/// Finding the objects that contain a point by walking the whole
+/// scene graph takes time in proportion to the number of objects.
+/// This is a binary tree of world-space boxes with one compound
+/// object at each leaf, so most of the scene can be ruled out a
+/// whole branch at a time.  It is built from a render queue, which
+/// already has a flat list of the compound objects and their bounding
+/// boxes.  When objects move, only the boxes along the paths from
+/// their leaves to the root are recalculated (refit()), and the tree
+/// is built again only when objects are added or removed.  The
+/// quality of the tree degrades a bit if things move a lot, but it
+/// is never wrong.
+class selectionTree {
+ private:
+  struct bvhNode {
+    glm::vec3 lower, upper;
+    /// For an interior node, the children.  Children always have
+    /// higher indices than their parents.
+    int left, right;
+    int parent;
+    /// For a leaf, the index of the compound object, else -1.
+    int leaf;
+  };
+  std::vector<bvhNode> _nodes;
+  std::vector<drawableCompound*> _leaves;
+
+  /// The tree node for each render queue node, or -1.
+  std::vector<int> _leafNodes;
+
+  std::vector<char> _dirty;
+
+  int _build(std::vector<int> &leaves, const int &first, const int &last,
+             const int &parent, const std::vector<glm::vec3> &centers);
+
+ public:
+  selectionTree() {};
+
+  /// \brief Build the tree from the compound objects in a queue.
+  ///
+  /// The queue's bounds should be up to date.
+  void build(renderQueue &queue);
+
+  /// \brief Recalculate the boxes of the moved nodes and their parents.
+  ///
+  /// Compound objects that were empty when the tree was built are not
+  /// in it.  If one of those has since acquired a bounding box, this
+  /// returns false, and the tree has to be built again.
+  bool refit(renderQueue &queue);
+
+  /// \brief Finds the nearest compound object hit by a ray.
+  ///
+  /// Branches are skipped if the ray misses their boxes, or hits them
+  /// farther away than a hit already found.  Sets the fields of the
+  /// hit and returns true if there was one.
+  bool raycast(const glm::vec3 &origin, const glm::vec3 &direction,
+               rayHit &hit) const;
+
+  /// \brief Finds the compound objects containing a point.
+  ///
+  /// The hits are appended to the given vector, which is not cleared
+  /// first.  Nothing is allocated unless the vector has to grow.  The
+  /// boxes are only a first cut; each object found is then checked
+  /// against the model-space boxes of its selectable components.
+  void query(const glm::vec4 &testPoint,
+             std::vector<drawableCompound*> &hits) const;
 };
 
 /// \brief A collection of drawable objects that make up a scene.
@@ -1350,6 +3381,27 @@ class scene {
 
   drawableCollection _sceneRoot;
 
+  /// The flattened version of the tree under _sceneRoot, rebuilt
+  /// whenever objects are added or removed.
+  renderQueue _renderQueue;
+  void _updateRenderQueue();
+
+  /// Set when cull() has been called since the last load().
+  bool _culledThisFrame;
+  /// For draw() to cull with, when cull() hasn't been called.
+  std::vector<glm::mat4> _viewProjMatrices;
+
+  /// For selection.  The tree is rebuilt when the render queue is.
+  selectionTree _selectionTree;
+  bool _selectionTreeNeedsBuild;
+  std::vector<drawableCompound*> _hits;
+  void _updateSelectionTree();
+
+  /// The names of the objects added by bakeStatic().
+  std::vector<std::string> _staticBatchNames;
+  static void _findStatic(drawableMulti* object, const bool &parentStatic,
+                          std::vector<drawableCompound*> &found);
+
   glm::mat4 _viewMatrix;
   glm::mat4 _projMatrix;
 
@@ -1378,6 +3430,8 @@ class scene {
     _aspect = 1.0f;
     _nearClip = 0.1f;
     _farClip = 100.0f;
+    _culledThisFrame = false;
+    _selectionTreeNeedsBuild = true;
   }
 
   /// \brief Where is the eye position?
@@ -1441,6 +3495,18 @@ class scene {
     _sceneRoot.addObject(name, pMultiObject);
   }
 
+  /// \brief Combine the static objects into batches.
+  ///
+  /// Finds the compound objects marked with setStatic(), or below a
+  /// collection so marked, and copies them into one
+  /// drawableStaticBatch for each shader, which is added to the scene
+  /// and draws them all.  This can make a big difference in a scene
+  /// with many static parts.  Call it after the scene is built and
+  /// before prepare().  If static objects are added, removed, or
+  /// moved, call it again, and then prepare() again; the old batches
+  /// are replaced.  Returns the number of batches.
+  int bakeStatic();
+
   /// \brief Prepare the scene to be drawn.
   ///
   /// This does a bunch of one-time-only initializations for the
@@ -1500,11 +3566,72 @@ class scene {
   bsgPtr<drawableMulti> getObject(bsgName &name);
 
   /// \brief Retrieve an object name identified by a selected point.
+  ///
+  /// This is a wrapper around pick() that turns the objects into
+  /// names, which means allocating lists of strings.
   bsgNameList insideBoundingBox(const glm::vec4 &testPoint);
 
+  /// \brief Finds the compound objects containing a point.
+  ///
+  /// The given vector is cleared and filled with the objects whose
+  /// selectable components have bounding boxes containing the point.
+  /// If you reuse the vector, this allocates no memory, so it is
+  /// suitable for doing every frame.  Use getFullName() to find out
+  /// what the objects are called.
+  void pick(const glm::vec4 &testPoint,
+            std::vector<drawableCompound*> &hits);
+
+  /// \brief Finds the nearest object hit by a ray.
+  ///
+  /// This is the way to select things with a pointer, like a VR wand.
+  /// The ray starts at the origin and goes in the given direction,
+  /// both in world space.  Only selectable objects are hit, and they
+  /// are tested triangle by triangle (see triangleTree).  If anything
+  /// is hit, the hit is filled in and the return is true.
+  bool raycast(const glm::vec3 &origin, const glm::vec3 &direction,
+               rayHit &hit);
+
+  /// \brief The name of an object, relative to the scene root.
+  ///
+  /// That is, the name you would use with getObject().
+  static bsgName getFullName(drawableMulti* object);
+
   /// \brief Loads all the compound elements.
+  ///
+  /// This also zeroes the render statistics, so after the draws of a
+  /// frame, getRenderStats() describes that frame.
   void load();
 
+  /// \brief How many OpenGL state changes did the last frame need?
+  const renderStats &getRenderStats() const {
+    return _renderQueue.getStats(); };
+
+  /// \brief Turn on or off the sorting of draws by OpenGL state.
+  void setSortDraws(const bool &sortDraws) {
+    _renderQueue.setSortDraws(sortDraws);
+    _renderQueue.finish();
+  };
+
+  /// \brief Turn view frustum culling on or off.  It is on by default.
+  void setFrustumCulling(const bool &culling) {
+    _renderQueue.setCulling(culling);
+  };
+
+  /// \brief Cull the scene for all the views of a frame at once.
+  ///
+  /// Takes a projection matrix times a view matrix for each of the
+  /// views (eyes, walls, whatever) that will be drawn this frame, and
+  /// marks everything outside all of them as invisible.  Call it after
+  /// load() and before the draw() calls.  If you don't call it,
+  /// draw() culls against its own matrices, which is fine for a
+  /// single view, but repeats the work for each view.
+  void cull(const std::vector<glm::mat4> &viewProjMatrices);
+
+  /// \brief Sort objects front to back as well.  See renderQueue.
+  void setDepthSort(const bool &depthSort, const float &range = 100.0f) {
+    _renderQueue.setDepthSort(depthSort, range);
+  };
+
   /// \brief Generates a view matrix and draws all the compound elements.
   ///
   /// The view matrix generated here, like the projection matrix
@@ -1,11 +1,28 @@
 #include "bsgMenagerie.h"
+#include <sstream>
+#include <iomanip>
 
 namespace bsg {
 
+  // Makes a key for the mesh cache from the name of a shape and the
+  // things that determine its mesh.
+  static std::string meshKey(const std::string &shape,
+                             const int &tess1, const int &tess2,
+                             const glm::vec4 &color) {
+    // Nine digits tell any two floats apart.
+    std::ostringstream key;
+    key << std::setprecision(9)
+        << shape << ":" << tess1 << ":" << tess2 << ":"
+        << color.r << "," << color.g << "," << color.b << "," << color.a;
+    return key.str();
+  }
+
   drawableRectangle::drawableRectangle(bsgPtr<shaderMgr> pShader,
                                        const float &width, const float &height,
-                                       const int &nDivs) :
-    drawableCompound(pShader), _height(height), _width(width) {
+                                       const int &nDivs,
+                                       const bool &twoSided) :
+    drawableCompound(pShader), _height(height), _width(width),
+    _twoSided(twoSided) {
 
     _name = randomName("rect");
 
@@ -27,7 +44,7 @@ namespace bsg {
     for (int j = 0; j < nDivs; j++) {
 
       _frontFace = new drawableObj();
-      _backFace = new drawableObj();
+      if (!_twoSided) _backFace = new drawableObj();
 
       for (int i = 0; i <= nDivs; i++) {
 
@@ -66,24 +83,32 @@ namespace bsg {
       _frontFace->addData(bsg::GLDATA_TEXCOORDS, "texture", frontFaceUVs);
       _frontFace->setDrawType(GL_TRIANGLE_STRIP, frontFaceVertices.size());
 
+      addObject(_frontFace);
+
+      // A two-sided strip is its own back.
+      if (_twoSided) {
+        _frontFace->setTwoSided(true);
+        continue;
+      }
+
       _backFace->addData(bsg::GLDATA_VERTICES, "position", backFaceVertices);
       _backFace->addData(bsg::GLDATA_COLORS, "color", backFaceColors);
       _backFace->addData(bsg::GLDATA_NORMALS, "normal", backFaceNormals);
       _backFace->addData(bsg::GLDATA_TEXCOORDS, "texture", backFaceUVs);
       _backFace->setDrawType(GL_TRIANGLE_STRIP, backFaceVertices.size());
 
-      addObject(_frontFace);
       addObject(_backFace);
     }
   }
 
   drawableRectangle::drawableRectangle(bsgPtr<shaderMgr> pShader,
-                                       const float &width, const float &height) :
-    drawableCompound(pShader), _height(height), _width(width) {
+                                       const float &width, const float &height,
+                                       const bool &twoSided) :
+    drawableCompound(pShader), _height(height), _width(width),
+    _twoSided(twoSided) {
 
     _name = randomName("rect");
     _frontFace = new drawableObj();
-    _backFace = new drawableObj();
 
     std::vector<glm::vec4> frontFaceVertices;
 
@@ -127,7 +152,15 @@ namespace bsg {
     // The vertices above are arranged into a set of triangles.
     _frontFace->setDrawType(GL_TRIANGLE_STRIP);
 
+    // A two-sided rectangle is its own back.
+    if (_twoSided) {
+      _frontFace->setTwoSided(true);
+      addObject(_frontFace);
+      return;
+    }
+
     // Same thing for the other rectangle.
+    _backFace = new drawableObj();
     std::vector<glm::vec4> backFaceVertices;
 
     backFaceVertices.push_back(glm::vec4( -w, -h, 0.0f, 1.0f));
@@ -178,6 +211,13 @@ namespace bsg {
 
     _name = randomName("sphere");
 
+    std::string key = meshKey("sphere", phiTesselation, thetaTesselation,
+                              color);
+    if (meshCache::find(key, _sphere)) {
+      addObject(_sphere);
+      return;
+    }
+
     float pi = 3.14159265358979323;
     float r = 0.5;
     float thetaStep = 2 * pi/_theta;
@@ -252,6 +292,7 @@ namespace bsg {
     // The vertices above are arranged into a set of triangles.
     _sphere->setDrawType(GL_TRIANGLE_STRIP, verts.size());
 
+    meshCache::add(key, _sphere);
     addObject(_sphere);
   }
 
@@ -384,19 +425,36 @@ namespace bsg {
     drawableCompound(pShader), _tess(tesselation) {
       _name = randomName("cube");
 
-      _front = new drawableObj;
-      _back = new drawableObj;
-      _left = new drawableObj;
-      _right = new drawableObj;
-      _top = new drawableObj;
-      _bottom = new drawableObj;
-
-      drawableSquare::getRect(_front, _tess, glm::vec3(-0.5, 0.5, 0.5), glm::vec3(0.5, 0.5, 0.5), glm::vec3(-0.5, -0.5, 0.5), color);
-      drawableSquare::getRect(_back, _tess, glm::vec3(0.5, 0.5, -0.5), glm::vec3(-0.5, 0.5, -0.5), glm::vec3(0.5, -0.5, -0.5), color);
-      drawableSquare::getRect(_left, _tess, glm::vec3(-0.5, 0.5, -0.5), glm::vec3(-0.5, 0.5, 0.5), glm::vec3(-0.5, -0.5, -0.5), color);
-      drawableSquare::getRect(_right, _tess, glm::vec3(0.5, 0.5, 0.5), glm::vec3(0.5, 0.5, -0.5), glm::vec3(0.5, -0.5, 0.5), color);
-      drawableSquare::getRect(_top, _tess, glm::vec3(-0.5, 0.5, -0.5), glm::vec3(0.5, 0.5, -0.5), glm::vec3(-0.5, 0.5, 0.5), color);
-      drawableSquare::getRect(_bottom, _tess, glm::vec3(-0.5, -0.5, 0.5), glm::vec3(0.5, -0.5, 0.5), glm::vec3(-0.5, -0.5, -0.5), color);
+      // All cubes of the same tesselation and color share their faces.
+      std::string key = meshKey("cube", _tess, _tess, color);
+      if (meshCache::find(key + ":front", _front)) {
+        meshCache::find(key + ":back", _back);
+        meshCache::find(key + ":left", _left);
+        meshCache::find(key + ":right", _right);
+        meshCache::find(key + ":top", _top);
+        meshCache::find(key + ":bottom", _bottom);
+      } else {
+        _front = new drawableObj;
+        _back = new drawableObj;
+        _left = new drawableObj;
+        _right = new drawableObj;
+        _top = new drawableObj;
+        _bottom = new drawableObj;
+
+        drawableSquare::getRect(_front, _tess, glm::vec3(-0.5, 0.5, 0.5), glm::vec3(0.5, 0.5, 0.5), glm::vec3(-0.5, -0.5, 0.5), color);
+        drawableSquare::getRect(_back, _tess, glm::vec3(0.5, 0.5, -0.5), glm::vec3(-0.5, 0.5, -0.5), glm::vec3(0.5, -0.5, -0.5), color);
+        drawableSquare::getRect(_left, _tess, glm::vec3(-0.5, 0.5, -0.5), glm::vec3(-0.5, 0.5, 0.5), glm::vec3(-0.5, -0.5, -0.5), color);
+        drawableSquare::getRect(_right, _tess, glm::vec3(0.5, 0.5, 0.5), glm::vec3(0.5, 0.5, -0.5), glm::vec3(0.5, -0.5, 0.5), color);
+        drawableSquare::getRect(_top, _tess, glm::vec3(-0.5, 0.5, -0.5), glm::vec3(0.5, 0.5, -0.5), glm::vec3(-0.5, 0.5, 0.5), color);
+        drawableSquare::getRect(_bottom, _tess, glm::vec3(-0.5, -0.5, 0.5), glm::vec3(0.5, -0.5, 0.5), glm::vec3(-0.5, -0.5, -0.5), color);
+
+        meshCache::add(key + ":front", _front);
+        meshCache::add(key + ":back", _back);
+        meshCache::add(key + ":left", _left);
+        meshCache::add(key + ":right", _right);
+        meshCache::add(key + ":top", _top);
+        meshCache::add(key + ":bottom", _bottom);
+      }
 
       addObject(_front);
       addObject(_back);
@@ -412,6 +470,15 @@ namespace bsg {
 
     _name = randomName("cone");
 
+    std::string key = meshKey("cone", heightTesselation, thetaTesselation,
+                              color);
+    if (meshCache::find(key + ":cap", _cap) &&
+        meshCache::find(key + ":base", _base)) {
+      addObject(_cap);
+      addObject(_base);
+      return;
+    }
+
     _cap = new drawableObj();
     _base = new drawableObj();
 
@@ -477,6 +544,9 @@ namespace bsg {
 
     drawableCircle::getCircle(_base, _theta, -1, -radius/2.0f, color);
 
+    meshCache::add(key + ":cap", _cap);
+    meshCache::add(key + ":base", _base);
+
     addObject(_cap);
     addObject(_base);
   }
@@ -489,6 +559,17 @@ namespace bsg {
   drawableCylinder::drawableCylinder(bsgPtr<shaderMgr> pShader, const int &heightTesselation, const int &thetaTesselation, const glm::vec4 &color) :
     drawableCompound(pShader), _height(heightTesselation), _theta(thetaTesselation) {
 
+    std::string key = meshKey("cylinder", heightTesselation, thetaTesselation,
+                              color);
+    if (meshCache::find(key + ":base", _base) &&
+        meshCache::find(key + ":body", _body) &&
+        meshCache::find(key + ":top", _top)) {
+      addObject(_base);
+      addObject(_body);
+      addObject(_top);
+      return;
+    }
+
     float pi = 3.14159265358979323;
     float r = 0.5;
     float thetaStep = 2 * pi/thetaTesselation;
@@ -545,6 +626,10 @@ namespace bsg {
     drawableCircle::getCircle(_top, _theta, 1, r, color);
     drawableCircle::getCircle(_base, _theta, -1, -r, color);
 
+    meshCache::add(key + ":base", _base);
+    meshCache::add(key + ":body", _body);
+    meshCache::add(key + ":top", _top);
+
     addObject(_base);
     addObject(_body);
     addObject(_top);
@@ -613,6 +698,10 @@ drawableLine::drawableLine(bsgPtr<shaderMgr> pShader,
 
   _line->setSelectable(false);
   _line->setInterleaved(false);
+  // The ends usually follow something around, changing every frame.
+  // Not GL_STREAM_DRAW, since that needs the application to call
+  // streamBuffer::advanceRing() every frame.
+  _line->setUsage(bsg::GLDATA_VERTICES, GL_DYNAMIC_DRAW);
 
   addObject(_line);
 }
@@ -623,7 +712,7 @@ void drawableLine::setLineEnds(const glm::vec3 &start, const glm::vec3 &end) {
   lineVertices.push_back(glm::vec4(start.x, start.y, start.z, 1.0f));
   lineVertices.push_back(glm::vec4(end.x, end.y, end.z, 1.0f));
 
-  _line->setData(bsg::GLDATA_VERTICES, lineVertices);
+  _line->setData(bsg::GLDATA_VERTICES, std::move(lineVertices));
 
 }
 
@@ -661,6 +750,10 @@ drawableSaggyLine::drawableSaggyLine(bsgPtr<shaderMgr> pShader,
 
   _line->setSelectable(false);
   _line->setInterleaved(false);
+  // The ends usually follow something around, changing every frame.
+  // Not GL_STREAM_DRAW, since that needs the application to call
+  // streamBuffer::advanceRing() every frame.
+  _line->setUsage(bsg::GLDATA_VERTICES, GL_DYNAMIC_DRAW);
 
   addObject(_line);
 }
@@ -670,7 +763,7 @@ void drawableSaggyLine::setLineEnds(const glm::vec3 &start, const glm::vec3 &end
   std::vector<glm::vec4> lineVertices = _calculateCatenary(start, end,
                                                            _nSegments,
                                                            _sagFactor);
-  _line->setData(bsg::GLDATA_VERTICES, lineVertices);
+  _line->setData(bsg::GLDATA_VERTICES, std::move(lineVertices));
 }
 
 std::vector<glm::vec4>
@@ -9,12 +9,22 @@ class drawableRectangle : public drawableCompound {
 
   bsgPtr<drawableObj> _frontFace, _backFace;
 
+  bool _twoSided;
+
  public:
+  /// \brief A rectangle with a front and a back.
+  ///
+  /// A two-sided rectangle has no back face object.  The front face
+  /// is drawn two-sided instead (see drawableObj::setTwoSided()),
+  /// which needs a shader that lights back faces.
   drawableRectangle(bsgPtr<shaderMgr> pShader,
-                    const float &width, const float &height);
+                    const float &width, const float &height,
+                    const bool &twoSided = false);
   drawableRectangle(bsgPtr<shaderMgr> pShader,
                     const float &width, const float &height,
-                    const int &nDivs);
+                    const int &nDivs, const bool &twoSided = false);
+
+  bool getTwoSided() const { return _twoSided; };
 
 };
 
@@ -1,318 +1,1181 @@
 #include "bsgObjModel.h"
 
+#include <cstdio>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef WIN32
+// Keep windows.h from defining min and max macros, which would break
+// std::min and std::max.
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 namespace bsg {
 
-drawableObjModel::drawableObjModel(bsgPtr<shaderMgr> pShader,
-                                   const std::string &fileName)
-  : drawableCompound(pShader), _fileName(fileName), _includeBackFace(true) {
-  _processObjFile();
+mappedFile::mappedFile(const std::string &fileName) :
+  _data(NULL), _size(0), _open(false), _mapped(false),
+  _fileHandle(NULL), _mappingHandle(NULL), _fd(-1) {
+
+#ifdef WIN32
+  HANDLE file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                            NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN,
+                            NULL);
+  if (file != INVALID_HANDLE_VALUE) {
+    LARGE_INTEGER size;
+    if (GetFileSizeEx(file, &size)) {
+      _size = (size_t)size.QuadPart;
+      _open = true;
+      if (_size > 0) {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY,
+                                            0, 0, NULL);
+        if (mapping) {
+          _data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+          if (_data) {
+            _mapped = true;
+            _mappingHandle = mapping;
+          } else {
+            CloseHandle(mapping);
+          }
+        }
+      }
+    }
+    if (_mapped) {
+      _fileHandle = file;
+    } else {
+      CloseHandle(file);
+    }
+  }
+#else
+  _fd = open(fileName.c_str(), O_RDONLY);
+  if (_fd >= 0) {
+    struct stat info;
+    if (fstat(_fd, &info) == 0) {
+      _size = info.st_size;
+      _open = true;
+      if (_size > 0) {
+        void* data = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
+        if (data != MAP_FAILED) {
+          // It will be read from front to back, so the system can
+          // read ahead.
+          madvise(data, _size, MADV_SEQUENTIAL);
+          _data = (const char*)data;
+          _mapped = true;
+        }
+      }
+    }
+    if (!_mapped) {
+      close(_fd);
+      _fd = -1;
+    }
+  }
+#endif
+
+  // If it couldn't be mapped, read it in the usual way.
+  if (_open && !_mapped && (_size > 0)) {
+    std::ifstream in(fileName.c_str(), std::ios::in | std::ios::binary);
+    _buffer.resize(_size);
+    in.read(&_buffer[0], _size);
+    _size = in.gcount();
+    _data = &_buffer[0];
+  }
 }
-   
-drawableObjModel::drawableObjModel(bsgPtr<shaderMgr> pShader,
-                                   const std::string &fileName,
-                                   const bool &back)
-  : drawableCompound(pShader), _fileName(fileName), _includeBackFace(back) {
-  _processObjFile();
+
+mappedFile::~mappedFile() {
+
+  if (!_mapped) return;
+
+#ifdef WIN32
+  UnmapViewOfFile(_data);
+  CloseHandle((HANDLE)_mappingHandle);
+  CloseHandle((HANDLE)_fileHandle);
+#else
+  munmap((void*)_data, _size);
+  close(_fd);
+#endif
 }
-   
-void drawableObjModel::_processObjFile() {
 
-  std::vector<glm::vec4> vert_list;
-  std::vector<glm::vec4> normal_list;
-  std::vector<glm::vec2> uv_list;
-  std::vector<material> materials;
-  std::vector<std::vector<int> > face_list;
-
-  std::ifstream fileObject(_fileName.c_str(), std::ios::in);
-  std::string fileObjectLine;
-  std::vector<std::string> lineTokens;
-  std::string lineType;
-  const char vertexGroupSeparator = ' ';
-  const char vertexFieldSeparator = '/';
-
-  int matIndex =
-      0; // placeholder material Index until material parsing is implemented
-  face_list.push_back(std::vector<int>());
-  
-  std::cout << "Processing: " << _fileName;
-  if (!_includeBackFace) std::cout << " (front face only)";
-  std::cout << " ..." << std::endl;
+// The parsing functions below read from a pointer into the text of a
+// file, which they move past whatever they read.  None of them goes
+// past the end, since the text isn't terminated.
+
+static inline bool isBlank(const char &c) {
+  return (c == ' ') || (c == '\t') || (c == '\r');
+}
+
+static inline void skipBlanks(const char* &p, const char* end) {
+  while ((p < end) && isBlank(*p)) p++;
+}
+
+static inline void skipLine(const char* &p, const char* end) {
+  const char* newline = (const char*)memchr(p, '\n', end - p);
+  p = newline ? newline + 1 : end;
+}
+
+static inline bool isDigit(const char &c) { return (c >= '0') && (c <= '9'); }
+
+// These are all exactly representable as doubles, so dividing or
+// multiplying by one is as accurate as it gets.
+static const double powersOfTen[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+// Reads a number like 1, -2.5, .75, or 6.02e23.  Anything else that
+// strtod() understands (inf, nan) goes to strtod().  Returns false,
+// leaving the pointer where it was, if there is no number.
+static bool parseFloat(const char* &p, const char* end, float &out) {
+
+  skipBlanks(p, end);
+  const char* q = p;
+
+  bool negative = false;
+  if ((q < end) && ((*q == '-') || (*q == '+'))) {
+    negative = (*q == '-');
+    q++;
+  }
+
+  // Up to 19 significant digits fit in the mantissa, which is more
+  // than a float can use.  Past that, only the exponent changes.
+  uint64_t mantissa = 0;
+  int exponent = 0, digits = 0;
+  bool any = false;
+  while ((q < end) && isDigit(*q)) {
+    if (digits < 19) {
+      mantissa = 10 * mantissa + (*q - '0');
+      if (mantissa > 0) digits++;
+    } else {
+      exponent++;
+    }
+    any = true;
+    q++;
+  }
+  if ((q < end) && (*q == '.')) {
+    q++;
+    while ((q < end) && isDigit(*q)) {
+      if (digits < 19) {
+        mantissa = 10 * mantissa + (*q - '0');
+        if (mantissa > 0) digits++;
+        exponent--;
+      }
+      any = true;
+      q++;
+    }
+  }
+
+  if (!any) {
+    // Maybe it's an inf or a nan.
+    char text[32];
+    size_t n = 0;
+    while ((p + n < end) && (n < sizeof(text) - 1) &&
+           !isBlank(p[n]) && (p[n] != '\n')) {
+      text[n] = p[n];
+      n++;
+    }
+    text[n] = '\0';
+    char* stop;
+    double value = strtod(text, &stop);
+    if (stop == text) return false;
+    out = (float)value;
+    p += stop - text;
+    return true;
+  }
+
+  if ((q < end) && ((*q == 'e') || (*q == 'E'))) {
+    const char* e = q + 1;
+    bool negativeExponent = false;
+    if ((e < end) && ((*e == '-') || (*e == '+'))) {
+      negativeExponent = (*e == '-');
+      e++;
+    }
+    if ((e < end) && isDigit(*e)) {
+      int value = 0;
+      while ((e < end) && isDigit(*e)) {
+        if (value < 10000) value = 10 * value + (*e - '0');
+        e++;
+      }
+      exponent += negativeExponent ? -value : value;
+      q = e;
+    }
+  }
+
+  double value = (double)mantissa;
+  if ((exponent < 0) && (exponent >= -22)) {
+    value /= powersOfTen[-exponent];
+  } else if ((exponent > 0) && (exponent <= 22)) {
+    value *= powersOfTen[exponent];
+  } else if (exponent != 0) {
+    value *= pow(10.0, exponent);
+  }
+
+  out = (float)(negative ? -value : value);
+  p = q;
+  return true;
+}
+
+// Reads an integer, with an optional sign.  Returns false, leaving
+// the pointer where it was, if there isn't one.
+static bool parseInt(const char* &p, const char* end, int &out) {
+
+  const char* q = p;
+  bool negative = false;
+  if ((q < end) && ((*q == '-') || (*q == '+'))) {
+    negative = (*q == '-');
+    q++;
+  }
+  if ((q == end) || !isDigit(*q)) return false;
+
+  long long value = 0;
+  while ((q < end) && isDigit(*q)) {
+    if (value < 0x7fffffff) value = 10 * value + (*q - '0');
+    q++;
+  }
+
+  out = (int)(negative ? -value : value);
+  p = q;
+  return true;
+}
+
+// OBJ indices count from 1, or, if negative, back from the end of the
+// list as it is so far.  This turns one into an index from zero.  A
+// missing index (zero) becomes -1, which is invalid.
+static inline int objIndex(const int &index, const size_t &listSize) {
+  if (index > 0) return index - 1;
+  if (index < 0) return (int)listSize + index;
+  return -1;
+}
+
+// Reads the rest of the line, without the blanks around it, as for a
+// material name.
+static std::string parseName(const char* &p, const char* end) {
 
-  if (fileObject.is_open()) {
-    while (!fileObject.eof()) {
-      getline(fileObject, fileObjectLine);
+  skipBlanks(p, end);
+  const char* q = p;
+  while ((q < end) && (*q != '\n')) q++;
 
-      // Split the line into segments, using whitespace as separator
-      lineTokens = split(fileObjectLine.c_str(), vertexGroupSeparator);
+  const char* nameEnd = q;
+  while ((nameEnd > p) && isBlank(nameEnd[-1])) nameEnd--;
 
-      // skip empty lines
-      if (lineTokens.size() == 0) {
-        continue;
+  std::string out(p, nameEnd);
+  p = q;
+  return out;
+}
+
+// Reads one blank-separated word, or returns false at the end of the
+// line.
+static bool parseWord(const char* &p, const char* end, std::string &out) {
+
+  skipBlanks(p, end);
+  const char* q = p;
+  while ((q < end) && !isBlank(*q) && (*q != '\n')) q++;
+  if (q == p) return false;
+
+  out.assign(p, q);
+  p = q;
+  return true;
+}
+
+static inline bool isLineType(const char* lineType, const size_t &typeLength,
+                              const char* name) {
+  return (typeLength == strlen(name)) && !strncmp(lineType, name, typeLength);
+}
+
+// The faces in a chunk that use one material.
+struct objFaceGroup {
+
+  // The name from the "usemtl" line.  The first group in a chunk
+  // carries on with whatever material the chunk before it ended
+  // with, which isn't known until all the chunks are parsed.
+  std::string materialName;
+  bool continued;
+
+  // Three indices (vertex, texture coordinate, normal) for each corner
+  // of each triangle.  Quads are made into two triangles.
+  std::vector<int> faces;
+
+  // Where the relative (negative) indices are in the face list.
+  // They are counted from the start of the chunk's lists until they
+  // are fixed up.
+  std::vector<size_t> relative;
+
+  // Which mesh (material) the faces go into, and where in it.
+  size_t mesh, triangleOffset;
+
+  objFaceGroup() : continued(true), mesh(0), triangleOffset(0) {};
+};
+
+// One piece of an OBJ file, and what was found in it.  The pieces
+// are parsed at the same time, in different threads.
+struct objChunk {
+  const char* begin;
+  const char* end;
+
+  std::vector<glm::vec4> vertices, normals;
+  std::vector<glm::vec2> uvs;
+
+  std::vector<objFaceGroup> groups;
+
+  // The MTL files named on "mtllib" lines.
+  std::vector<std::string> libraries;
+
+  // Where this chunk's data goes in the lists for the whole file.
+  size_t vertexOffset, normalOffset, uvOffset;
+};
+
+// The unpacked data for one drawableObj.  The color is the same for
+// all of it, so it isn't stored at every vertex.
+struct objMesh {
+  std::vector<glm::vec4> vertices, normals;
+  std::vector<glm::vec2> uvs;
+  glm::vec4 color;
+
+  void resize(const size_t &n) {
+    vertices.resize(n);
+    normals.resize(n);
+    uvs.resize(n);
+  };
+};
+
+// The lists for the whole file, and the meshes made from them, one
+// per material.
+struct objModelData {
+  std::vector<glm::vec4> vertices, normals;
+  std::vector<glm::vec2> uvs;
+  std::vector<objMesh> front, back;
+  bool includeBack;
+};
+
+// Runs a function on each chunk, each in its own thread, passing the
+// same arguments to each.  This thread takes the first one, instead
+// of just waiting.
+template <typename... Args>
+static void forEachChunk(void (*function)(objChunk*, Args...),
+                         std::vector<objChunk> &chunks, Args... args) {
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < chunks.size(); i++) {
+    threads.push_back(std::thread(function, &chunks[i], args...));
+  }
+  if (!chunks.empty()) function(&chunks[0], args...);
+
+  for (std::vector<std::thread>::iterator it = threads.begin();
+       it != threads.end(); it++) {
+    it->join();
+  }
+}
+
+// Turns an OBJ index into one from zero, for a chunk.  A relative
+// index is left relative to the chunk's list, and its place noted.
+static inline void addIndex(objFaceGroup* group, const int &index,
+                            const size_t &listSize) {
+  if (index < 0) group->relative.push_back(group->faces.size());
+  group->faces.push_back(objIndex(index, listSize));
+}
+
+static void parseObjChunk(objChunk* chunk) {
+
+  // The corners of the face being read, as they appear in the file.
+  std::vector<int> corners;
+
+  chunk->groups.assign(1, objFaceGroup());
+
+  const char* p = chunk->begin;
+  const char* end = chunk->end;
+  while (p < end) {
+
+    // The first token defines the line type (e.g. "v", "vn", etc.)
+    skipBlanks(p, end);
+    const char* lineType = p;
+    while ((p < end) && !isBlank(*p) && (*p != '\n')) p++;
+    size_t typeLength = p - lineType;
+
+    if ((typeLength == 1) && (lineType[0] == 'v')) {
+
+      // Parse an obj vertex location line. Format: "v x y z"
+      float x = 0.0f, y = 0.0f, z = 0.0f;
+      parseFloat(p, end, x) && parseFloat(p, end, y) && parseFloat(p, end, z);
+
+      chunk->vertices.push_back(glm::vec4(x, y, z, 1.0f));
+
+    } else if ((typeLength == 2) && (lineType[0] == 'v') &&
+               (lineType[1] == 'n')) {
+      // Parse an obj vertex normal line. Format: "vn nx ny nz"
+      float nx = 0.0f, ny = 0.0f, nz = 0.0f;
+      parseFloat(p, end, nx) && parseFloat(p, end, ny) &&
+        parseFloat(p, end, nz);
+
+      chunk->normals.push_back(glm::vec4(nx, ny, nz, 1.0f));
+
+    } else if ((typeLength == 2) && (lineType[0] == 'v') &&
+               (lineType[1] == 't')) {
+      // Parse an obj texture coordinate line. Format: "vt u v"
+      float u = 0.0f, v = 0.0f;
+      parseFloat(p, end, u) && parseFloat(p, end, v);
+
+      chunk->uvs.push_back(glm::vec2(u, v));
+
+    } else if ((typeLength == 1) && (lineType[0] == 'f')) {
+      // Parse the indices on an obj face line.
+      //"f v1 v2 v3" ("v4" optional)
+      //"f v1/vt1 v2/vt2 v3/vt3" ("v4/vt4 ..." optional)
+      //"f v1//vn1 v2//vn2 v3//vn3" ("v4//vn4 ..." optional)
+      //"f v1/vt1/vn1 v2/vt2/vn2 v3/vt3/vn3" ("v4/vt4/vn4 ..." optional)
+      // every primitive will be broken down into triangles
+      corners.clear();
+      while (true) {
+        skipBlanks(p, end);
+
+        // Missing fields are left zero, which becomes an invalid
+        // index, for filtering later.
+        int vIndex = 0, vtIndex = 0, vnIndex = 0;
+        if (!parseInt(p, end, vIndex)) break;
+        if ((p < end) && (*p == '/')) {
+          p++;
+          parseInt(p, end, vtIndex);
+          if ((p < end) && (*p == '/')) {
+            p++;
+            parseInt(p, end, vnIndex);
+          }
+        }
+
+        corners.push_back(vIndex);
+        corners.push_back(vtIndex);
+        corners.push_back(vnIndex);
       }
 
-      // The first token defines the line type (e.g. "v", "vn", etc.)
-      lineType = lineTokens[0];
-
-      if (lineType.compare("v") == 0) {
-
-        // Parse an obj vertex location line. Format: "v x y z"
-        float x, y, z;
-
-        sscanf(lineTokens[1].c_str(), "%f", &x);
-        sscanf(lineTokens[2].c_str(), "%f", &y);
-        sscanf(lineTokens[3].c_str(), "%f", &z);
-
-        vert_list.push_back(glm::vec4(x, y, z, 1.0f));
-
-      } else if (lineType.compare("vn") == 0) {
-        // Parse an obj vertex normal line. Format: "vn nx ny nz"
-        float nx, ny, nz;
-
-        sscanf(lineTokens[1].c_str(), "%f", &nx);
-        sscanf(lineTokens[2].c_str(), "%f", &ny);
-        sscanf(lineTokens[3].c_str(), "%f", &nz);
-
-        normal_list.push_back(glm::vec4(nx, ny, nz, 1.0f));
-
-      } else if (lineType.compare("vt") == 0) {
-        // Parse an obj texture coordinate line. Format: "vt u v"
-        float u, v;
-
-        sscanf(lineTokens[1].c_str(), "%f", &u);
-        sscanf(lineTokens[2].c_str(), "%f", &v);
-
-        uv_list.push_back(glm::vec2(u, v));
-
-      } else if (lineType.compare("f") == 0) {
-        // Parse the indices on an obj face line.
-        //"f v1 v2 v3" ("v4" optional)
-        //"f v1/vt1 v2/vt2 v3/vt3" ("v4/vt4 ..." optional)
-        //"f v1//vn1 v2//vn2 v3//vn3" ("v4//vn4 ..." optional)
-        //"f v1/vt1/vn1 v2/vt2/vn2 v3/vt3/vn3" ("v4/vt4/vn4 ..." optional)
-        // every primitive will be broken down into triangles
-
-        // Covered primitives are triangles and quads (ignoring other
-        // primitives)
-        if (lineTokens.size() == 4 || lineTokens.size() == 5) {
-          int vIndex, vnIndex, vtIndex;
-          std::vector<std::string> faceElementTokens;
-          std::size_t numSlash;
-
-          for (int i = 1; i < lineTokens.size(); i++) {
-            // Initialize fields with invalid indices for filtering later
-            vIndex = 0;
-            vnIndex = 0;
-            vtIndex = 0;
-
-            // Split the token around the "/" character and count the occurrence
-            faceElementTokens =
-                split(lineTokens[i].c_str(), vertexFieldSeparator);
-            numSlash = std::count(lineTokens[i].begin(), lineTokens[i].end(),
-                                  vertexFieldSeparator);
-
-            switch (faceElementTokens.size()) {
-            case 1:
-              // v1
-              sscanf(faceElementTokens[0].c_str(), "%d", &vIndex);
-              break;
-            case 2:
-              if (numSlash == 1) {
-                // v1/vt1
-                sscanf(faceElementTokens[0].c_str(), "%d", &vIndex);
-                sscanf(faceElementTokens[1].c_str(), "%d", &vtIndex);
-              } else {
-                // v1//vn1
-                sscanf(faceElementTokens[0].c_str(), "%d", &vIndex);
-                sscanf(faceElementTokens[1].c_str(), "%d", &vnIndex);
-              }
-              break;
-            case 3:
-              // v1/vt1/vn1
-              sscanf(faceElementTokens[0].c_str(), "%d", &vIndex);
-              sscanf(faceElementTokens[1].c_str(), "%d", &vtIndex);
-              sscanf(faceElementTokens[2].c_str(), "%d", &vnIndex);
-              break;
-            }
-
-            // Store all vertex indices in temporary list, until parsing of all
-            // lines of the file is complete
-            // C++ vectors are zero-indexed, so all obj indizes have to be
-            // reduced by one
-            if (i < 4) {
-              // The current vertex is part of the first triangle of the
-              // primitive and can be stored in incoming order
-              face_list[matIndex].push_back(vIndex - 1);
-              face_list[matIndex].push_back(vtIndex - 1);
-              face_list[matIndex].push_back(vnIndex - 1);
-            } else {
-              // The primitive has more than three vertices, triangulize the
-              // primitive as triangle fan
-              // using the first, previous and current vertex
-              int firstVertexPos = face_list[matIndex].size() - ((i - 1) * 3);
-              int previousVertexPos = face_list[matIndex].size() - 3;
-
-              face_list[matIndex].push_back(
-                  face_list[matIndex][firstVertexPos]);
-              face_list[matIndex].push_back(
-                  face_list[matIndex][firstVertexPos + 1]);
-              face_list[matIndex].push_back(
-                  face_list[matIndex][firstVertexPos + 2]);
-
-              face_list[matIndex].push_back(
-                  face_list[matIndex][previousVertexPos]);
-              face_list[matIndex].push_back(
-                  face_list[matIndex][previousVertexPos + 1]);
-              face_list[matIndex].push_back(
-                  face_list[matIndex][previousVertexPos + 2]);
-
-              face_list[matIndex].push_back(vIndex - 1);
-              face_list[matIndex].push_back(vtIndex - 1);
-              face_list[matIndex].push_back(vnIndex - 1);
-            }
+      // Covered primitives are triangles and quads (ignoring other
+      // primitives).  A quad is made into two triangles, as a fan,
+      // using the first, previous, and current vertex.
+      objFaceGroup* group = &chunk->groups.back();
+      int nCorners = corners.size() / 3;
+      if ((nCorners == 3) || (nCorners == 4)) {
+        for (int i = 2; i < nCorners; i++) {
+          int triangle[3] = { 0, i - 1, i };
+          for (int k = 0; k < 3; k++) {
+            addIndex(group, corners[3 * triangle[k]], chunk->vertices.size());
+            addIndex(group, corners[3 * triangle[k] + 1], chunk->uvs.size());
+            addIndex(group, corners[3 * triangle[k] + 2],
+                     chunk->normals.size());
           }
         }
       }
+
+    } else if (isLineType(lineType, typeLength, "usemtl")) {
+      // The faces after this use the named material.  Format:
+      // "usemtl name"
+      if (!chunk->groups.back().faces.empty()) {
+        chunk->groups.push_back(objFaceGroup());
+      }
+      chunk->groups.back().materialName = parseName(p, end);
+      chunk->groups.back().continued = false;
+
+    } else if (isLineType(lineType, typeLength, "mtllib")) {
+      // The materials are defined in these files.  Format:
+      // "mtllib file1 file2 ..."
+      std::string library;
+      while (parseWord(p, end, library)) chunk->libraries.push_back(library);
     }
+
+    skipLine(p, end);
   }
+}
 
-  // File parsing complete
+// Copies a chunk's lists into the lists for the whole file, and makes
+// its relative indices absolute.
+static void mergeObjChunk(objChunk* chunk, objModelData* data) {
+
+  std::copy(chunk->vertices.begin(), chunk->vertices.end(),
+            data->vertices.begin() + chunk->vertexOffset);
+  std::copy(chunk->normals.begin(), chunk->normals.end(),
+            data->normals.begin() + chunk->normalOffset);
+  std::copy(chunk->uvs.begin(), chunk->uvs.end(),
+            data->uvs.begin() + chunk->uvOffset);
 
-  // "Unpack" indices into Vertex Buffers to load them into graphics memory
+  // The copies aren't needed any more.
+  std::vector<glm::vec4>().swap(chunk->vertices);
+  std::vector<glm::vec4>().swap(chunk->normals);
+  std::vector<glm::vec2>().swap(chunk->uvs);
 
-  int nEntries = face_list[matIndex].size() / 3;
+  // The indices go vertex, texture coordinate, normal.
+  for (std::vector<objFaceGroup>::iterator it = chunk->groups.begin();
+       it != chunk->groups.end(); it++) {
+    for (std::vector<size_t>::iterator jt = it->relative.begin();
+         jt != it->relative.end(); jt++) {
+      switch (*jt % 3) {
+      case 0:
+        it->faces[*jt] += chunk->vertexOffset;
+        break;
+      case 1:
+        it->faces[*jt] += chunk->uvOffset;
+        break;
+      case 2:
+        it->faces[*jt] += chunk->normalOffset;
+        break;
+      }
+    }
+  }
+}
 
-  std::vector<glm::vec4> frontFaceVertices = std::vector<glm::vec4>(nEntries);
-  std::vector<glm::vec4> frontFaceColors = std::vector<glm::vec4>(nEntries);
-  std::vector<glm::vec4> frontFaceNormals = std::vector<glm::vec4>(nEntries);
-  std::vector<glm::vec2> frontFaceUVs = std::vector<glm::vec2>(nEntries);
-  std::vector<glm::vec4> backFaceVertices = std::vector<glm::vec4>(nEntries);
-  std::vector<glm::vec4> backFaceColors = std::vector<glm::vec4>(nEntries);
-  std::vector<glm::vec4> backFaceNormals = std::vector<glm::vec4>(nEntries);
-  std::vector<glm::vec2> backFaceUVs = std::vector<glm::vec2>(nEntries);
+static inline bool validIndex(const int &index, const size_t &listSize) {
+  return (index >= 0) && ((size_t)index < listSize);
+}
+
+// "Unpack" a chunk's triangles into the meshes for their materials,
+// at the chunk's place in them, so they can be loaded into graphics
+// memory.
+static void unpackObjChunk(objChunk* chunk, objModelData* data) {
+
+  const std::vector<glm::vec4> &vert_list = data->vertices;
+  const std::vector<glm::vec4> &normal_list = data->normals;
+  const std::vector<glm::vec2> &uv_list = data->uvs;
 
-  _frontFace = new drawableObj();
-  if (_includeBackFace) _backFace = new drawableObj();
-  
   glm::vec2 genericUV = glm::vec2(0.0f, 0.0f);
 
-  for (int i = 0; i < nEntries / 3; i++) {
-    // process every triangle in the face_list
-
-    int j = i * 9; // Start index of the triangle, since every triangle has 9
-                   // indices (v1/vt1/vn1 v2/vt2/vn2 v3/vt3/vn3)
-
-    int writePos =
-        i * 3; // Writing position in vertex, color, normal and uv vectors
-
-    if (!(face_list[matIndex][j] < 0 || face_list[matIndex][j + 3] < 0 ||
-          face_list[matIndex][j + 6] < 0)) {
-      // Only process triangle if all of the vertex coordinate indices are valid
-      // (>= 0)
-
-      // Add front-facing triangle
-      frontFaceVertices[writePos] = vert_list[face_list[matIndex][j]];
-      frontFaceVertices[writePos + 1] = vert_list[face_list[matIndex][j + 3]];
-      frontFaceVertices[writePos + 2] = vert_list[face_list[matIndex][j + 6]];
-
-      // Add back-facing triangle by flipping the order of the last two vertices
-      backFaceVertices[writePos] = vert_list[face_list[matIndex][j]];
-      backFaceVertices[writePos + 1] = vert_list[face_list[matIndex][j + 6]];
-      backFaceVertices[writePos + 2] = vert_list[face_list[matIndex][j + 3]];
-
-      if (!(face_list[matIndex][j + 1] < 0 || face_list[matIndex][j + 4] < 0 ||
-            face_list[matIndex][j + 7] < 0)) {
-        // All texture coordinate indices are valid (>= 0)
-        // Add front-facing triangle UVs
-        frontFaceUVs[writePos] = uv_list[face_list[matIndex][j + 1]];
-        frontFaceUVs[writePos + 1] = uv_list[face_list[matIndex][j + 4]];
-        frontFaceUVs[writePos + 2] = uv_list[face_list[matIndex][j + 7]];
-
-        // Add back-facing triangle UVs by flipping the order of the last two
-        // vertices
-        backFaceUVs[writePos] = uv_list[face_list[matIndex][j + 1]];
-        backFaceUVs[writePos + 1] = uv_list[face_list[matIndex][j + 7]];
-        backFaceUVs[writePos + 2] = uv_list[face_list[matIndex][j + 4]];
+  for (std::vector<objFaceGroup>::iterator it = chunk->groups.begin();
+       it != chunk->groups.end(); it++) {
+
+    objMesh &front = data->front[it->mesh];
+
+    int nTriangles = it->faces.size() / 9;
+    for (int i = 0; i < nTriangles; i++) {
+      // process every triangle in the group.  Every triangle has 9
+      // indices (v1/vt1/vn1 v2/vt2/vn2 v3/vt3/vn3)
+      const int* f = &it->faces[9 * i];
+
+      // Writing position in vertex, color, normal and uv vectors
+      size_t writePos = 3 * (it->triangleOffset + i);
+
+      if (!validIndex(f[0], vert_list.size()) ||
+          !validIndex(f[3], vert_list.size()) ||
+          !validIndex(f[6], vert_list.size())) continue;
+
+      // Only process triangle if all of the vertex coordinate indices
+      // are valid.  Add front-facing triangle
+      front.vertices[writePos] = vert_list[f[0]];
+      front.vertices[writePos + 1] = vert_list[f[3]];
+      front.vertices[writePos + 2] = vert_list[f[6]];
+
+      if (validIndex(f[1], uv_list.size()) &&
+          validIndex(f[4], uv_list.size()) &&
+          validIndex(f[7], uv_list.size())) {
+        // All texture coordinate indices are valid
+        front.uvs[writePos] = uv_list[f[1]];
+        front.uvs[writePos + 1] = uv_list[f[4]];
+        front.uvs[writePos + 2] = uv_list[f[7]];
       } else {
-        // At least one texture coordinate index was invalid, store generic
-        // texture coordinates
-        frontFaceUVs[writePos] = genericUV;
-        frontFaceUVs[writePos + 1] = genericUV;
-        frontFaceUVs[writePos + 2] = genericUV;
-        backFaceUVs[writePos] = genericUV;
-        backFaceUVs[writePos + 1] = genericUV;
-        backFaceUVs[writePos + 2] = genericUV;
+        // At least one texture coordinate index was invalid, store
+        // generic texture coordinates
+        front.uvs[writePos] = genericUV;
+        front.uvs[writePos + 1] = genericUV;
+        front.uvs[writePos + 2] = genericUV;
       }
 
-      if (!(face_list[matIndex][j + 2] < 0 || face_list[matIndex][j + 5] < 0 ||
-            face_list[matIndex][j + 8] < 0)) {
-        // All normal indices are valid (>= 0)
-        // Add front-facing triangle normals
-        frontFaceNormals[writePos] = normal_list[face_list[matIndex][j + 2]];
-        frontFaceNormals[writePos + 1] =
-            normal_list[face_list[matIndex][j + 5]];
-        frontFaceNormals[writePos + 2] =
-            normal_list[face_list[matIndex][j + 8]];
-
-        // Add back-facing triangle normals by negating front facing ones
-        backFaceNormals[writePos] = -normal_list[face_list[matIndex][j + 2]];
-        backFaceNormals[writePos + 1] =
-            -normal_list[face_list[matIndex][j + 5]];
-        backFaceNormals[writePos + 2] =
-            -normal_list[face_list[matIndex][j + 8]];
+      if (validIndex(f[2], normal_list.size()) &&
+          validIndex(f[5], normal_list.size()) &&
+          validIndex(f[8], normal_list.size())) {
+        // All normal indices are valid
+        front.normals[writePos] = normal_list[f[2]];
+        front.normals[writePos + 1] = normal_list[f[5]];
+        front.normals[writePos + 2] = normal_list[f[8]];
       } else {
-        // At least one normal index was invalid, calculate face normal from
-        // vertex data
-        glm::vec3 a = glm::vec3(frontFaceVertices[writePos]) -
-                      glm::vec3(frontFaceVertices[writePos + 1]);
-        glm::vec3 b = glm::vec3(frontFaceVertices[writePos]) -
-                      glm::vec3(frontFaceVertices[writePos + 2]);
+        // At least one normal index was invalid, calculate face normal
+        // from vertex data
+        glm::vec3 a = glm::vec3(front.vertices[writePos]) -
+                      glm::vec3(front.vertices[writePos + 1]);
+        glm::vec3 b = glm::vec3(front.vertices[writePos]) -
+                      glm::vec3(front.vertices[writePos + 2]);
         glm::vec3 n = glm::normalize(glm::cross(a, b));
         glm::vec4 faceNormal = glm::vec4(n, 1.0f);
 
-        frontFaceNormals[writePos] = faceNormal;
-        frontFaceNormals[writePos + 1] = faceNormal;
-        frontFaceNormals[writePos + 2] = faceNormal;
+        front.normals[writePos] = faceNormal;
+        front.normals[writePos + 1] = faceNormal;
+        front.normals[writePos + 2] = faceNormal;
+      }
 
-        // Add back-facing triangle normals by negating front facing ones
-        backFaceNormals[writePos] = -faceNormal;
-        backFaceNormals[writePos + 1] = -faceNormal;
-        backFaceNormals[writePos + 2] = -faceNormal;
+      if (data->includeBack) {
+        // Add back-facing triangle by flipping the order of the last
+        // two vertices, and negating the normals.
+        objMesh &back = data->back[it->mesh];
+        int order[3] = { 0, 2, 1 };
+        for (int k = 0; k < 3; k++) {
+          back.vertices[writePos + k] = front.vertices[writePos + order[k]];
+          back.uvs[writePos + k] = front.uvs[writePos + order[k]];
+          back.normals[writePos + k] = -front.normals[writePos + order[k]];
+        }
       }
     }
   }
+}
 
-  _frontFace->addData(bsg::GLDATA_VERTICES, "position", frontFaceVertices);
-  _frontFace->addData(bsg::GLDATA_COLORS, "color", frontFaceColors);
-  _frontFace->addData(bsg::GLDATA_NORMALS, "normal", frontFaceNormals);
-  _frontFace->addData(bsg::GLDATA_TEXCOORDS, "texture", frontFaceUVs);
-  _frontFace->setDrawType(GL_TRIANGLES, frontFaceVertices.size());
+// The part of a file name up to and including the last slash, so a
+// file named in it can be found relative to it.
+static std::string directoryOf(const std::string &fileName) {
+  size_t slash = fileName.find_last_of("/\\");
+  if (slash == std::string::npos) return "";
+  return fileName.substr(0, slash + 1);
+}
 
-  _backFace->addData(bsg::GLDATA_VERTICES, "position", backFaceVertices);
-  _backFace->addData(bsg::GLDATA_COLORS, "color", backFaceColors);
-  _backFace->addData(bsg::GLDATA_NORMALS, "normal", backFaceNormals);
-  _backFace->addData(bsg::GLDATA_TEXCOORDS, "texture", backFaceUVs);
-  _backFace->setDrawType(GL_TRIANGLES, backFaceVertices.size());
+// The materials of the models in use, so a model found in the mesh
+// cache gets them too.  An entry lasts as long as there are models
+// using it, which is at least as long as the meshes it goes with are
+// in use, and is replaced whenever the file is read again.
+struct objModelMaterials {
+  std::vector<material> materials;
+  int users;
+  objModelMaterials() : users(0) {};
+};
+static std::map<std::string, objModelMaterials> objMaterials;
 
-  
-  _frontFace->setInterleaved(true);
-  addObject(_frontFace);
+int drawableObjModel::_numThreads = 0;
+bool drawableObjModel::_useMeshFiles = false;
+std::string drawableObjModel::_meshFileDirectory;
 
-  if (_includeBackFace) {
-    _backFace->setInterleaved(true);
-    addObject(_backFace);
+drawableObjModel::drawableObjModel(bsgPtr<shaderMgr> pShader,
+                                   const std::string &fileName)
+  : drawableCompound(pShader), _fileName(fileName), _includeBackFace(true),
+    _twoSided(false), _sharingMaterials(false) {
+  _processObjFile();
+}
+   
+drawableObjModel::drawableObjModel(bsgPtr<shaderMgr> pShader,
+                                   const std::string &fileName,
+                                   const bool &back)
+  : drawableCompound(pShader), _fileName(fileName), _includeBackFace(back),
+    _twoSided(false), _sharingMaterials(false) {
+  _processObjFile();
+}
+
+// Two-sided models need no back faces.
+drawableObjModel::drawableObjModel(bsgPtr<shaderMgr> pShader,
+                                   const std::string &fileName,
+                                   const bool &back, const bool &twoSided)
+  : drawableCompound(pShader), _fileName(fileName),
+    _includeBackFace(back && !twoSided), _twoSided(twoSided),
+    _sharingMaterials(false) {
+  _processObjFile();
+}
+
+drawableObjModel::~drawableObjModel() {
+
+  if (!_sharingMaterials) return;
+  std::map<std::string, objModelMaterials>::iterator shared =
+    objMaterials.find(_fileName);
+  if ((shared != objMaterials.end()) && (--shared->second.users <= 0))
+    objMaterials.erase(shared);
+}
+
+void drawableObjModel::_shareMaterials() {
+
+  objModelMaterials &shared = objMaterials[_fileName];
+  shared.materials = _materials;
+  shared.users++;
+  _sharingMaterials = true;
+}
+
+void drawableObjModel::_readMtlFile(const std::string &fileName) {
+
+  mappedFile file(fileName);
+  if (!file.isOpen()) {
+    std::cerr << "** Caution: could not open " << fileName << std::endl;
+    return;
   }
 
-  std::cout << "... " << _fileName << " done." << std::endl;
+  material* current = NULL;
+
+  const char* p = file.begin();
+  const char* end = file.end();
+  while (p < end) {
+
+    skipBlanks(p, end);
+    const char* lineType = p;
+    while ((p < end) && !isBlank(*p) && (*p != '\n')) p++;
+    size_t typeLength = p - lineType;
+
+    if (isLineType(lineType, typeLength, "newmtl")) {
+      _materials.push_back(material(parseName(p, end)));
+      current = &_materials.back();
+
+    } else if (!current) {
+      // Lines before the first "newmtl" have nothing to describe.
+
+    } else if (isLineType(lineType, typeLength, "Ka") ||
+               isLineType(lineType, typeLength, "Kd") ||
+               isLineType(lineType, typeLength, "Ks")) {
+      glm::vec3 color;
+      parseFloat(p, end, color.r);
+      // A single value means a gray.
+      color.g = color.b = color.r;
+      parseFloat(p, end, color.g) && parseFloat(p, end, color.b);
+
+      switch (lineType[1]) {
+      case 'a':
+        current->colorAmbient = color;
+        break;
+      case 'd':
+        current->colorDiffuse = color;
+        break;
+      case 's':
+        current->colorSpecular = color;
+        break;
+      }
+
+    } else if (isLineType(lineType, typeLength, "Ns")) {
+      parseFloat(p, end, current->exponentSpecular);
+
+    } else if (isLineType(lineType, typeLength, "d")) {
+      parseFloat(p, end, current->opacity);
+
+    } else if (isLineType(lineType, typeLength, "Tr")) {
+      // Transparency, the opposite of "d".
+      float transparency = 0.0f;
+      if (parseFloat(p, end, transparency)) {
+        current->opacity = 1.0f - transparency;
+      }
+
+    }
+
+    skipLine(p, end);
+  }
+}
+
+// Makes the object for one mesh.  The mesh's arrays are handed over,
+// not copied, since they can be big.
+static bsgPtr<drawableObj> makeObjFace(objMesh &mesh) {
+
+  bsgPtr<drawableObj> face = new drawableObj();
+
+  int nEntries = mesh.vertices.size();
+  face->addData(bsg::GLDATA_VERTICES, "position", std::move(mesh.vertices));
+  face->setConstantColor("color", mesh.color);
+  face->addData(bsg::GLDATA_NORMALS, "normal", std::move(mesh.normals));
+  face->addData(bsg::GLDATA_TEXCOORDS, "texture", std::move(mesh.uvs));
+  face->setDrawType(GL_TRIANGLES, nEntries);
+
+  // The unpacking above left every corner of every triangle as its
+  // own vertex.  Merge the duplicates and draw with an index array.
+  face->weld();
+
+  face->setInterleaved(true);
+  return face;
 }
 
-std::vector<std::string> drawableObjModel::split(const std::string line,
-                                                 const char separator) {
-  std::vector<std::string> out;
-  std::string element;
-  std::stringstream linestream(line);
-  while (std::getline(linestream, element, separator)) {
-    out.push_back(element);
+void drawableObjModel::_addFaces(bsgPtr<drawableObj> frontFace,
+                                 bsgPtr<drawableObj> backFace) {
+
+  std::stringstream index;
+  index << _frontFaces.size();
+
+  // A two-sided face is not the same object as a front face, though
+  // its data is.
+  std::string side = frontFace->getTwoSided() ? ":twoSided:" : ":front:";
+  meshCache::add("obj:" + _fileName + side + index.str(), frontFace);
+  _frontFaces.push_back(frontFace);
+  addObject(frontFace);
+
+  if (_includeBackFace) {
+    meshCache::add("obj:" + _fileName + ":back:" + index.str(), backFace);
+    _backFaces.push_back(backFace);
+    addObject(backFace);
   }
+}
+
+// The mesh files start with this, and a version number that changes
+// whenever what follows does.  The rest is written in the machine's
+// byte order, which the version number also catches.
+static const char meshFileMagic[8] = { 'B', 'S', 'G', 'M', 'E', 'S', 'H', 0 };
+static const uint32_t meshFileVersion = 4;
+
+// The size and modification time of a file, to tell whether it has
+// changed.  Returns false if there is no such file.
+static bool fileStamp(const std::string &fileName,
+                      uint64_t &size, int64_t &time) {
+  struct stat info;
+  if (stat(fileName.c_str(), &info) != 0) return false;
+  size = info.st_size;
+  time = info.st_mtime;
+  return true;
+}
+
+// The full path of a file, so it names the same file from whatever
+// directory the program is started in.  Returns the name as it is if
+// the file can't be found.
+static std::string absolutePath(const std::string &fileName) {
+
+#ifdef WIN32
+  char path[_MAX_PATH];
+  if (!_fullpath(path, fileName.c_str(), _MAX_PATH)) return fileName;
+  return path;
+#else
+  char* path = realpath(fileName.c_str(), NULL);
+  if (!path) return fileName;
+  std::string out = path;
+  free(path);
   return out;
+#endif
+}
+
+std::string drawableObjModel::_meshFileName() const {
+
+  if (!_useMeshFiles) return "";
+  std::string name = absolutePath(_fileName);
+  if (_meshFileDirectory.empty()) return name + ".bsgmesh";
+
+  // Flatten the whole path into a name, so models with the same name
+  // in different directories don't collide.
+  for (std::string::iterator it = name.begin(); it != name.end(); it++) {
+    if ((*it == '/') || (*it == '\\') || (*it == ':')) *it = '_';
+  }
+  return _meshFileDirectory + "/" + name + ".bsgmesh";
+}
+
+bool drawableObjModel::_readMeshFile(const std::string &meshFileName) {
+
+  mappedFile file(meshFileName);
+  if (!file.isOpen()) return false;
+  binaryReader in(file.begin(), file.end());
+
+  const char* magic = in.getBytes(sizeof(meshFileMagic));
+  uint32_t version = 0, includeBack = 0;
+  in.getValue(version);
+  in.getValue(includeBack);
+  if (!magic || memcmp(magic, meshFileMagic, sizeof(meshFileMagic)) ||
+      (version != meshFileVersion) || (_includeBackFace && !includeBack))
+    return false;
+
+  // If any of the files it was made from has changed, it's stale.  A
+  // file that was missing then and is still missing hasn't changed,
+  // but the OBJ file itself, which comes first, has to be there.
+  uint32_t nSources = 0;
+  in.getValue(nSources);
+  for (uint32_t i = 0; i < nSources; i++) {
+    std::string source;
+    uint32_t found = 0;
+    uint64_t size = 0, fileSize = 0;
+    int64_t time = 0, fileTime = 0;
+    in.getString(source);
+    in.getValue(found);
+    in.getValue(size);
+    in.getValue(time);
+    if (!in.good()) return false;
+    bool foundNow = fileStamp(source, fileSize, fileTime);
+    if ((i == 0) && !foundNow) return false;
+    if ((foundNow != (found != 0)) ||
+        (foundNow && ((size != fileSize) || (time != fileTime)))) return false;
+  }
+
+  std::vector<material> materials;
+  uint32_t nMaterials = 0;
+  in.getValue(nMaterials);
+  for (uint32_t i = 0; (i < nMaterials) && in.good(); i++) {
+    std::string name;
+    in.getString(name);
+    material m(name);
+    in.getValue(m.colorAmbient);
+    in.getValue(m.colorDiffuse);
+    in.getValue(m.colorSpecular);
+    in.getValue(m.opacity);
+    in.getValue(m.exponentSpecular);
+    materials.push_back(m);
+  }
+
+  std::vector<bsgPtr<drawableObj> > frontFaces, backFaces;
+  uint32_t nFaces = 0;
+  in.getValue(nFaces);
+  for (uint32_t i = 0; (i < nFaces) && in.good(); i++) {
+    bsgPtr<drawableObj> frontFace = new drawableObj();
+    if (!frontFace->readBinary(in)) return false;
+    frontFace->setTwoSided(_twoSided);
+    frontFaces.push_back(frontFace);
+
+    if (includeBack) {
+      bsgPtr<drawableObj> backFace = new drawableObj();
+      if (!backFace->readBinary(in)) return false;
+      backFaces.push_back(backFace);
+    }
+  }
+  if (!in.good()) return false;
+
+  _materials = materials;
+  for (size_t i = 0; i < frontFaces.size(); i++) {
+    bsgPtr<drawableObj> backFace;
+    if (_includeBackFace) backFace = backFaces[i];
+    _addFaces(frontFaces[i], backFace);
+  }
+  return true;
+}
+
+// A name for a temporary file that no other process will pick, even
+// on another machine writing to the same shared directory: the host
+// name, the process ID, and a count of the names made so far.  The
+// random names are no good for this, since processes started in the
+// same second get the same ones.
+static std::string uniqueSuffix() {
+
+  static int count = 0;
+  std::ostringstream out;
+
+#ifdef WIN32
+  char host[MAX_COMPUTERNAME_LENGTH + 1];
+  DWORD hostSize = sizeof(host);
+  if (!GetComputerNameA(host, &hostSize)) host[0] = '\0';
+  out << host << "." << GetCurrentProcessId();
+#else
+  char host[256];
+  if (gethostname(host, sizeof(host)) != 0) host[0] = '\0';
+  host[sizeof(host) - 1] = '\0';
+  out << host << "." << getpid();
+#endif
+
+  out << "." << count++ << ".tmp";
+  return out.str();
+}
+
+void drawableObjModel::_writeMeshFile(const std::string &meshFileName,
+                                      const std::vector<std::string> &sources) {
+
+  // Write to a file of our own, and rename it into place when it's
+  // complete, so that when several processes read the same model at
+  // once, none of them sees a half-written file.
+  std::string tempName = meshFileName + "." + uniqueSuffix();
+  std::ofstream stream(tempName.c_str(), std::ios::binary);
+  if (!stream) {
+    std::cerr << "** Caution: could not write " << meshFileName << std::endl;
+    return;
+  }
+  binaryWriter out(stream);
+
+  out.putBytes(meshFileMagic, sizeof(meshFileMagic));
+  out.putValue<uint32_t>(meshFileVersion);
+  out.putValue<uint32_t>(_includeBackFace);
+
+  out.putValue<uint32_t>(sources.size());
+  for (std::vector<std::string>::const_iterator it = sources.begin();
+       it != sources.end(); it++) {
+    uint64_t size = 0;
+    int64_t time = 0;
+    bool found = fileStamp(*it, size, time);
+    out.putString(*it);
+    out.putValue<uint32_t>(found);
+    out.putValue(size);
+    out.putValue(time);
+  }
+
+  out.putValue<uint32_t>(_materials.size());
+  for (std::vector<material>::const_iterator it = _materials.begin();
+       it != _materials.end(); it++) {
+    out.putString(it->getName());
+    out.putValue(it->colorAmbient);
+    out.putValue(it->colorDiffuse);
+    out.putValue(it->colorSpecular);
+    out.putValue(it->opacity);
+    out.putValue(it->exponentSpecular);
+  }
+
+  out.putValue<uint32_t>(_frontFaces.size());
+  for (size_t i = 0; i < _frontFaces.size(); i++) {
+    _frontFaces[i]->writeBinary(out);
+    if (_includeBackFace) _backFaces[i]->writeBinary(out);
+  }
+
+  stream.close();
+  if (!out.good()) {
+    std::cerr << "** Caution: could not write " << meshFileName << std::endl;
+    std::remove(tempName.c_str());
+    return;
+  }
+
+  // Some systems won't rename over an existing file.
+  if (std::rename(tempName.c_str(), meshFileName.c_str()) != 0) {
+    std::remove(meshFileName.c_str());
+    if (std::rename(tempName.c_str(), meshFileName.c_str()) != 0) {
+      std::cerr << "** Caution: could not write " << meshFileName << std::endl;
+      std::remove(tempName.c_str());
+    }
+  }
+}
+
+void drawableObjModel::_processObjFile() {
+
+  // A model that has been read already is shared, not read again.
+  // There is one cache entry for each material.
+  std::string frontKey = "obj:" + _fileName +
+    (_twoSided ? ":twoSided:" : ":front:");
+  std::string backKey = "obj:" + _fileName + ":back:";
+  for (int i = 0; ; i++) {
+    std::stringstream index;
+    index << i;
+    bsgPtr<drawableObj> frontFace, backFace;
+    if (!meshCache::find(frontKey + index.str(), frontFace)) break;
+    if (_includeBackFace &&
+        !meshCache::find(backKey + index.str(), backFace)) break;
+    _frontFaces.push_back(frontFace);
+    if (_includeBackFace) _backFaces.push_back(backFace);
+  }
+  std::map<std::string, objModelMaterials>::iterator shared =
+    objMaterials.find(_fileName);
+  if (!_frontFaces.empty() && (shared != objMaterials.end())) {
+    _materials = shared->second.materials;
+    shared->second.users++;
+    _sharingMaterials = true;
+    for (size_t i = 0; i < _frontFaces.size(); i++) {
+      addObject(_frontFaces[i]);
+      if (_includeBackFace) addObject(_backFaces[i]);
+    }
+    return;
+  }
+  _frontFaces.clear();
+  _backFaces.clear();
+
+  // Next best is the binary copy, if it's up to date.
+  std::string meshFileName = _meshFileName();
+  if (!meshFileName.empty() && _readMeshFile(meshFileName)) {
+    _shareMaterials();
+    return;
+  }
+
+  std::cout << "Processing: " << _fileName;
+  if (_twoSided) {
+    std::cout << " (two-sided)";
+  } else if (!_includeBackFace) {
+    std::cout << " (front face only)";
+  }
+  std::cout << " ..." << std::endl;
+
+  mappedFile file(_fileName);
+  if (!file.isOpen()) {
+    std::cerr << "** Caution: could not open " << _fileName << std::endl;
+    return;
+  }
+
+  // Split the file into pieces, one per thread, but not so many that
+  // starting the threads takes longer than reading.  Each piece
+  // starts at the beginning of a line.
+  size_t nChunks = _numThreads;
+  if (nChunks == 0) nChunks = std::max(1u, std::thread::hardware_concurrency());
+  nChunks = std::min(nChunks, file.size() / (1 << 20) + 1);
+
+  std::vector<objChunk> chunks(nChunks);
+  const char* p = file.begin();
+  for (size_t i = 0; i < nChunks; i++) {
+    chunks[i].begin = p;
+    if (i == nChunks - 1) {
+      p = file.end();
+    } else {
+      p = std::max(p, file.begin() + (file.size() * (i + 1)) / nChunks);
+      if (p > file.begin()) skipLine(--p, file.end());
+    }
+    chunks[i].end = p;
+  }
+
+  objModelData data;
+  data.includeBack = _includeBackFace;
+  forEachChunk(parseObjChunk, chunks);
+
+  // Read the materials, from the MTL files named in the OBJ file,
+  // which are relative to it.  Those files and the OBJ file are what
+  // the mesh file is made from.
+  std::vector<std::string> sources(1, absolutePath(_fileName));
+  std::string directory = directoryOf(_fileName);
+  for (std::vector<objChunk>::iterator it = chunks.begin();
+       it != chunks.end(); it++) {
+    for (std::vector<std::string>::iterator jt = it->libraries.begin();
+         jt != it->libraries.end(); jt++) {
+      sources.push_back(absolutePath(directory + *jt));
+      _readMtlFile(sources.back());
+    }
+  }
+  _shareMaterials();
+
+  // There is a mesh for each material, and one more, last, for the
+  // faces without one.  Those have no color, as before there were
+  // materials.
+  std::map<std::string, size_t> meshIndex;
+  for (size_t i = 0; i < _materials.size(); i++) {
+    meshIndex.insert(std::make_pair(_materials[i].getName(), i));
+  }
+  size_t nMeshes = _materials.size() + 1;
+
+  // Now that we know how much is in each piece, we know where it
+  // goes in the whole.  The faces are sorted into the meshes by
+  // material, keeping their order in the file.
+  size_t nVertices = 0, nNormals = 0, nUVs = 0;
+  std::vector<size_t> nTriangles(nMeshes, 0);
+  std::string materialName;
+  for (std::vector<objChunk>::iterator it = chunks.begin();
+       it != chunks.end(); it++) {
+    it->vertexOffset = nVertices;
+    it->normalOffset = nNormals;
+    it->uvOffset = nUVs;
+    nVertices += it->vertices.size();
+    nNormals += it->normals.size();
+    nUVs += it->uvs.size();
+
+    for (std::vector<objFaceGroup>::iterator jt = it->groups.begin();
+         jt != it->groups.end(); jt++) {
+      if (!jt->continued) materialName = jt->materialName;
+
+      std::map<std::string, size_t>::iterator found =
+        meshIndex.find(materialName);
+      if (found != meshIndex.end()) {
+        jt->mesh = found->second;
+      } else {
+        if (!materialName.empty() && !jt->faces.empty()) {
+          std::cerr << "** Caution: material " << materialName
+                    << " is not defined for " << _fileName << std::endl;
+          meshIndex[materialName] = nMeshes - 1;
+        }
+        jt->mesh = nMeshes - 1;
+      }
+
+      jt->triangleOffset = nTriangles[jt->mesh];
+      nTriangles[jt->mesh] += jt->faces.size() / 9;
+    }
+  }
+
+  data.vertices.resize(nVertices);
+  data.normals.resize(nNormals);
+  data.uvs.resize(nUVs);
+  forEachChunk(mergeObjChunk, chunks, &data);
+
+  // File parsing complete
+
+  data.front.resize(nMeshes);
+  if (_includeBackFace) data.back.resize(nMeshes);
+  for (size_t i = 0; i < nMeshes; i++) {
+    glm::vec4 color = (i < _materials.size()) ?
+      glm::vec4(_materials[i].colorDiffuse, _materials[i].opacity) :
+      glm::vec4(0.0f, 0.0f, 0.0f, 0.0f);
+    data.front[i].resize(3 * nTriangles[i]);
+    data.front[i].color = color;
+    if (_includeBackFace) {
+      data.back[i].resize(3 * nTriangles[i]);
+      data.back[i].color = color;
+    }
+  }
+  forEachChunk(unpackObjChunk, chunks, &data);
+
+  // Make the objects, in material order, so the compound draws one
+  // material after another.
+  for (size_t i = 0; i < nMeshes; i++) {
+    if (nTriangles[i] == 0) continue;
+
+    bsgPtr<drawableObj> frontFace = makeObjFace(data.front[i]);
+    frontFace->setTwoSided(_twoSided);
+    bsgPtr<drawableObj> backFace;
+    if (_includeBackFace) backFace = makeObjFace(data.back[i]);
+    _addFaces(frontFace, backFace);
+  }
+
+  if (!meshFileName.empty()) _writeMeshFile(meshFileName, sources);
+
+  std::cout << "... " << _fileName << " done." << std::endl;
 }
 }
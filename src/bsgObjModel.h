@@ -4,32 +4,55 @@
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <thread>
 
 namespace bsg {
 
-class drawableObjModel : public drawableCompound {
+/// \brief A read-only view of a whole file in memory.
+///
+/// The file is memory-mapped where that's possible, so the operating
+/// system reads it in as it is used and nothing is copied.  Otherwise
+/// it is read into a buffer.  Either way, the contents are not
+/// terminated with a zero, so stay between begin() and end().
+class mappedFile {
+ private:
+  const char* _data;
+  size_t _size;
+  bool _open;
 
-private:
-  const std::string &_fileName;
-  bsgPtr<drawableObj> _frontFace, _backFace;
+  // The file and mapping handles, if the file is mapped.  (Windows
+  // has two handles, Unix one.)
+  bool _mapped;
+  void* _fileHandle;
+  void* _mappingHandle;
+  int _fd;
 
-  // Do we *want* to see the interior?  Set this to false to show only
-  // the object exterior, a simple optimization for big models.
-  bool _includeBackFace;
+  // The contents, if the file could not be mapped.
+  std::vector<char> _buffer;
 
-  std::vector<std::string> split(const std::string line, const char separator);
+  // Not to be copied.
+  mappedFile(const mappedFile &);
+  mappedFile &operator=(const mappedFile &);
 
-  // So we can have two different constructors.
-  void _processObjFile();
-  
-public:
-  drawableObjModel(bsgPtr<shaderMgr> pShader, const std::string &fileName);
-  drawableObjModel(bsgPtr<shaderMgr> pShader,
-                   const std::string &fileName,
-                   const bool &back);
+ public:
+  mappedFile(const std::string &fileName);
+  ~mappedFile();
 
+  /// \brief Was the file opened successfully?
+  bool isOpen() const { return _open; };
+
+  const char* begin() const { return _data; };
+  const char* end() const { return _data + _size; };
+  size_t size() const { return _size; };
 };
 
+/// \brief The surface description of a part of an OBJ model.
+///
+/// These come from the MTL files named on the model's "mtllib" lines.
+/// The diffuse color and opacity become the color of the faces that
+/// use the material, given to the shader once for all of them (see
+/// drawableObj::setConstantColor()).  Texture maps are not read: the
+/// shader holds one texture for the whole model.
 class material {
  private:
   std::string _name;
@@ -50,9 +73,117 @@ class material {
     exponentSpecular(0.0f),
     textureIDAmbient(0),
     textureIDDiffuse(0),
-    textureIDSpecular(0) {};    
+    textureIDSpecular(0) {};
+
+  const std::string &getName() const { return _name; };
+};
+
+class drawableObjModel : public drawableCompound {
+
+private:
+  std::string _fileName;
+
+  // One object per material for the front faces, and another for the
+  // back, in the order the materials were defined.
+  std::vector<bsgPtr<drawableObj> > _frontFaces, _backFaces;
+
+  std::vector<material> _materials;
+
+  // Do we *want* to see the interior?  Set this to false to show only
+  // the object exterior, a simple optimization for big models.
+  bool _includeBackFace;
+
+  // Draw the front faces two-sided, with no back faces at all.
+  bool _twoSided;
+
+  // Is this model counted as a user of its file's shared materials?
+  // Not if the file couldn't be read.
+  bool _sharingMaterials;
+
+  // So we can have two different constructors.
+  void _processObjFile();
+
+  // Adds the materials in an MTL file to the list.
+  void _readMtlFile(const std::string &fileName);
+
+  // Makes this model's materials the ones found by the next model of
+  // the same file that comes out of the mesh cache.
+  void _shareMaterials();
+
+  // Adds the objects for one material to the compound and the cache.
+  void _addFaces(bsgPtr<drawableObj> frontFace,
+                 bsgPtr<drawableObj> backFace);
+
+  // The binary copy of the model.  Reading it fails if it is missing
+  // or older than any of the files it came from.
+  std::string _meshFileName() const;
+  bool _readMeshFile(const std::string &meshFileName);
+  void _writeMeshFile(const std::string &meshFileName,
+                      const std::vector<std::string> &sources);
+
+  static int _numThreads;
+  static bool _useMeshFiles;
+  static std::string _meshFileDirectory;
   
+public:
+  drawableObjModel(bsgPtr<shaderMgr> pShader, const std::string &fileName);
+  drawableObjModel(bsgPtr<shaderMgr> pShader,
+                   const std::string &fileName,
+                   const bool &back);
+
+  /// \brief Show the backs of the model without a copy of each face.
+  ///
+  /// A two-sided model has no back face objects.  Its front faces are
+  /// drawn two-sided instead (see drawableObj::setTwoSided()), which
+  /// takes half the memory, but needs a shader that lights back
+  /// faces, like textureShader.fp.  The back argument is ignored when
+  /// twoSided is true.
+  drawableObjModel(bsgPtr<shaderMgr> pShader,
+                   const std::string &fileName,
+                   const bool &back, const bool &twoSided);
+  ~drawableObjModel();
+  bool getTwoSided() const { return _twoSided; };
+
+  /// \brief How many threads to read a file with.
+  ///
+  /// A big file is read in pieces, all at once, in this many threads.
+  /// Zero, the default, means one for each core.
+  static void setNumThreads(const int &numThreads) {
+    _numThreads = numThreads; };
+  static int getNumThreads() { return _numThreads; };
+
+  /// \brief Keep binary copies of the models that are read.
+  ///
+  /// The first time an OBJ file is read, the welded and interleaved
+  /// meshes and the materials are written to a ".bsgmesh" file, next
+  /// to it or in the mesh file directory.  After that, the model is
+  /// read from that file, with no parsing, as long as the OBJ file
+  /// and its MTL files have the same sizes and times as when it was
+  /// written, and any MTL file that was missing then is still
+  /// missing.  Otherwise it is written again.  The files are named
+  /// by their full paths, so it doesn't matter what directory the
+  /// program is started in.  This is off by default, since it writes
+  /// files.
+  static void setMeshFiles(const bool &useMeshFiles) {
+    _useMeshFiles = useMeshFiles; };
+  static bool getMeshFiles() { return _useMeshFiles; };
+
+  /// \brief Where to put the binary copies of models.
+  ///
+  /// Empty, the default, means next to the OBJ files.  Use this if
+  /// the models are somewhere that can't be written.
+  static void setMeshFileDirectory(const std::string &directory) {
+    _meshFileDirectory = directory; };
+  static const std::string &getMeshFileDirectory() {
+    return _meshFileDirectory; };
+
+  /// \brief The materials named in the model's MTL files.
+  ///
+  /// The model is drawn one material at a time, in this order, with
+  /// any faces that use no material (or one that isn't defined) last.
+  const std::vector<material> &getMaterials() const { return _materials; };
 };
 
 
+
 }